@@ -14,6 +14,7 @@
 #ifdef __cplusplus
 #define __STDC_FORMAT_MACROS // C++ should define this for PRIu64
 #define __STDC_LIMIT_MACROS  // C++ should define this for UINT64_MAX
+#define __STDC_CONSTANT_MACROS // C++ should define this for UINT64_C
 #endif
 
 #include "moov.h"
@@ -39,6 +40,7 @@
 #include <limits.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_STDINT_H
 # include <stdint.h>
@@ -51,43 +53,226 @@
 // #define ftello _ftelli64
 // #define fseeko _fseeki64
 #include <windows.h>
+#include <process.h>
 #define DIR_SEPARATOR '\\'
 #endif
 
 #ifndef WIN32
 #include "dirent.h"
+#include <pthread.h>
 #define DIR_SEPARATOR '/'
 #endif
 
-struct bucket_t* bucket_init(enum bucket_type_t bucket_type)
+struct bucket_slab_t
+{
+  unsigned int used_;
+  unsigned int live_;
+  struct bucket_t buckets_[BUCKET_SLAB_SIZE];
+};
+
+// The slab that new buckets are taken from. A slab is freed when its last
+// bucket is freed. Fragments are built on several threads, so the slabs are
+// shared under a lock.
+static struct bucket_slab_t* bucket_slab_ = NULL;
+
+#ifdef WIN32
+// A critical section, like the manifest cache. It has no static initializer,
+// so it is initialized once on first use.
+static CRITICAL_SECTION bucket_slab_mutex_;
+static INIT_ONCE bucket_slab_once_ = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK bucket_slab_mutex_init(PINIT_ONCE once, PVOID param,
+                                            PVOID* context)
+{
+  InitializeCriticalSection(&bucket_slab_mutex_);
+  return TRUE;
+}
+
+static void bucket_slab_lock()
+{
+  InitOnceExecuteOnce(&bucket_slab_once_, bucket_slab_mutex_init, NULL, NULL);
+  EnterCriticalSection(&bucket_slab_mutex_);
+}
+
+static void bucket_slab_unlock()
+{
+  LeaveCriticalSection(&bucket_slab_mutex_);
+}
+#else
+static pthread_mutex_t bucket_slab_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+static void bucket_slab_lock()
+{
+  pthread_mutex_lock(&bucket_slab_mutex_);
+}
+
+static void bucket_slab_unlock()
+{
+  pthread_mutex_unlock(&bucket_slab_mutex_);
+}
+#endif
+
+static struct bucket_t* bucket_slab_alloc()
+{
+  struct bucket_t* bucket;
+
+  bucket_slab_lock();
+  if(bucket_slab_ == NULL || bucket_slab_->used_ == BUCKET_SLAB_SIZE)
+  {
+    // the previous slab is freed with its last bucket
+    bucket_slab_ =
+      (struct bucket_slab_t*)malloc(sizeof(struct bucket_slab_t));
+    bucket_slab_->used_ = 0;
+    bucket_slab_->live_ = 0;
+  }
+  bucket = &bucket_slab_->buckets_[bucket_slab_->used_++];
+  ++bucket_slab_->live_;
+  bucket->slab_ = bucket_slab_;
+  bucket_slab_unlock();
+
+  return bucket;
+}
+
+static void bucket_slab_free(struct bucket_t* bucket)
+{
+  struct bucket_slab_t* slab = bucket->slab_;
+
+  bucket_slab_lock();
+  if(--slab->live_ == 0)
+  {
+    if(slab == bucket_slab_)
+    {
+      bucket_slab_ = NULL;
+    }
+    free(slab);
+  }
+  bucket_slab_unlock();
+}
+
+static void bucket_link(struct bucket_t* bucket, enum bucket_type_t bucket_type)
 {
-  struct bucket_t* bucket = (struct bucket_t*)malloc(sizeof(struct bucket_t));
+  bucket->shared_ = NULL;
   bucket->type_ = bucket_type;
+  bucket->buf_ = NULL;
+  bucket->offset_ = 0;
+  bucket->size_ = 0;
   bucket->prev_ = bucket;
   bucket->next_ = bucket;
+}
+
+struct bucket_t* bucket_init(enum bucket_type_t bucket_type)
+{
+  struct bucket_t* bucket = bucket_slab_alloc();
+  bucket_link(bucket, bucket_type);
 
   return bucket;
 }
 
+struct bucket_shared_t
+{
+  unsigned int refcount_;
+  void* buf_;
+};
+
+extern struct bucket_shared_t* bucket_shared_init(void* buf)
+{
+  struct bucket_shared_t* shared =
+    (struct bucket_shared_t*)malloc(sizeof(struct bucket_shared_t));
+  shared->refcount_ = 1;
+  shared->buf_ = buf;
+
+  return shared;
+}
+
+// The reference count is shared between threads as well
+extern void bucket_shared_exit(struct bucket_shared_t* shared)
+{
+  unsigned int refcount;
+
+  bucket_slab_lock();
+  refcount = --shared->refcount_;
+  bucket_slab_unlock();
+
+  if(refcount == 0)
+  {
+    free(shared->buf_);
+    free(shared);
+  }
+}
+
 static void bucket_exit(struct bucket_t* bucket)
 {
-  switch(bucket->type_)
+  if(bucket->shared_)
+  {
+    bucket_shared_exit(bucket->shared_);
+  }
+
+  // the data of a memory bucket is allocated with the bucket
+  if(bucket->slab_)
+  {
+    bucket_slab_free(bucket);
+  }
+  else
+  {
+    free(bucket);
+  }
+}
+
+// A memory bucket with room for size bytes of data
+static struct bucket_t* bucket_alloc_memory(uint64_t size)
+{
+  struct bucket_t* bucket;
+  if(size <= BUCKET_INLINE_SIZE)
+  {
+    bucket = bucket_init(BUCKET_TYPE_MEMORY);
+    bucket->buf_ = bucket->inline_;
+  }
+  else
   {
-  case BUCKET_TYPE_MEMORY:
-    free(bucket->buf_);
-    break;
-  case BUCKET_TYPE_FILE:
-    break;
+    bucket = (struct bucket_t*)malloc(sizeof(struct bucket_t) + (size_t)size);
+    bucket_link(bucket, BUCKET_TYPE_MEMORY);
+    bucket->slab_ = NULL;
+    bucket->buf_ = bucket + 1;
   }
-  free(bucket);
+  bucket->size_ = size;
+  return bucket;
 }
 
 extern struct bucket_t* bucket_init_memory(void const* buf, uint64_t size)
 {
-  struct bucket_t* bucket = bucket_init(BUCKET_TYPE_MEMORY);
-  bucket->buf_ = malloc((size_t)size);
+  struct bucket_t* bucket = bucket_alloc_memory(size);
   memcpy(bucket->buf_, buf, (size_t)size);
+  return bucket;
+}
+
+extern struct bucket_t* bucket_init_reference(void const* buf, uint64_t size)
+{
+  struct bucket_t* bucket = bucket_init(BUCKET_TYPE_MEMORY);
+  bucket->buf_ = (void*)buf;
+  bucket->size_ = size;
+  return bucket;
+}
+
+extern struct bucket_t* bucket_init_shared(struct bucket_shared_t* shared,
+                                           uint64_t offset, uint64_t size)
+{
+  struct bucket_t* bucket = bucket_init(BUCKET_TYPE_MEMORY);
+  bucket->buf_ = (unsigned char*)shared->buf_ + offset;
   bucket->size_ = size;
+  bucket->shared_ = shared;
+
+  bucket_slab_lock();
+  ++shared->refcount_;
+  bucket_slab_unlock();
+
+  return bucket;
+}
+
+extern struct bucket_t* bucket_init_owned(void* buf, uint64_t size)
+{
+  struct bucket_shared_t* shared = bucket_shared_init(buf);
+  struct bucket_t* bucket = bucket_init_shared(shared, 0, size);
+  bucket_shared_exit(shared);
   return bucket;
 }
 
@@ -123,6 +308,30 @@ extern void bucket_insert_head(struct bucket_t** head, struct bucket_t* bucket)
   *head = bucket;
 }
 
+extern void buckets_insert_tail(struct bucket_t** head,
+                                struct bucket_t* buckets)
+{
+  struct bucket_t* tail;
+
+  if(buckets == NULL)
+  {
+    return;
+  }
+
+  if(*head == NULL)
+  {
+    *head = buckets;
+    return;
+  }
+
+  // splice the circular list [buckets, tail] before the head
+  tail = buckets->prev_;
+  (*head)->prev_->next_ = buckets;
+  buckets->prev_ = (*head)->prev_;
+  tail->next_ = *head;
+  (*head)->prev_ = tail;
+}
+
 static void bucket_remove(struct bucket_t* bucket)
 {
   struct bucket_t* prev = bucket->prev_;
@@ -131,6 +340,84 @@ static void bucket_remove(struct bucket_t* bucket)
   bucket->next_->prev_ = prev;
 }
 
+static int bucket_is_small(struct bucket_t const* bucket)
+{
+  return bucket->type_ == BUCKET_TYPE_MEMORY &&
+         bucket->size_ < BUCKET_COALESCE_SIZE;
+}
+
+extern void buckets_coalesce(struct bucket_t** head)
+{
+  struct bucket_t* bucket = *head;
+
+  if(bucket == NULL)
+  {
+    return;
+  }
+
+  for(;;)
+  {
+    struct bucket_t* next = bucket->next_;
+    if(next == *head)
+    {
+      break;
+    }
+
+    // contiguous file ranges
+    if(bucket->type_ == BUCKET_TYPE_FILE && next->type_ == BUCKET_TYPE_FILE &&
+       bucket->offset_ + bucket->size_ == next->offset_)
+    {
+      bucket->size_ += next->size_;
+      bucket_remove(next);
+      bucket_exit(next);
+      continue;
+    }
+
+    // a run of small memory buckets is copied into a single bucket
+    if(bucket_is_small(bucket) && bucket_is_small(next) &&
+       bucket->size_ + next->size_ <= BUCKET_WRITER_BLOCK_SIZE)
+    {
+      struct bucket_t* last = next;
+      struct bucket_t* merged;
+      unsigned char* p;
+      uint64_t size = bucket->size_ + next->size_;
+
+      while(last->next_ != *head && bucket_is_small(last->next_) &&
+            size + last->next_->size_ <= BUCKET_WRITER_BLOCK_SIZE)
+      {
+        last = last->next_;
+        size += last->size_;
+      }
+
+      merged = bucket_alloc_memory(size);
+      p = (unsigned char*)merged->buf_;
+      bucket_insert_after(bucket->prev_, merged);
+      if(bucket == *head)
+      {
+        *head = merged;
+      }
+      for(;;)
+      {
+        int is_last = bucket == last;
+        next = bucket->next_;
+        memcpy(p, bucket->buf_, (size_t)bucket->size_);
+        p += bucket->size_;
+        bucket_remove(bucket);
+        bucket_exit(bucket);
+        if(is_last)
+        {
+          break;
+        }
+        bucket = next;
+      }
+      bucket = merged;
+      continue;
+    }
+
+    bucket = next;
+  }
+}
+
 extern void buckets_exit(struct bucket_t* buckets)
 {
   struct bucket_t* bucket = buckets;
@@ -142,6 +429,222 @@ extern void buckets_exit(struct bucket_t* buckets)
   } while(bucket != buckets);
 }
 
+extern unsigned int buckets_iovec(struct bucket_t const* buckets,
+                                  struct bucket_iovec_t** iov, uint64_t* size)
+{
+  struct bucket_t const* bucket = buckets;
+  unsigned int iovs = 0;
+  unsigned int capacity = 0;
+
+  *iov = NULL;
+  *size = 0;
+
+  if(bucket == NULL)
+  {
+    return 0;
+  }
+
+  do
+  {
+    struct bucket_iovec_t* entry;
+    if(iovs == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      *iov = (struct bucket_iovec_t*)
+        realloc(*iov, capacity * sizeof(struct bucket_iovec_t));
+    }
+    entry = &(*iov)[iovs++];
+    entry->type_ = bucket->type_;
+    entry->base_ = bucket->type_ == BUCKET_TYPE_MEMORY ? bucket->buf_ : NULL;
+    entry->offset_ = bucket->type_ == BUCKET_TYPE_FILE ? bucket->offset_ : 0;
+    entry->size_ = bucket->size_;
+    *size += bucket->size_;
+    bucket = bucket->next_;
+  } while(bucket != buckets);
+
+  return iovs;
+}
+
+extern void bucket_writer_init(struct bucket_writer_t* writer,
+                               struct bucket_t** buckets)
+{
+  writer->buckets_ = buckets;
+  writer->p_ = writer->block_;
+}
+
+extern void bucket_writer_flush(struct bucket_writer_t* writer)
+{
+  if(writer->p_ != writer->block_)
+  {
+    bucket_insert_tail(writer->buckets_, bucket_init_memory(writer->block_,
+                       writer->p_ - writer->block_));
+    writer->p_ = writer->block_;
+  }
+}
+
+extern void bucket_writer_write(struct bucket_writer_t* writer,
+                                char const* data, unsigned int size)
+{
+  while(size)
+  {
+    unsigned int left = (unsigned int)
+      (writer->block_ + BUCKET_WRITER_BLOCK_SIZE - writer->p_);
+    unsigned int bytes = size < left ? size : left;
+    memcpy(writer->p_, data, bytes);
+    writer->p_ += bytes;
+    data += bytes;
+    size -= bytes;
+    if(writer->p_ == writer->block_ + BUCKET_WRITER_BLOCK_SIZE)
+    {
+      bucket_writer_flush(writer);
+    }
+  }
+}
+
+extern void bucket_writer_puts(struct bucket_writer_t* writer,
+                               char const* str)
+{
+  bucket_writer_write(writer, str, (unsigned int)strlen(str));
+}
+
+// converts two digits at a time, without the division of sprintf's %llu
+extern void bucket_writer_putu(struct bucket_writer_t* writer, uint64_t value)
+{
+  static const char digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char buffer[20];
+  char* p = buffer + sizeof(buffer);
+
+  while(value >= 100)
+  {
+    unsigned int i = (unsigned int)(value % 100) * 2;
+    value /= 100;
+    *--p = digits[i + 1];
+    *--p = digits[i];
+  }
+  if(value >= 10)
+  {
+    unsigned int i = (unsigned int)value * 2;
+    *--p = digits[i + 1];
+    *--p = digits[i];
+  }
+  else
+  {
+    *--p = (char)('0' + value);
+  }
+
+  bucket_writer_write(writer, p, (unsigned int)(buffer + sizeof(buffer) - p));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct worker_args_t
+{
+  mp4_worker_t worker_;
+  void* arg_;
+  unsigned int index_;
+  unsigned int workers_;
+  int result_;
+};
+
+#ifdef WIN32
+static unsigned __stdcall worker_thread(void* arg)
+#else
+static void* worker_thread(void* arg)
+#endif
+{
+  struct worker_args_t* args = (struct worker_args_t*)arg;
+  args->result_ = args->worker_(args->arg_, args->index_, args->workers_);
+
+  return 0;
+}
+
+extern int mp4_run_workers(unsigned int workers, mp4_worker_t worker,
+                           void* arg)
+{
+  int result = 1;
+  unsigned int i;
+  struct worker_args_t* args;
+#ifdef WIN32
+  HANDLE* threads;
+#else
+  pthread_t* threads;
+#endif
+
+  if(workers <= 1)
+  {
+    return worker(arg, 0, 1);
+  }
+
+  args = (struct worker_args_t*)malloc(workers * sizeof(struct worker_args_t));
+#ifdef WIN32
+  threads = (HANDLE*)malloc(workers * sizeof(HANDLE));
+#else
+  threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+#endif
+
+  for(i = 0; i != workers; ++i)
+  {
+    args[i].worker_ = worker;
+    args[i].arg_ = arg;
+    args[i].index_ = i;
+    args[i].workers_ = workers;
+    args[i].result_ = 0;
+  }
+
+  // the calling thread runs the first worker itself
+  for(i = 1; i != workers; ++i)
+  {
+#ifdef WIN32
+    threads[i] = (HANDLE)_beginthreadex(NULL, 0, &worker_thread, &args[i],
+                                        0, NULL);
+    if(threads[i] == 0)
+#else
+    if(pthread_create(&threads[i], NULL, &worker_thread, &args[i]) != 0)
+#endif
+    {
+      // no more threads available, run the remaining workers inline
+      unsigned int j;
+      for(j = i; j != workers; ++j)
+      {
+        worker_thread(&args[j]);
+      }
+      break;
+    }
+  }
+  worker_thread(&args[0]);
+
+  {
+    unsigned int started = i;
+    for(i = 1; i != started; ++i)
+    {
+#ifdef WIN32
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+#else
+      pthread_join(threads[i], NULL);
+#endif
+    }
+  }
+
+  for(i = 0; i != workers; ++i)
+  {
+    if(!args[i].result_)
+    {
+      result = 0;
+    }
+  }
+
+  free(threads);
+  free(args);
+
+  return result;
+}
+
 /* Returns true when the test string is a prefix of the input */
 int starts_with(const char* input, const char* test)
 {
@@ -204,14 +707,45 @@ static void moov_shift_offsets(struct moov_t* moov, int64_t offset)
 // fixed:
 // first pass we get the new aligned times for traks with an stss present
 // second pass is for traks without an stss
+//
+// In precise mode every trak is cut at the requested times instead. The start
+// still goes back to the keyframe the samples depend on (the edit list of the
+// output skips the samples before the start), the end keeps the samples that
+// are presented before the end.
+static unsigned int trak_get_precise_end(struct trak_t const* trak,
+                                         unsigned int end, uint64_t end_time)
+{
+  unsigned int sample;
+
+  // the reordered samples (e.g. B-frames) up to the next keyframe that are
+  // presented before the end
+  for(sample = end; sample != trak->samples_size_; ++sample)
+  {
+    struct samples_t const* s = &trak->samples_[sample];
+    if(s->is_ss_)
+    {
+      break;
+    }
+    if(s->pts_ + s->cto_ < end_time)
+    {
+      end = sample + 1;
+    }
+  }
+
+  return end;
+}
+
 static int get_aligned_start_and_end(struct mp4_context_t const* mp4_context,
                                      unsigned int start, unsigned int end,
+                                     int precise, int trickplay,
                                      unsigned int* trak_sample_start,
                                      unsigned int* trak_sample_end)
 {
   unsigned int pass;
   struct moov_t* moov = mp4_context->moov;
   long moov_time_scale = moov->mvhd_->timescale_;
+  unsigned int requested_start = start;
+  unsigned int requested_end = end;
 
   for(pass = 0; pass != 2; ++pass)
   {
@@ -221,13 +755,25 @@ static int get_aligned_start_and_end(struct mp4_context_t const* mp4_context,
       struct trak_t* trak = moov->traks_[i];
       struct stbl_t* stbl = trak->mdia_->minf_->stbl_;
       long trak_time_scale = trak->mdia_->mdhd_->timescale_;
+      // trick play reduced the video tracks to their keyframes (without an
+      // 'stss'), which still snap to the keyframe at or before the time
+      int keyframes_only = trickplay &&
+        trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e');
+      int has_keyframes = stbl->stss_ || keyframes_only;
 
       // 1st pass: stss present, 2nd pass: no stss present
-      if(pass == 0 && !stbl->stss_)
+      if(pass == 0 && !has_keyframes)
         continue;
-      if(pass == 1 && stbl->stss_)
+      if(pass == 1 && has_keyframes)
         continue;
 
+      // the traks aren't aligned to each other in precise mode
+      if(precise)
+      {
+        start = requested_start;
+        end = requested_end;
+      }
+
       // get start
       if(start == 0)
       {
@@ -235,8 +781,16 @@ static int get_aligned_start_and_end(struct mp4_context_t const* mp4_context,
       }
       else
       {
-        start = stts_get_sample(stbl->stts_,
-          moov_time_to_trak_time(start, moov_time_scale, trak_time_scale));
+        uint64_t start_time =
+          moov_time_to_trak_time(start, moov_time_scale, trak_time_scale);
+        start = stts_get_sample(stbl->stts_, start_time);
+
+        // the sample that is presented at the start
+        if((precise || keyframes_only) && start != 0 &&
+           stts_get_time(stbl->stts_, start) > start_time)
+        {
+          --start;
+        }
 
         MP4_INFO("start=%u (trac time)\n", start);
         MP4_INFO("start=%.2f (seconds)\n",
@@ -259,8 +813,15 @@ static int get_aligned_start_and_end(struct mp4_context_t const* mp4_context,
       }
       else
       {
-        end = stts_get_sample(stbl->stts_,
-          moov_time_to_trak_time(end, moov_time_scale, trak_time_scale));
+        uint64_t end_time =
+          moov_time_to_trak_time(end, moov_time_scale, trak_time_scale);
+        end = stts_get_sample(stbl->stts_, end_time);
+        // the keyframe that is presented at the end is left out
+        if(keyframes_only && !precise && end != 0 &&
+           stts_get_time(stbl->stts_, end) > end_time)
+        {
+          --end;
+        }
         MP4_INFO("end=%u (trac time)\n", end);
         MP4_INFO("end=%.2f (seconds)\n",
           stts_get_time(stbl->stts_, end) / (float)trak_time_scale);
@@ -269,6 +830,10 @@ static int get_aligned_start_and_end(struct mp4_context_t const* mp4_context,
         {
           end = trak->samples_size_;
         }
+        else if(precise)
+        {
+          end = trak_get_precise_end(trak, end, end_time);
+        }
         else
         {
           end = stbl_get_nearest_keyframe(stbl, end + 1) - 1;
@@ -308,18 +873,119 @@ struct mp4_split_options_t* mp4_split_options_init()
   options->adaptive = 0;
   options->fragments = 0;
   options->manifest = 0;
+  options->manifest_version = 1;
   options->fragment_type = FRAGMENT_TYPE_UNKNOWN;
+  options->fragment_language[0] = '\0';
   options->output_format = OUTPUT_FORMAT_MP4;
   options->fragment_start = 0;
   options->seconds = 0;
   options->byte_offsets = 0;
+  options->byte_times = 0;
+  options->precise = 0;
+  options->trickplay = 0;
+  options->compress_moov = 0;
+  options->moov_cache = 0;
+  options->tracks = 0;
+  options->track_types = 0;
+  options->pace = 0.0;
+  options->burst = 10.0;
+  options->index_times_only = 0;
+  options->threads = 1;
+  options->interleave = 0;
+  options->fragment_duration = 0.0;
+  options->min_fragment_duration = 0.0;
+  options->sidx = 0;
+  options->cmaf_track_id = 0;
+  options->cmaf_init = 0;
+  options->cmaf_time = 0;
+  options->hls_segment = -1;
+  options->hls_playlist = 0;
+  options->chunk_duration = 0.0;
+  options->sink = 0;
+  options->sink_arg = 0;
 
   return options;
 }
 
-int mp4_split_options_set(struct mp4_split_options_t* options,
-                          const char* args_data,
-                          unsigned int args_size)
+// The names of the streams in the manifest with a language, e.g. audio_nld
+static enum fragment_type_t fragment_name_to_type(char const* name,
+                                                  size_t len, char* language)
+{
+  enum fragment_type_t type = FRAGMENT_TYPE_UNKNOWN;
+  size_t type_len = 0;
+
+  if(len == 9 && !strncmp("audio_", name, 6))
+  {
+    type = FRAGMENT_TYPE_AUDIO;
+    type_len = 6;
+  } else
+  if(len == 9 && !strncmp("video_", name, 6))
+  {
+    type = FRAGMENT_TYPE_VIDEO;
+    type_len = 6;
+  } else
+  if(len == 8 && !strncmp("text_", name, 5))
+  {
+    type = FRAGMENT_TYPE_TEXT;
+    type_len = 5;
+  }
+
+  if(type != FRAGMENT_TYPE_UNKNOWN)
+  {
+    memcpy(language, name + type_len, 3);
+    language[3] = '\0';
+  }
+
+  return type;
+}
+
+// A comma separated list of track_IDs and track types (audio, video, text)
+static int track_selection_set(struct mp4_split_options_t* options,
+                               char const* first)
+{
+  while(*first)
+  {
+    char const* last = strchr(first, ',');
+    size_t len = last ? (size_t)(last - first) : strlen(first);
+
+    if(len == 5 && !strncmp("audio", first, len))
+    {
+      options->track_types |= 1 << FRAGMENT_TYPE_AUDIO;
+    } else
+    if(len == 5 && !strncmp("video", first, len))
+    {
+      options->track_types |= 1 << FRAGMENT_TYPE_VIDEO;
+    } else
+    if(len == 4 && !strncmp("text", first, len))
+    {
+      options->track_types |= 1 << FRAGMENT_TYPE_TEXT;
+    }
+    else
+    {
+      unsigned int track_id = atoi(first);
+      unsigned int max_ids =
+        sizeof(options->track_ids) / sizeof(options->track_ids[0]);
+      if(track_id == 0 || options->tracks == max_ids)
+      {
+        return 0;
+      }
+      options->track_ids[options->tracks] = track_id;
+      ++options->tracks;
+    }
+
+    first += len;
+    if(*first == ',')
+    {
+      ++first;
+    }
+  }
+
+  return options->tracks || options->track_types;
+}
+
+int mp4_split_options_set(struct mp4_split_options_t* options,
+                          const char* args_data,
+                          unsigned int args_size)
 {
   int result = 1;
 
@@ -401,6 +1067,96 @@ int mp4_split_options_set(struct mp4_split_options_t* options,
             if(!strncmp("manifest", key, key_len))
             {
               options->manifest = 1;
+            } else
+            if(!strncmp("manifest_version", key, key_len))
+            {
+              options->manifest_version = atoi(valz);
+            } else
+            if(!strncmp("interleave", key, key_len))
+            {
+              options->interleave = atoi(valz);
+            } else
+            if(!strncmp("fragment_duration", key, key_len))
+            {
+              options->fragment_duration = (float)(strtod(valz, NULL));
+            } else
+            if(!strncmp("min_fragment_duration", key, key_len))
+            {
+              options->min_fragment_duration = (float)(strtod(valz, NULL));
+            } else
+            if(!strncmp("sidx", key, key_len))
+            {
+              options->sidx = atoi(valz);
+            } else
+            if(!strncmp("cmaf_init", key, key_len))
+            {
+              options->cmaf_track_id = atoi(valz);
+              options->cmaf_init = 1;
+            } else
+            if(!strncmp("cmaf_segment", key, key_len))
+            {
+              options->cmaf_track_id = atoi(valz);
+            } else
+            if(!strncmp("cmaf_time", key, key_len))
+            {
+              options->cmaf_time = atoi64(valz);
+            } else
+            if(!strncmp("hls_segment", key, key_len))
+            {
+              options->hls_segment = atoi(valz);
+            } else
+            if(!strncmp("hls_playlist", key, key_len))
+            {
+              options->hls_playlist = 1;
+              options->manifest = 1;
+            } else
+            if(!strncmp("chunk_duration", key, key_len))
+            {
+              options->chunk_duration = (float)(strtod(valz, NULL));
+            } else
+            if(!strncmp("pace", key, key_len))
+            {
+              options->pace = (float)(strtod(valz, NULL));
+            } else
+            if(!strncmp("burst", key, key_len))
+            {
+              options->burst = (float)(strtod(valz, NULL));
+            } else
+            if(!strncmp("text", key, key_len))
+            {
+              options->fragments = 1;
+              options->fragment_type = FRAGMENT_TYPE_TEXT;
+              options->fragment_start = atoi64(valz);
+            } else
+            if(!strncmp("tracks", key, key_len))
+            {
+              if(!track_selection_set(options, valz))
+              {
+                result = 0;
+              }
+            } else
+            if(!strncmp("precise", key, key_len))
+            {
+              options->precise = atoi(valz);
+            } else
+            if(!strncmp("trickplay", key, key_len))
+            {
+              options->trickplay = atoi(valz);
+            } else
+            if(!strncmp("cmov", key, key_len))
+            {
+              options->compress_moov = atoi(valz);
+            }
+            else
+            {
+              enum fragment_type_t type =
+                fragment_name_to_type(key, key_len, options->fragment_language);
+              if(type != FRAGMENT_TYPE_UNKNOWN)
+              {
+                options->fragments = 1;
+                options->fragment_type = type;
+                options->fragment_start = atoi64(valz);
+              }
             }
             free(valz);
           }
@@ -454,17 +1210,148 @@ void mp4_split_options_exit(struct mp4_split_options_t* options)
   {
     free(options->byte_offsets);
   }
+  if(options->byte_times)
+  {
+    free(options->byte_times);
+  }
 
   free(options);
 }
 
+// the longest %g, e.g. -1.79769e+308
+#define FORMAT_G_SIZE 13
+
+int mp4_split_options_fragment_query(struct mp4_split_options_t const* options,
+                                     char const* first,
+                                     char const* separator,
+                                     char* query, size_t size)
+{
+  char* p = query;
+
+  *p = '\0';
+  if(options && options->fragment_duration > 0.0)
+  {
+    size_t bound = strlen(first) + sizeof("fragment_duration=") +
+                   FORMAT_G_SIZE;
+    if(options->min_fragment_duration > 0.0)
+    {
+      bound += strlen(separator) + sizeof("min_fragment_duration=") +
+               FORMAT_G_SIZE;
+    }
+    if(bound > size)
+    {
+      return -1;
+    }
+
+    p += sprintf(p, "%sfragment_duration=%g",
+                 first, options->fragment_duration);
+    if(options->min_fragment_duration > 0.0)
+    {
+      p += sprintf(p, "%smin_fragment_duration=%g",
+                   separator, options->min_fragment_duration);
+    }
+  }
+
+  return (int)(p - query);
+}
+
+void mp4_pace_mark(struct mp4_split_options_t* options, double time,
+                   uint64_t filepos)
+{
+  unsigned int entries = (unsigned int)options->seconds;
+
+  if(options->pace <= 0.0f)
+  {
+    return;
+  }
+
+  // keep the times increasing when the tracks aren't interleaved
+  if(entries && time < options->byte_times[entries - 1])
+  {
+    time = options->byte_times[entries - 1];
+  }
+
+  options->byte_offsets = (uint64_t*)
+    realloc(options->byte_offsets, (entries + 1) * sizeof(uint64_t));
+  options->byte_times = (double*)
+    realloc(options->byte_times, (entries + 1) * sizeof(double));
+  options->byte_offsets[entries] = filepos;
+  options->byte_times[entries] = time;
+  ++options->seconds;
+}
+
+unsigned int mp4_pace_delay(struct mp4_split_options_t const* options,
+                            uint64_t filepos, uint64_t elapsed_ms)
+{
+  uint64_t const* byte_offsets = options->byte_offsets;
+  double const* byte_times = options->byte_times;
+  uint64_t prev;
+  double prev_time;
+  double time;
+  double media_time;
+  double send_time;
+  int second;
+
+  if(options->pace <= 0.0f || byte_offsets == NULL)
+  {
+    return 0;
+  }
+
+  // the first entry that needs the output up to filepos
+  for(second = 0; second != options->seconds; ++second)
+  {
+    if(byte_offsets[second] >= filepos)
+    {
+      break;
+    }
+  }
+  if(second == 0 || second == options->seconds)
+  {
+    return 0;
+  }
+
+  // interpolate between the entries
+  prev = byte_offsets[second - 1];
+  prev_time = byte_times ? byte_times[second - 1] : second - 1;
+  time = byte_times ? byte_times[second] : second;
+  media_time = prev_time + (time - prev_time) *
+    (double)(filepos - prev) / (double)(byte_offsets[second] - prev);
+
+  send_time = (media_time - options->burst) * 1000.0 / options->pace;
+  if(send_time <= (double)elapsed_ms)
+  {
+    return 0;
+  }
+
+  return (unsigned int)(send_time - (double)elapsed_ms);
+}
+
+static struct mp4_files_t* mp4_files_add(unsigned int* files,
+                                          struct mp4_files_t** filespecs,
+                                          char const* dir, size_t dir_len,
+                                          char const* name)
+{
+  struct mp4_files_t* filespec;
+
+  *filespecs = (struct mp4_files_t*)
+    realloc(*filespecs, (*files + 1) * sizeof(struct mp4_files_t));
+  filespec = &(*filespecs)[*files];
+  ++(*files);
+
+  filespec->name_ = (char*)malloc(dir_len + strlen(name) + 1);
+  filespec->name_[0] = '\0';
+  strncat(filespec->name_, dir, dir_len);
+  strcat(filespec->name_, name);
+  filespec->size_ = 0;
+  filespec->mtime_ = 0;
+
+  return filespec;
+}
+
 extern int mp4_scanfiles(const char* input_file,
                          unsigned int* files,
-                         struct mp4_files_t* filespecs)
+                         struct mp4_files_t** filespecs)
 {
-  size_t max_files = *files;
-  *files = 0;
-
   // the name is 'video.mp4'. Scan the directory ./video.ism/video_*.ismv
   if(ends_with(input_file, ".mp4") || ends_with(input_file, ".ism"))
   {
@@ -502,19 +1389,11 @@ extern int mp4_scanfiles(const char* input_file,
         do
         {
           {
-            size_t len = dir_end - filename + strlen(ffd.cFileName);
-            if((*files) == max_files)
-            {
-              break;
-            }
-
-            filespecs[*files].name_ = (char*)malloc(len + 1);
-            filespecs[*files].name_[0] = '\0';
-            strncat(filespecs[*files].name_, filename, dir_end - filename);
-            strcat(filespecs[*files].name_, ffd.cFileName);
-//            filespecs[*files].size_ =
-//              ((uint64_t)(ffd.nFileSizeHigh) << 32) + ffd.nFileSizeLow;
-            ++(*files);
+            struct mp4_files_t* filespec =
+              mp4_files_add(files, filespecs, filename, dir_end - filename,
+                            ffd.cFileName);
+            filespec->size_ =
+              ((uint64_t)(ffd.nFileSizeHigh) << 32) + ffd.nFileSizeLow;
           }
         } while(FindNextFile(hFind, &ffd) != 0);
         FindClose(hFind);
@@ -532,18 +1411,8 @@ extern int mp4_scanfiles(const char* input_file,
           if(/*starts_with(pEntry->d_name, name_start, ext_start - name_start && */
               ends_with(pEntry->d_name, ".ismv"))
           {
-            size_t len = dir_end - filename + strlen(pEntry->d_name);
-
-            if((*files) == max_files)
-            {
-              break;
-            }
-
-            filespecs[*files].name_ = malloc(len + 1);
-            filespecs[*files].name_[0] = '\0';
-            strncat(filespecs[*files].name_, filename, dir_end - filename);
-            strcat(filespecs[*files].name_, pEntry->d_name);
-            ++(*files);
+            mp4_files_add(files, filespecs, filename, dir_end - filename,
+                          pEntry->d_name);
           }
         }
       }
@@ -557,6 +1426,582 @@ extern int mp4_scanfiles(const char* input_file,
   return 1;
 }
 
+struct open_files_t
+{
+  struct mp4_files_t const* filespecs_;
+  unsigned int files_;
+  int mfra_only_;
+  int verbose_;
+  struct mp4_context_t** mp4_context_;
+};
+
+static int open_files_worker(void* arg, unsigned int worker,
+                             unsigned int workers)
+{
+  struct open_files_t* open_files = (struct open_files_t*)arg;
+  int result = 1;
+  unsigned int i;
+
+  for(i = worker; i < open_files->files_; i += workers)
+  {
+    struct mp4_files_t const* filespec = &open_files->filespecs_[i];
+    open_files->mp4_context_[i] = mp4_open(filespec->name_, filespec->size_,
+      open_files->mfra_only_, open_files->verbose_);
+    if(open_files->mp4_context_[i] == NULL)
+    {
+      result = 0;
+    }
+  }
+
+  return result;
+}
+
+extern int mp4_open_files(struct mp4_files_t const* filespecs,
+                          unsigned int files, int mfra_only, int verbose,
+                          unsigned int threads,
+                          struct mp4_context_t** mp4_context)
+{
+  struct open_files_t open_files;
+  unsigned int i;
+
+  for(i = 0; i != files; ++i)
+  {
+    mp4_context[i] = NULL;
+  }
+
+  open_files.filespecs_ = filespecs;
+  open_files.files_ = files;
+  open_files.mfra_only_ = mfra_only;
+  open_files.verbose_ = verbose;
+  open_files.mp4_context_ = mp4_context;
+
+  return mp4_run_workers(threads < files ? threads : files,
+                         open_files_worker, &open_files);
+}
+
+extern int mp4_stat_files(struct mp4_files_t* filespecs, unsigned int files)
+{
+  int result = 1;
+  unsigned int i;
+
+  for(i = 0; i != files; ++i)
+  {
+#ifdef WIN32
+    WIN32_FILE_ATTRIBUTE_DATA status;
+    if(!GetFileAttributesExA(filespecs[i].name_, GetFileExInfoStandard,
+                             &status))
+#else
+    struct stat status;
+    if(stat(filespecs[i].name_, &status))
+#endif
+    {
+      filespecs[i].size_ = 0;
+      filespecs[i].mtime_ = 0;
+      result = 0;
+      continue;
+    }
+    // The modification time has a sub-second resolution, so that a file that
+    // is rewritten within the same second with the same size is still seen
+    // as changed.
+#ifdef WIN32
+    filespecs[i].size_ =
+      ((uint64_t)status.nFileSizeHigh << 32) | status.nFileSizeLow;
+    filespecs[i].mtime_ =
+      ((uint64_t)status.ftLastWriteTime.dwHighDateTime << 32) |
+      status.ftLastWriteTime.dwLowDateTime;
+#else
+    filespecs[i].size_ = status.st_size;
+#if defined(__APPLE__)
+    filespecs[i].mtime_ = (uint64_t)status.st_mtimespec.tv_sec * 1000000000 +
+                          status.st_mtimespec.tv_nsec;
+#else
+    filespecs[i].mtime_ = (uint64_t)status.st_mtim.tv_sec * 1000000000 +
+                          status.st_mtim.tv_nsec;
+#endif
+#endif
+  }
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef WIN32
+typedef CRITICAL_SECTION manifest_cache_lock_t;
+#else
+typedef pthread_mutex_t manifest_cache_lock_t;
+#endif
+
+struct manifest_cache_entry_t
+{
+  char* variant_;
+  struct mp4_files_t* filespecs_;
+  unsigned int files_;
+  char* data_;
+  uint64_t size_;
+  // the data, shared with the buckets of the responses
+  struct bucket_shared_t* shared_;
+  char etag_[MANIFEST_CACHE_ETAG_SIZE];
+  struct manifest_cache_entry_t* next_;
+};
+
+struct manifest_cache_t
+{
+  unsigned int max_entries_;
+  unsigned int entries_;
+  // most recently used first
+  struct manifest_cache_entry_t* first_;
+  manifest_cache_lock_t lock_;
+};
+
+static void manifest_cache_lock(struct manifest_cache_t* cache)
+{
+#ifdef WIN32
+  EnterCriticalSection(&cache->lock_);
+#else
+  pthread_mutex_lock(&cache->lock_);
+#endif
+}
+
+static void manifest_cache_unlock(struct manifest_cache_t* cache)
+{
+#ifdef WIN32
+  LeaveCriticalSection(&cache->lock_);
+#else
+  pthread_mutex_unlock(&cache->lock_);
+#endif
+}
+
+static struct manifest_cache_entry_t*
+manifest_cache_entry_init(char const* variant,
+                          struct mp4_files_t const* filespecs,
+                          unsigned int files)
+{
+  struct manifest_cache_entry_t* entry = (struct manifest_cache_entry_t*)
+    malloc(sizeof(struct manifest_cache_entry_t));
+  unsigned int i;
+
+  entry->variant_ = (char*)malloc(strlen(variant) + 1);
+  strcpy(entry->variant_, variant);
+  entry->filespecs_ = (struct mp4_files_t*)
+    malloc((files ? files : 1) * sizeof(struct mp4_files_t));
+  for(i = 0; i != files; ++i)
+  {
+    entry->filespecs_[i].name_ = (char*)malloc(strlen(filespecs[i].name_) + 1);
+    strcpy(entry->filespecs_[i].name_, filespecs[i].name_);
+    entry->filespecs_[i].size_ = filespecs[i].size_;
+    entry->filespecs_[i].mtime_ = filespecs[i].mtime_;
+  }
+  entry->files_ = files;
+  entry->data_ = NULL;
+  entry->size_ = 0;
+  entry->shared_ = NULL;
+  entry->etag_[0] = '\0';
+  entry->next_ = NULL;
+
+  return entry;
+}
+
+static void manifest_cache_entry_exit(struct manifest_cache_entry_t* entry)
+{
+  unsigned int i;
+  for(i = 0; i != entry->files_; ++i)
+  {
+    free(entry->filespecs_[i].name_);
+  }
+  free(entry->filespecs_);
+  free(entry->variant_);
+  if(entry->shared_)
+  {
+    bucket_shared_exit(entry->shared_);
+  }
+  else
+  {
+    free(entry->data_);
+  }
+  free(entry);
+}
+
+// Same variant and the same renditions. With check_stat the sizes and
+// modification times have to match as well.
+static int manifest_cache_entry_match(struct manifest_cache_entry_t const* entry,
+                                      char const* variant,
+                                      struct mp4_files_t const* filespecs,
+                                      unsigned int files, int check_stat)
+{
+  unsigned int i;
+
+  if(entry->files_ != files || strcmp(entry->variant_, variant))
+  {
+    return 0;
+  }
+
+  for(i = 0; i != files; ++i)
+  {
+    if(strcmp(entry->filespecs_[i].name_, filespecs[i].name_))
+    {
+      return 0;
+    }
+    if(check_stat && (entry->filespecs_[i].size_ != filespecs[i].size_ ||
+                      entry->filespecs_[i].mtime_ != filespecs[i].mtime_))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// A strong entity tag from a 64 bit FNV-1a hash of the manifest
+extern void manifest_cache_etag(char const* data, uint64_t size, char* etag)
+{
+  uint64_t hash = UINT64_C(14695981039346656037);
+  uint64_t i;
+
+  for(i = 0; i != size; ++i)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= UINT64_C(1099511628211);
+  }
+
+  sprintf(etag, "\"%08x%08x\"",
+          (unsigned int)(hash >> 32), (unsigned int)(hash & 0xffffffff));
+}
+
+// Adds the entry in front and removes the least recently used entries
+static void manifest_cache_add(struct manifest_cache_t* cache,
+                               struct manifest_cache_entry_t* entry)
+{
+  struct manifest_cache_entry_t** link = &cache->first_;
+  unsigned int entries = 1;
+
+  // an entry for the same variant and renditions is stale now
+  while(*link)
+  {
+    struct manifest_cache_entry_t* next = *link;
+    if(manifest_cache_entry_match(next, entry->variant_, entry->filespecs_,
+                                  entry->files_, 0))
+    {
+      *link = next->next_;
+      manifest_cache_entry_exit(next);
+      --cache->entries_;
+      break;
+    }
+    link = &next->next_;
+  }
+
+  entry->next_ = cache->first_;
+  cache->first_ = entry;
+  ++cache->entries_;
+
+  link = &cache->first_;
+  while(*link && entries != cache->max_entries_)
+  {
+    link = &(*link)->next_;
+    ++entries;
+  }
+  if(*link)
+  {
+    struct manifest_cache_entry_t* evict = (*link)->next_;
+    (*link)->next_ = NULL;
+    while(evict)
+    {
+      struct manifest_cache_entry_t* next = evict->next_;
+      manifest_cache_entry_exit(evict);
+      --cache->entries_;
+      evict = next;
+    }
+  }
+}
+
+extern struct manifest_cache_t* manifest_cache_init(unsigned int max_entries)
+{
+  struct manifest_cache_t* cache =
+    (struct manifest_cache_t*)malloc(sizeof(struct manifest_cache_t));
+  cache->max_entries_ = max_entries ? max_entries : 1;
+  cache->entries_ = 0;
+  cache->first_ = NULL;
+#ifdef WIN32
+  InitializeCriticalSection(&cache->lock_);
+#else
+  pthread_mutex_init(&cache->lock_, NULL);
+#endif
+
+  return cache;
+}
+
+extern void manifest_cache_exit(struct manifest_cache_t* cache)
+{
+  struct manifest_cache_entry_t* entry = cache->first_;
+  while(entry)
+  {
+    struct manifest_cache_entry_t* next = entry->next_;
+    manifest_cache_entry_exit(entry);
+    entry = next;
+  }
+#ifdef WIN32
+  DeleteCriticalSection(&cache->lock_);
+#else
+  pthread_mutex_destroy(&cache->lock_);
+#endif
+  free(cache);
+}
+
+extern int manifest_cache_get(struct manifest_cache_t* cache,
+                              char const* variant,
+                              struct mp4_files_t const* filespecs,
+                              unsigned int files,
+                              struct bucket_t** buckets, char* etag)
+{
+  struct manifest_cache_entry_t** link;
+  int result = 0;
+
+  manifest_cache_lock(cache);
+  for(link = &cache->first_; *link; link = &(*link)->next_)
+  {
+    struct manifest_cache_entry_t* entry = *link;
+    if(manifest_cache_entry_match(entry, variant, filespecs, files, 1))
+    {
+      bucket_insert_tail(buckets, bucket_init_shared(entry->shared_, 0,
+                                                     entry->size_));
+      strcpy(etag, entry->etag_);
+
+      // move to the front
+      *link = entry->next_;
+      entry->next_ = cache->first_;
+      cache->first_ = entry;
+      result = 1;
+      break;
+    }
+  }
+  manifest_cache_unlock(cache);
+
+  return result;
+}
+
+extern int manifest_cache_put(struct manifest_cache_t* cache,
+                              char const* variant,
+                              struct mp4_files_t const* filespecs,
+                              unsigned int files,
+                              struct bucket_t const* buckets, char* etag)
+{
+  struct manifest_cache_entry_t* entry;
+  struct bucket_iovec_t* iov;
+  uint64_t size;
+  unsigned int iovs = buckets_iovec(buckets, &iov, &size);
+  unsigned int i;
+  char* p;
+
+  // only manifests that are completely in memory
+  for(i = 0; i != iovs; ++i)
+  {
+    if(iov[i].type_ != BUCKET_TYPE_MEMORY)
+    {
+      free(iov);
+      return 0;
+    }
+  }
+
+  entry = manifest_cache_entry_init(variant, filespecs, files);
+  entry->data_ = (char*)malloc(size ? (size_t)size : 1);
+  entry->size_ = size;
+  p = entry->data_;
+  for(i = 0; i != iovs; ++i)
+  {
+    memcpy(p, iov[i].base_, (size_t)iov[i].size_);
+    p += iov[i].size_;
+  }
+  free(iov);
+  entry->shared_ = bucket_shared_init(entry->data_);
+  manifest_cache_etag(entry->data_, entry->size_, entry->etag_);
+  strcpy(etag, entry->etag_);
+
+  manifest_cache_lock(cache);
+  manifest_cache_add(cache, entry);
+  manifest_cache_unlock(cache);
+
+  return 1;
+}
+
+static int manifest_cache_write_data(FILE* file, void const* data,
+                                     uint64_t size)
+{
+  return size == 0 || fwrite(data, (size_t)size, 1, file) == 1;
+}
+
+static int manifest_cache_write_u64(FILE* file, uint64_t value)
+{
+  unsigned char buffer[8];
+  write_64(buffer, value);
+  return manifest_cache_write_data(file, buffer, 8);
+}
+
+static int manifest_cache_write_string(FILE* file, char const* str)
+{
+  uint64_t size = strlen(str);
+  return manifest_cache_write_u64(file, size) &&
+         manifest_cache_write_data(file, str, size);
+}
+
+static int manifest_cache_read_u64(FILE* file, uint64_t* value)
+{
+  unsigned char buffer[8];
+  if(fread(buffer, 8, 1, file) != 1)
+  {
+    return 0;
+  }
+  *value = read_64(buffer);
+  return 1;
+}
+
+// Reads a string of at most max_size bytes
+static char* manifest_cache_read_string(FILE* file, uint64_t max_size,
+                                        uint64_t* size)
+{
+  char* str;
+  if(!manifest_cache_read_u64(file, size) || *size > max_size)
+  {
+    return NULL;
+  }
+  str = (char*)malloc((size_t)*size + 1);
+  if(*size && fread(str, (size_t)*size, 1, file) != 1)
+  {
+    free(str);
+    return NULL;
+  }
+  str[*size] = '\0';
+  return str;
+}
+
+#define MANIFEST_CACHE_MAGIC UINT64_C(0x6d616e6966737432) // manifst2
+
+extern int manifest_cache_save(struct manifest_cache_t* cache,
+                               char const* filename)
+{
+  struct manifest_cache_entry_t const* entry;
+  int result;
+  FILE* file = fopen(filename, "wb");
+  if(file == NULL)
+  {
+    return 0;
+  }
+
+  manifest_cache_lock(cache);
+  result = manifest_cache_write_u64(file, MANIFEST_CACHE_MAGIC) &&
+           manifest_cache_write_u64(file, cache->entries_);
+  // least recently used first, so that loading restores the order
+  {
+    unsigned int entries = cache->entries_;
+    while(result && entries)
+    {
+      unsigned int i;
+      unsigned int n = 1;
+      for(entry = cache->first_; n != entries; entry = entry->next_)
+      {
+        ++n;
+      }
+      result = manifest_cache_write_string(file, entry->variant_) &&
+               manifest_cache_write_u64(file, entry->files_);
+      for(i = 0; result && i != entry->files_; ++i)
+      {
+        result = manifest_cache_write_string(file, entry->filespecs_[i].name_) &&
+                 manifest_cache_write_u64(file, entry->filespecs_[i].size_) &&
+                 manifest_cache_write_u64(file, entry->filespecs_[i].mtime_);
+      }
+      result = result &&
+               manifest_cache_write_u64(file, entry->size_) &&
+               manifest_cache_write_data(file, entry->data_, entry->size_);
+      --entries;
+    }
+  }
+  manifest_cache_unlock(cache);
+
+  if(fclose(file))
+  {
+    result = 0;
+  }
+
+  return result;
+}
+
+extern int manifest_cache_load(struct manifest_cache_t* cache,
+                               char const* filename)
+{
+  uint64_t magic;
+  uint64_t entries;
+  int result;
+  FILE* file = fopen(filename, "rb");
+  if(file == NULL)
+  {
+    return 0;
+  }
+
+  result = manifest_cache_read_u64(file, &magic) &&
+           magic == MANIFEST_CACHE_MAGIC &&
+           manifest_cache_read_u64(file, &entries);
+
+  while(result && entries--)
+  {
+    struct manifest_cache_entry_t* entry;
+    char* variant;
+    uint64_t files;
+    uint64_t size;
+    unsigned int i;
+
+    variant = manifest_cache_read_string(file, 4096, &size);
+    if(variant == NULL || !manifest_cache_read_u64(file, &files) ||
+       files > 65536)
+    {
+      free(variant);
+      result = 0;
+      break;
+    }
+    entry = manifest_cache_entry_init(variant, NULL, 0);
+    free(variant);
+    entry->filespecs_ = (struct mp4_files_t*)
+      realloc(entry->filespecs_,
+              (files ? (size_t)files : 1) * sizeof(struct mp4_files_t));
+    for(i = 0; i != files; ++i)
+    {
+      struct mp4_files_t* filespec = &entry->filespecs_[i];
+      filespec->name_ = manifest_cache_read_string(file, 4096, &size);
+      if(filespec->name_ == NULL)
+      {
+        result = 0;
+        break;
+      }
+      ++entry->files_;
+      if(!manifest_cache_read_u64(file, &filespec->size_) ||
+         !manifest_cache_read_u64(file, &filespec->mtime_))
+      {
+        result = 0;
+        break;
+      }
+    }
+    if(result)
+    {
+      entry->data_ = manifest_cache_read_string(file, UINT32_MAX,
+                                                &entry->size_);
+      result = entry->data_ != NULL;
+    }
+    if(!result)
+    {
+      manifest_cache_entry_exit(entry);
+      break;
+    }
+    entry->shared_ = bucket_shared_init(entry->data_);
+    manifest_cache_etag(entry->data_, entry->size_, entry->etag_);
+
+    manifest_cache_lock(cache);
+    manifest_cache_add(cache, entry);
+    manifest_cache_unlock(cache);
+  }
+
+  fclose(file);
+
+  return result;
+}
+
 extern int mp4_split(struct mp4_context_t* mp4_context,
                      unsigned int* trak_sample_start,
                      unsigned int* trak_sample_end,
@@ -566,7 +2011,7 @@ extern int mp4_split(struct mp4_context_t* mp4_context,
   float start_time;
   float end_time;
 
-  moov_build_index(mp4_context, mp4_context->moov);
+  moov_build_index(mp4_context, mp4_context->moov, options);
 
   start_time = options->start;
   end_time = options->end;
@@ -587,6 +2032,7 @@ extern int mp4_split(struct mp4_context_t* mp4_context,
     // for every trak, convert seconds to sample (time-to-sample).
     // adjust sample to keyframe
     result = get_aligned_start_and_end(mp4_context, start, end,
+                                       options->precise, options->trickplay,
                                        trak_sample_start, trak_sample_end);
   }
 
@@ -42,16 +42,25 @@ enum fragment_type_t
 {
   FRAGMENT_TYPE_UNKNOWN,
   FRAGMENT_TYPE_AUDIO,
-  FRAGMENT_TYPE_VIDEO
+  FRAGMENT_TYPE_VIDEO,
+  FRAGMENT_TYPE_TEXT
 };
 
 enum output_format_t
 {
   OUTPUT_FORMAT_MP4,
   OUTPUT_FORMAT_RAW,
-  OUTPUT_FORMAT_FLV
+  OUTPUT_FORMAT_FLV,
+  OUTPUT_FORMAT_CMAF
 };
 
+struct bucket_t;
+
+/* In chunked mode every completed moof/mdat chunk is passed to the sink as
+   soon as it is available. The sink takes ownership of the buckets and
+   returns 0 on failure */
+typedef int (*bucket_sink_t)(void* arg, struct bucket_t* buckets);
+
 struct mp4_split_options_t
 {
   int client_is_flash;
@@ -60,11 +69,55 @@ struct mp4_split_options_t
   int adaptive;
   int fragments;
   int manifest;
+  int manifest_version;         // 1 (default) or 2 with run-length chunks
   enum fragment_type_t fragment_type;
+  char fragment_language[4];    // e.g. 'nld' for audio_nld fragments
   enum output_format_t output_format;
   uint64_t fragment_start;
+  // cut the MP4 output at exactly start and end (with an edit list)
+  int precise;
+  // reduce the video tracks to their keyframes (for scrubbing and trick
+  // play), each keyframe lasting until the next one
+  int trickplay;
+  // write the moov of the MP4 output compressed (a 'cmov'). The compressed
+  // moov is reused from the moov_cache while the clip and the cut are the
+  // same.
+  int compress_moov;
+  struct manifest_cache_t* moov_cache;
+  // traffic shaping: the output position needed by each media second, or,
+  // for fragmented output, by the media time in byte_times (in seconds) of
+  // each fragment or chunk. seconds is the number of byte_offsets.
   int seconds;
   uint64_t* byte_offsets;
+  double* byte_times;
+  // the tracks of the MP4 output, selected by track_ID or by type (e.g.
+  // tracks=1,3 or tracks=audio). All tracks when nothing is selected.
+  unsigned int tracks;          // the number of track_ids
+  uint32_t track_ids[8];
+  unsigned int track_types;     // (1 << fragment_type_t) for each type
+  // pace the output at pace times the media rate (0 is unpaced), after an
+  // initial burst of burst seconds of media. Only the MP4 and the fragmented
+  // (.ismv, chunked and CMAF) outputs build the byte_offsets to pace with.
+  float pace;
+  float burst;
+  // only index the timestamps and sync samples (e.g. for manifests)
+  int index_times_only;
+  unsigned int threads;
+  int interleave;
+  float fragment_duration;
+  float min_fragment_duration;
+  int sidx;
+  // CMAF init segment or media segment (at cmaf_time) of a track
+  uint32_t cmaf_track_id;
+  int cmaf_init;
+  uint64_t cmaf_time;
+  // HLS transport stream segment (numbered from 0) or media playlist
+  int hls_segment;
+  int hls_playlist;
+  // split the fragments into chunks of (at least) chunk_duration seconds
+  float chunk_duration;
+  bucket_sink_t sink;
+  void* sink_arg;
 };
 typedef struct mp4_split_options_t mp4_split_options_t;
 
@@ -75,6 +128,18 @@ enum bucket_type_t
 };
 typedef enum bucket_type_t bucket_type_t;
 
+/* Buckets are carved from shared slabs. The data of a small memory bucket
+   (like a tag or NAL header) is stored inline, a larger memory bucket is a
+   single allocation for the bucket and its data */
+#define BUCKET_INLINE_SIZE 32
+#define BUCKET_SLAB_SIZE 256
+
+/* buckets_coalesce merges memory buckets smaller than this */
+#define BUCKET_COALESCE_SIZE 1024
+
+struct bucket_slab_t;
+struct bucket_shared_t;
+
 struct bucket_t
 {
   int type_;
@@ -85,6 +150,9 @@ struct bucket_t
   uint64_t size_;
   struct bucket_t* prev_;
   struct bucket_t* next_;
+  struct bucket_slab_t* slab_;
+  struct bucket_shared_t* shared_;
+  unsigned char inline_[BUCKET_INLINE_SIZE];
 };
 typedef struct bucket_t bucket_t;
 MOD_STREAMING_DLL_LOCAL extern bucket_t* bucket_init(bucket_type_t bucket_type);
@@ -92,21 +160,132 @@ MOD_STREAMING_DLL_LOCAL extern
 bucket_t* bucket_init_memory(void const* buf, uint64_t size);
 MOD_STREAMING_DLL_LOCAL extern
 bucket_t* bucket_init_file(uint64_t offset, uint64_t size);
+/* A memory bucket that doesn't copy the data. The memory is owned by the
+   caller and has to outlive the bucket */
+MOD_STREAMING_DLL_LOCAL extern
+bucket_t* bucket_init_reference(void const* buf, uint64_t size);
+/* A memory bucket that takes ownership of buf (allocated with malloc) */
+MOD_STREAMING_DLL_LOCAL extern
+bucket_t* bucket_init_owned(void* buf, uint64_t size);
+/* Reference counted memory (allocated with malloc) that can be shared by
+   many buckets, e.g. a cached manifest. bucket_shared_init returns it with one
+   reference, which is dropped with bucket_shared_exit */
+MOD_STREAMING_DLL_LOCAL extern
+struct bucket_shared_t* bucket_shared_init(void* buf);
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_shared_exit(struct bucket_shared_t* shared);
+MOD_STREAMING_DLL_LOCAL extern
+bucket_t* bucket_init_shared(struct bucket_shared_t* shared,
+                             uint64_t offset, uint64_t size);
 MOD_STREAMING_DLL_LOCAL extern
 void buckets_exit(struct bucket_t* buckets);
 MOD_STREAMING_DLL_LOCAL extern
 void bucket_insert_tail(bucket_t** head, bucket_t* bucket);
 MOD_STREAMING_DLL_LOCAL extern
 void bucket_insert_head(bucket_t** head, bucket_t* bucket);
+MOD_STREAMING_DLL_LOCAL extern
+void buckets_insert_tail(bucket_t** head, bucket_t* buckets);
+/* Merges contiguous file buckets and runs of small memory buckets. Only for
+   a complete list, since the buckets may be replaced */
+MOD_STREAMING_DLL_LOCAL extern
+void buckets_coalesce(bucket_t** head);
+
+/* A flat view of a list of buckets for the writers. Returns the number of
+   entries in *iov (allocated with malloc) and the total size in *size */
+struct bucket_iovec_t
+{
+  int type_;
+  void const* base_;    // BUCKET_TYPE_MEMORY
+  uint64_t offset_;     // BUCKET_TYPE_FILE
+  uint64_t size_;
+};
+typedef struct bucket_iovec_t bucket_iovec_t;
+MOD_STREAMING_DLL_LOCAL extern
+unsigned int buckets_iovec(bucket_t const* buckets, bucket_iovec_t** iov,
+                           uint64_t* size);
+
+/* Appends text to a list of memory buckets. The text is collected in a block
+   that is moved into a bucket when it is full, so there is no upper bound on
+   the size of the output */
+#define BUCKET_WRITER_BLOCK_SIZE 16384
+
+struct bucket_writer_t
+{
+  struct bucket_t** buckets_;
+  char* p_;
+  char block_[BUCKET_WRITER_BLOCK_SIZE];
+};
+typedef struct bucket_writer_t bucket_writer_t;
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_writer_init(bucket_writer_t* writer, bucket_t** buckets);
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_writer_flush(bucket_writer_t* writer);
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_writer_write(bucket_writer_t* writer, char const* data,
+                         unsigned int size);
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_writer_puts(bucket_writer_t* writer, char const* str);
+MOD_STREAMING_DLL_LOCAL extern
+void bucket_writer_putu(bucket_writer_t* writer, uint64_t value);
+
+/* The most worker threads (e.g. the -t option of mp4split) */
+#define MAX_THREADS 64
+
+/* Runs worker(arg, i, workers) for i in [0,workers> on separate threads and
+   returns 0 when any of the workers failed */
+typedef int (*mp4_worker_t)(void* arg, unsigned int worker,
+                            unsigned int workers);
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_run_workers(unsigned int workers, mp4_worker_t worker, void* arg);
 
 struct mp4_files_t
 {
   char* name_;
+  uint64_t size_;
+  uint64_t mtime_;              // in ns (100ns units on Windows)
 };
 
+/* Appends the files of the directory to filespecs (grown with realloc) */
 MOD_STREAMING_DLL_LOCAL extern
 int mp4_scanfiles(const char* input_file, unsigned int* files,
-                  struct mp4_files_t* filespecs);
+                  struct mp4_files_t** filespecs);
+
+/* Fills in the size and the sub-second modification time of every file with
+   a single stat each. Returns 0 when any of the files could not be stat'ed */
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_stat_files(struct mp4_files_t* filespecs, unsigned int files);
+
+/* A cache of rendered manifests and playlists. An entry is keyed by the
+   output variant (e.g. the output extension and the query) and the set of
+   renditions, and stays valid as long as the size and modification time of
+   every rendition are unchanged (see mp4_stat_files). The ETag of an entry is
+   computed once, when the entry is stored. */
+#define MANIFEST_CACHE_ETAG_SIZE 20
+
+struct manifest_cache_t;
+MOD_STREAMING_DLL_LOCAL extern
+struct manifest_cache_t* manifest_cache_init(unsigned int max_entries);
+MOD_STREAMING_DLL_LOCAL extern
+void manifest_cache_exit(struct manifest_cache_t* cache);
+/* Appends the cached manifest to buckets and copies its ETag. Returns 0 on a
+   cache miss */
+MOD_STREAMING_DLL_LOCAL extern
+int manifest_cache_get(struct manifest_cache_t* cache, char const* variant,
+                       struct mp4_files_t const* filespecs, unsigned int files,
+                       struct bucket_t** buckets, char* etag);
+/* Stores the manifest in buckets (memory buckets only) and returns its ETag */
+MOD_STREAMING_DLL_LOCAL extern
+int manifest_cache_put(struct manifest_cache_t* cache, char const* variant,
+                       struct mp4_files_t const* filespecs, unsigned int files,
+                       struct bucket_t const* buckets, char* etag);
+/* Persist the cache, e.g. for command line use */
+MOD_STREAMING_DLL_LOCAL extern
+int manifest_cache_load(struct manifest_cache_t* cache, char const* filename);
+MOD_STREAMING_DLL_LOCAL extern
+int manifest_cache_save(struct manifest_cache_t* cache, char const* filename);
+/* Writes the ETag of the data (MANIFEST_CACHE_ETAG_SIZE bytes, quoted) */
+MOD_STREAMING_DLL_LOCAL extern
+void manifest_cache_etag(char const* data, uint64_t size, char* etag);
 
 MOD_STREAMING_DLL_LOCAL extern
 mp4_split_options_t* mp4_split_options_init();
@@ -116,9 +295,42 @@ int mp4_split_options_set(mp4_split_options_t* options,
                           unsigned int args_size);
 MOD_STREAMING_DLL_LOCAL extern
 void mp4_split_options_exit(mp4_split_options_t* options);
+/* Writes the options that change the fragment plan (e.g. the fragment
+   duration) as a query for the fragment urls in the manifests, with first
+   in front of the first option and separator in front of the others. Returns
+   the length of the query, or -1 (and an empty query) when it doesn't fit in
+   size bytes. MP4_FRAGMENT_QUERY_SIZE always fits the separators used in
+   the manifests. */
+#define MP4_FRAGMENT_QUERY_SIZE 128
+
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_split_options_fragment_query(mp4_split_options_t const* options,
+                                     char const* first,
+                                     char const* separator,
+                                     char* query, size_t size);
+
+/* Records for pacing that the output up to filepos is needed at the media
+   time (in seconds from the start of the output). Output that is created in
+   order, like fragments and chunks, builds its byte_offsets with this. */
+MOD_STREAMING_DLL_LOCAL extern
+void mp4_pace_mark(mp4_split_options_t* options, double time,
+                   uint64_t filepos);
+
+/* The number of milliseconds to wait (after elapsed_ms of sending) before the
+   output up to filepos may be sent. Returns 0 when the output isn't paced */
+MOD_STREAMING_DLL_LOCAL extern
+unsigned int mp4_pace_delay(mp4_split_options_t const* options,
+                            uint64_t filepos, uint64_t elapsed_ms);
 
 struct mp4_context_t;
 
+/* Opens (and parses) the files on at most threads workers. Returns 0 when any
+   of the files failed to open, the contexts of those files are NULL */
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_open_files(struct mp4_files_t const* filespecs, unsigned int files,
+                   int mfra_only, int verbose, unsigned int threads,
+                   struct mp4_context_t** mp4_context);
+
 MOD_STREAMING_DLL_LOCAL extern
 int mp4_split(struct mp4_context_t* mp4_context,
               unsigned int* trak_sample_start,
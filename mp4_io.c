@@ -24,6 +24,10 @@
 #include <stdlib.h>
 #include <sys/types.h>  // FreeBSD doesn't define off_t in stdio.h
 
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+# include <zlib.h>
+#endif
+
 #ifdef WIN32
 // #define ftello _ftelli64
 // #define fseeko _fseeki64
@@ -256,6 +260,101 @@ static unsigned char* read_box(struct mp4_context_t* mp4_context,
   return box_data;
 }
 
+// The largest uncompressed moov, and the best compression ratio of deflate
+// (which bounds it by the size of the compressed data)
+#define MOOV_UNCOMPRESSED_MAX_SIZE (256 * 1024 * 1024)
+#define DEFLATE_MAX_RATIO 1032
+
+// A compressed movie ('cmov' with a 'dcom' and a 'cmvd') is replaced by the
+// moov that it holds, so that it is decompressed only once.
+static int moov_uncompress(struct mp4_context_t* mp4_context)
+{
+  unsigned char* cmov = mp4_context->moov_data + ATOM_PREAMBLE_SIZE;
+  unsigned char* last = mp4_context->moov_data + mp4_context->moov_data_size;
+  unsigned char* dcom;
+  unsigned char* cmvd;
+
+  if(cmov + ATOM_PREAMBLE_SIZE > last ||
+     read_32(cmov + 4) != FOURCC('c', 'm', 'o', 'v'))
+  {
+    return 1;
+  }
+
+  dcom = cmov + ATOM_PREAMBLE_SIZE;
+  cmvd = dcom + ATOM_PREAMBLE_SIZE + 4;
+  if(cmvd + ATOM_PREAMBLE_SIZE + 4 > last ||
+     read_32(dcom + 4) != FOURCC('d', 'c', 'o', 'm') ||
+     read_32(dcom) != ATOM_PREAMBLE_SIZE + 4 ||
+     read_32(cmvd + 4) != FOURCC('c', 'm', 'v', 'd') ||
+     read_32(cmvd) < ATOM_PREAMBLE_SIZE + 4 ||
+     read_32(cmvd) > (uint64_t)(last - cmvd))
+  {
+    MP4_ERROR("%s", "Error: invalid compressed moov\n");
+    return 0;
+  }
+
+  if(read_32(dcom + 8) != FOURCC('z', 'l', 'i', 'b'))
+  {
+    MP4_ERROR("%s", "Error: compressed moov is not zlib compressed\n");
+    return 0;
+  }
+
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+  {
+    uLong size = read_32(cmvd + 8);
+    uLong header_size = 0;
+    uint64_t compressed_size = read_32(cmvd) - ATOM_PREAMBLE_SIZE - 4;
+    unsigned char* moov_data;
+
+    if(size > MOOV_UNCOMPRESSED_MAX_SIZE ||
+       size > compressed_size * DEFLATE_MAX_RATIO)
+    {
+      MP4_ERROR("Error: invalid uncompressed moov size %lu\n", size);
+      return 0;
+    }
+
+    // the uncompressed data is a complete moov, or just its atoms
+    moov_data = (unsigned char*)malloc(size + ATOM_PREAMBLE_SIZE);
+    if(moov_data == NULL)
+    {
+      MP4_ERROR("Error: allocating %lu bytes for the moov\n", size);
+      return 0;
+    }
+    if(uncompress(moov_data + ATOM_PREAMBLE_SIZE, &size,
+                  cmvd + ATOM_PREAMBLE_SIZE + 4,
+                  (uLong)compressed_size) != Z_OK)
+    {
+      MP4_ERROR("%s", "Error: uncompressing moov\n");
+      free(moov_data);
+      return 0;
+    }
+    if(size < ATOM_PREAMBLE_SIZE ||
+       read_32(moov_data + ATOM_PREAMBLE_SIZE + 4) != FOURCC('m', 'o', 'o', 'v'))
+    {
+      header_size = ATOM_PREAMBLE_SIZE;
+      write_32(moov_data, (uint32_t)(size + header_size));
+      write_32(moov_data + 4, FOURCC('m', 'o', 'o', 'v'));
+    }
+    else
+    {
+      memmove(moov_data, moov_data + ATOM_PREAMBLE_SIZE, size);
+    }
+
+    MP4_INFO("moov uncompressed from %llu to %lu bytes\n",
+             mp4_context->moov_data_size, size + header_size);
+
+    free(mp4_context->moov_data);
+    mp4_context->moov_data = moov_data;
+    mp4_context->moov_data_size = size + header_size;
+  }
+
+  return 1;
+#else
+  MP4_ERROR("%s", "Error: compressed moov needs zlib\n");
+  return 0;
+#endif
+}
+
 static mp4_context_t* mp4_context_init(const char* filename, int verbose)
 {
   mp4_context_t* mp4_context = (mp4_context_t*)malloc(sizeof(mp4_context_t));
@@ -270,6 +369,7 @@ static mp4_context_t* mp4_context_init(const char* filename, int verbose)
   memset(&mp4_context->mfra_atom, 0, sizeof(struct mp4_atom_t));
 
   mp4_context->moov_data = 0;
+  mp4_context->moov_data_size = 0;
   mp4_context->mfra_data = 0;
 
   mp4_context->moov = 0;
@@ -372,6 +472,12 @@ extern mp4_context_t* mp4_open(const char* filename, int64_t filesize, int mfra_
         mp4_context_exit(mp4_context);
         return 0;
       }
+      mp4_context->moov_data_size = mp4_context->moov_atom.size_;
+      if(!moov_uncompress(mp4_context))
+      {
+        mp4_context_exit(mp4_context);
+        return 0;
+      }
       break;
     case FOURCC('m', 'd', 'a', 't'):
       mp4_context->mdat_atom = leaf_atom;
@@ -430,7 +536,7 @@ extern mp4_context_t* mp4_open(const char* filename, int64_t filesize, int mfra_
   mp4_context->moov = (struct moov_t*)
     moov_read(mp4_context, NULL,
               mp4_context->moov_data + ATOM_PREAMBLE_SIZE,
-              mp4_context->moov_atom.size_ - ATOM_PREAMBLE_SIZE);
+              mp4_context->moov_data_size - ATOM_PREAMBLE_SIZE);
 
   if(mp4_context->moov == 0 || mp4_context->moov->mvhd_ == 0)
   {
@@ -476,6 +582,7 @@ extern struct moov_t* moov_init()
   moov->unknown_atoms_ = 0;
   moov->mvhd_ = 0;
   moov->tracks_ = 0;
+  moov->mvex_ = 0;
 
   return moov;
 }
@@ -495,6 +602,52 @@ extern void moov_exit(struct moov_t* atom)
   {
     trak_exit(atom->traks_[i]);
   }
+  if(atom->mvex_)
+  {
+    mvex_exit(atom->mvex_);
+  }
+  free(atom);
+}
+
+extern struct trex_t* trex_init()
+{
+  struct trex_t* trex = (struct trex_t*)malloc(sizeof(struct trex_t));
+  trex->version_ = 0;
+  trex->flags_ = 0;
+  trex->track_id_ = 0;
+  trex->default_sample_description_index_ = 1;
+  trex->default_sample_duration_ = 0;
+  trex->default_sample_size_ = 0;
+  trex->default_sample_flags_ = 0;
+
+  return trex;
+}
+
+extern void trex_exit(struct trex_t* atom)
+{
+  free(atom);
+}
+
+extern struct mvex_t* mvex_init()
+{
+  struct mvex_t* mvex = (struct mvex_t*)malloc(sizeof(struct mvex_t));
+  mvex->unknown_atoms_ = 0;
+  mvex->tracks_ = 0;
+
+  return mvex;
+}
+
+extern void mvex_exit(struct mvex_t* atom)
+{
+  unsigned int i;
+  if(atom->unknown_atoms_)
+  {
+    unknown_atom_exit(atom->unknown_atoms_);
+  }
+  for(i = 0; i != atom->tracks_; ++i)
+  {
+    trex_exit(atom->trexs_[i]);
+  }
   free(atom);
 }
 
@@ -503,11 +656,14 @@ extern struct trak_t* trak_init()
   struct trak_t* trak = (struct trak_t*)malloc(sizeof(struct trak_t));
   trak->unknown_atoms_ = 0;
   trak->tkhd_ = 0;
+  trak->edts_ = 0;
   trak->mdia_ = 0;
   trak->chunks_size_ = 0;
   trak->chunks_ = 0;
   trak->samples_size_ = 0;
   trak->samples_ = 0;
+  trak->avg_bitrate_ = 0;
+  trak->max_bitrate_ = 0;
 
   return trak;
 }
@@ -522,6 +678,10 @@ extern void trak_exit(struct trak_t* trak)
   {
     tkhd_exit(trak->tkhd_);
   }
+  if(trak->edts_)
+  {
+    edts_exit(trak->edts_);
+  }
   if(trak->mdia_)
   {
     mdia_exit(trak->mdia_);
@@ -537,6 +697,43 @@ extern void trak_exit(struct trak_t* trak)
   free(trak);
 }
 
+extern struct elst_t* elst_init()
+{
+  struct elst_t* atom = (struct elst_t*)malloc(sizeof(struct elst_t));
+  atom->version_ = 0;
+  atom->flags_ = 0;
+  atom->entries_ = 0;
+  atom->table_ = 0;
+
+  return atom;
+}
+
+extern void elst_exit(struct elst_t* atom)
+{
+  if(atom->table_)
+  {
+    free(atom->table_);
+  }
+  free(atom);
+}
+
+extern struct edts_t* edts_init()
+{
+  struct edts_t* atom = (struct edts_t*)malloc(sizeof(struct edts_t));
+  atom->elst_ = 0;
+
+  return atom;
+}
+
+extern void edts_exit(struct edts_t* atom)
+{
+  if(atom->elst_)
+  {
+    elst_exit(atom->elst_);
+  }
+  free(atom);
+}
+
 extern struct mvhd_t* mvhd_init()
 {
   struct mvhd_t* atom = (struct mvhd_t*)malloc(sizeof(struct mvhd_t));
@@ -984,6 +1181,72 @@ extern void sample_entry_exit(struct sample_entry_t* sample_entry)
   }
 }
 
+const uint32_t aac_samplerates[] =
+{
+  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+  16000, 12000, 11025,  8000,  7350,     0,     0,     0
+};
+
+extern int mp4_samplerate_to_index(unsigned int samplerate)
+{
+  unsigned int i;
+  for(i = 0; i != 13; ++i)
+  {
+    if(aac_samplerates[i] == samplerate)
+      return i;
+  }
+  return 4;
+}
+
+extern unsigned char* sample_entry_write_adts(
+  struct sample_entry_t const* sample_entry, unsigned int sample_size,
+  unsigned char* out)
+{
+  unsigned int syncword = 0xfff;
+  unsigned int ID = 0; // MPEG-4
+  unsigned int layer = 0;
+  unsigned int protection_absent = 1;
+  // 0 = Main profile AAC MAIN
+  // 1 = Low Complexity profile (LC) AAC LC
+  // 2 = Scalable Sample Rate profile (SSR) AAC SSR
+  // 3 = (reserved) AAC LTP
+  unsigned int profile = 1;
+  unsigned int sampling_frequency_index =
+    mp4_samplerate_to_index(sample_entry->nSamplesPerSec);
+  unsigned int private_bit = 0;
+  unsigned int channel_configuration = sample_entry->nChannels;
+  unsigned int original_copy = 0;
+  unsigned int home = 0;
+  unsigned int copyright_identification_bit = 0;
+  unsigned int copyright_identification_start = 0;
+  unsigned int aac_frame_length = 7 + sample_size;
+  unsigned int adts_buffer_fullness = 0x7ff;
+  unsigned int no_raw_data_blocks_in_frame = 0;
+  unsigned char buffer[8];
+
+  uint64_t adts = 0;
+  adts = (adts << 12) | syncword;
+  adts = (adts << 1) | ID;
+  adts = (adts << 2) | layer;
+  adts = (adts << 1) | protection_absent;
+  adts = (adts << 2) | profile;
+  adts = (adts << 4) | sampling_frequency_index;
+  adts = (adts << 1) | private_bit;
+  adts = (adts << 3) | channel_configuration;
+  adts = (adts << 1) | original_copy;
+  adts = (adts << 1) | home;
+  adts = (adts << 1) | copyright_identification_bit;
+  adts = (adts << 1) | copyright_identification_start;
+  adts = (adts << 13) | aac_frame_length;
+  adts = (adts << 11) | adts_buffer_fullness;
+  adts = (adts << 2) | no_raw_data_blocks_in_frame;
+
+  write_64(buffer, adts);
+  memcpy(out, buffer + 1, 7);
+
+  return out + 7;
+}
+
 extern struct stts_t* stts_init()
 {
   struct stts_t* atom = (struct stts_t*)malloc(sizeof(struct stts_t));
@@ -1215,6 +1478,38 @@ extern uint64_t moov_time_to_trak_time(uint64_t t, long moov_time_scale,
   return t * (uint64_t)trak_time_scale / moov_time_scale;
 }
 
+// RFC 6381 codecs parameter
+extern char* trak_write_codecs(struct trak_t const* trak, char* p)
+{
+  struct sample_entry_t const* sample_entry =
+    &trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0];
+  uint32_t fourcc = sample_entry->fourcc_;
+
+  if(fourcc == FOURCC('a', 'v', 'c', '1') && sample_entry->sps_length_ >= 4)
+  {
+    p += sprintf(p, "avc1.%02X%02X%02X",
+                 sample_entry->sps_[1], sample_entry->sps_[2],
+                 sample_entry->sps_[3]);
+  }
+  else if(fourcc == FOURCC('m', 'p', '4', 'a'))
+  {
+    unsigned int object_type = 2;
+    if(sample_entry->codec_private_data_length_)
+    {
+      object_type = sample_entry->codec_private_data_[0] >> 3;
+    }
+    p += sprintf(p, "mp4a.40.%u", object_type);
+  }
+  else
+  {
+    p += sprintf(p, "%c%c%c%c",
+                 (fourcc >> 24) & 0xff, (fourcc >> 16) & 0xff,
+                 (fourcc >> 8) & 0xff, fourcc & 0xff);
+  }
+
+  return p;
+}
+
 extern uint64_t trak_time_to_moov_time(uint64_t t, long moov_time_scale,
                                        long trak_time_scale)
 {
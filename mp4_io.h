@@ -116,11 +116,36 @@ struct moov_t
   struct mvhd_t* mvhd_;
   unsigned int tracks_;
   struct trak_t* traks_[MAX_TRACKS];
+  struct mvex_t* mvex_;         // only for fragmented output
 };
 typedef struct moov_t moov_t;
 MOD_STREAMING_DLL_LOCAL extern moov_t* moov_init();
 MOD_STREAMING_DLL_LOCAL extern void moov_exit(moov_t* atom);
 
+struct trex_t
+{
+  unsigned int version_;
+  unsigned int flags_;
+  uint32_t track_id_;
+  uint32_t default_sample_description_index_;
+  uint32_t default_sample_duration_;
+  uint32_t default_sample_size_;
+  uint32_t default_sample_flags_;
+};
+typedef struct trex_t trex_t;
+MOD_STREAMING_DLL_LOCAL extern trex_t* trex_init();
+MOD_STREAMING_DLL_LOCAL extern void trex_exit(trex_t* atom);
+
+struct mvex_t
+{
+  struct unknown_atom_t* unknown_atoms_;
+  unsigned int tracks_;
+  struct trex_t* trexs_[MAX_TRACKS];
+};
+typedef struct mvex_t mvex_t;
+MOD_STREAMING_DLL_LOCAL extern mvex_t* mvex_init();
+MOD_STREAMING_DLL_LOCAL extern void mvex_exit(mvex_t* atom);
+
 struct mvhd_t
 {
   unsigned int version_;
@@ -146,6 +171,7 @@ struct trak_t
 {
   struct unknown_atom_t* unknown_atoms_;
   struct tkhd_t* tkhd_;
+  struct edts_t* edts_;         // only for output
   struct mdia_t* mdia_;
 
   /* temporary indices */
@@ -154,11 +180,43 @@ struct trak_t
 
   unsigned int samples_size_;
   struct samples_t* samples_;
+
+  /* bitrates measured over the smooth streaming fragments */
+  uint32_t avg_bitrate_;
+  uint32_t max_bitrate_;
 };
 typedef struct trak_t trak_t;
 MOD_STREAMING_DLL_LOCAL extern trak_t* trak_init();
 MOD_STREAMING_DLL_LOCAL extern void trak_exit(trak_t* trak);
 
+struct elst_table_t
+{
+  uint64_t segment_duration_;   // in the timescale of the movie
+  int64_t media_time_;          // in the timescale of the media, -1 is empty
+  int16_t media_rate_integer_;
+  int16_t media_rate_fraction_;
+};
+typedef struct elst_table_t elst_table_t;
+
+struct elst_t
+{
+  unsigned int version_;
+  unsigned int flags_;
+  uint32_t entries_;
+  struct elst_table_t* table_;
+};
+typedef struct elst_t elst_t;
+MOD_STREAMING_DLL_LOCAL extern elst_t* elst_init();
+MOD_STREAMING_DLL_LOCAL extern void elst_exit(elst_t* atom);
+
+struct edts_t
+{
+  struct elst_t* elst_;
+};
+typedef struct edts_t edts_t;
+MOD_STREAMING_DLL_LOCAL extern edts_t* edts_init();
+MOD_STREAMING_DLL_LOCAL extern void edts_exit(edts_t* atom);
+
 struct tkhd_t
 {
   unsigned int version_;
@@ -361,6 +419,15 @@ void sample_entry_assign(sample_entry_t* lhs, sample_entry_t const* rhs);
 MOD_STREAMING_DLL_LOCAL extern
 void sample_entry_exit(sample_entry_t* sample_entry);
 
+MOD_STREAMING_DLL_LOCAL extern const uint32_t aac_samplerates[];
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_samplerate_to_index(unsigned int samplerate);
+// writes the 7 byte ADTS header for an AAC frame of sample_size bytes
+MOD_STREAMING_DLL_LOCAL extern
+unsigned char* sample_entry_write_adts(sample_entry_t const* sample_entry,
+                                       unsigned int sample_size,
+                                       unsigned char* out);
+
 struct stts_t
 {
   unsigned int version_;
@@ -487,6 +554,10 @@ MOD_STREAMING_DLL_LOCAL extern
 uint64_t trak_time_to_moov_time(uint64_t t, long moov_time_scale,
                                 long trak_time_scale);
 
+// writes the RFC 6381 codecs parameter of the track (e.g. avc1.42C01E)
+MOD_STREAMING_DLL_LOCAL extern
+char* trak_write_codecs(struct trak_t const* trak, char* p);
+
 struct mp4_context_t
 {
   char* filename_;
@@ -502,6 +573,8 @@ struct mp4_context_t
 
   // the actual binary data
   unsigned char* moov_data;
+  // the size of moov_data, which is the uncompressed moov for a 'cmov'
+  uint64_t moov_data_size;
   unsigned char* mfra_data;
 
   // the parsed atoms
@@ -18,6 +18,7 @@
 
 #include "mp4_reader.h"
 #include "mp4_io.h"
+#include "moov.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -1623,13 +1624,23 @@ extern void* moov_read(struct mp4_context_t const* mp4_context,
   return atom;
 }
 
+// When times_only is set, only the timestamps and the sync samples are
+// indexed (e.g. for a manifest), not the positions and sizes of the samples.
 static int trak_build_index(mp4_context_t const* mp4_context,
-                            trak_t* trak)
+                            trak_t* trak, int times_only)
 {
   stco_t const* stco = trak->mdia_->minf_->stbl_->stco_;
   int have_samples = stco == NULL ? 0 : 1;
 
-  if(have_samples)
+  if(have_samples && times_only)
+  {
+    stsz_t const* stsz = trak->mdia_->minf_->stbl_->stsz_;
+    trak->samples_size_ = stsz->sample_size_ == 0 ? stsz->entries_ :
+      stts_get_samples(trak->mdia_->minf_->stbl_->stts_);
+    trak->samples_ = (samples_t*)calloc(trak->samples_size_ + 1, sizeof(samples_t));
+  }
+
+  if(have_samples && !times_only)
   {
     trak->chunks_size_ = stco->entries_;
     trak->chunks_ = (chunks_t*)malloc(trak->chunks_size_ * sizeof(chunks_t));
@@ -1644,7 +1655,7 @@ static int trak_build_index(mp4_context_t const* mp4_context,
   }
 
   // process chunkmap:
-  if(have_samples)
+  if(have_samples && !times_only)
   {
     stsc_t const* stsc = trak->mdia_->minf_->stbl_->stsc_;
     unsigned int last = trak->chunks_size_;
@@ -1665,7 +1676,7 @@ static int trak_build_index(mp4_context_t const* mp4_context,
   }
 
   // calc pts of chunks:
-  if(have_samples)
+  if(have_samples && !times_only)
   {
     stsz_t const* stsz = trak->mdia_->minf_->stbl_->stsz_;
     unsigned int sample_size = stsz->sample_size_;
@@ -1690,16 +1701,21 @@ static int trak_build_index(mp4_context_t const* mp4_context,
 
     // reserve one extra for the end information (like pts and cto).
     trak->samples_ = (samples_t*)calloc(trak->samples_size_ + 1, sizeof(samples_t));
+  }
 
+  // sample sizes (also needed for the bitrates in the manifest):
+  if(have_samples)
+  {
+    stsz_t const* stsz = trak->mdia_->minf_->stbl_->stsz_;
+    unsigned int sample_size = stsz->sample_size_;
+    unsigned int i;
     if(sample_size == 0)
     {
-      unsigned int i;
       for(i = 0; i != trak->samples_size_ ; ++i)
         trak->samples_[i].size_ = stsz->sample_sizes_[i];
     }
     else
     {
-      unsigned int i;
       for(i = 0; i != trak->samples_size_ ; ++i)
         trak->samples_[i].size_ = sample_size;
     }
@@ -1773,7 +1789,7 @@ static int trak_build_index(mp4_context_t const* mp4_context,
   }
 
   // calc sample offsets
-  if(have_samples)
+  if(have_samples && !times_only)
   {
     unsigned int s = 0;
     unsigned int j;
@@ -1796,10 +1812,9 @@ static int trak_build_index(mp4_context_t const* mp4_context,
     unsigned int i;
     if(stss)
     {
-      // TODO: The chunks for smooth streaming are now aligned to the keyframes.
-      // We may want to consider skipping some keyframes and use a
-      // minimal_increment_between_keyframes (say 2 seconds) as some chunks
-      // can be very small.
+      // The chunks for smooth streaming are aligned to the keyframes. When a
+      // fragment duration is requested, trak_plan_fragments skips some of
+      // them so that the chunks aren't too small (see moov_build_index).
       for(i = 0; i != stss->entries_; ++i)
       {
         uint32_t s = stss->sample_numbers_[i] - 1;
@@ -1827,6 +1842,73 @@ static int trak_build_index(mp4_context_t const* mp4_context,
   return 1;
 }
 
+// Re-plan the smooth sync samples of a track. A fragment is closed at the
+// keyframe nearest to the target duration, as long as the fragment is at
+// least min_duration long. A trailing fragment that is shorter than
+// min_duration is merged into the previous one.
+static void trak_plan_fragments(trak_t* trak, uint64_t target,
+                                uint64_t min_duration)
+{
+  samples_t* first = trak->samples_;
+  samples_t* last = trak->samples_ + trak->samples_size_;
+  samples_t* start;
+  samples_t* prev = NULL;
+  samples_t* sample;
+
+  for(sample = first; sample != last; ++sample)
+  {
+    sample->is_smooth_ss_ = 0;
+  }
+
+  // the first fragment starts at the first keyframe
+  start = first;
+  while(start != last && !start->is_ss_)
+  {
+    ++start;
+  }
+  if(start == last)
+  {
+    return;
+  }
+  start->is_smooth_ss_ = 1;
+  first = start;
+
+  for(sample = start + 1; sample != last; ++sample)
+  {
+    uint64_t duration;
+    if(!sample->is_ss_)
+    {
+      continue;
+    }
+
+    duration = sample->pts_ - start->pts_;
+    if(duration < target)
+    {
+      if(duration >= min_duration)
+      {
+        prev = sample;
+      }
+      continue;
+    }
+
+    // this is the first keyframe at (or past) the target, but use the
+    // previous keyframe instead when it is closer to the target.
+    if(prev && target - (prev->pts_ - start->pts_) < duration - target)
+    {
+      sample = prev;
+    }
+    sample->is_smooth_ss_ = 1;
+    start = sample;
+    prev = NULL;
+  }
+
+  // don't end with a fragment that is too short
+  if(start != first && last->pts_ - start->pts_ < min_duration)
+  {
+    start->is_smooth_ss_ = 0;
+  }
+}
+
 static void copy_sync_samples_to_audio_track(trak_t* video,
                                              trak_t* audio)
 {
@@ -1875,12 +1957,262 @@ static void copy_sync_samples_to_audio_track(trak_t* video,
   }
 }
 
+static void trak_plan_fragments_in_seconds(trak_t* trak,
+  struct mp4_split_options_t const* options)
+{
+  uint32_t timescale = trak->mdia_->mdhd_->timescale_;
+  float min_duration = options->min_fragment_duration;
+
+  // by default a fragment is at least as long as the target duration
+  if(min_duration <= 0.0 || min_duration > options->fragment_duration)
+  {
+    min_duration = options->fragment_duration;
+  }
+
+  trak_plan_fragments(trak,
+    (uint64_t)(options->fragment_duration * timescale),
+    (uint64_t)(min_duration * timescale));
+}
+
+static uint64_t fragment_bitrate(uint64_t bytes, uint64_t duration,
+                                 uint32_t timescale)
+{
+  return duration == 0 ? 0 : bytes * 8 * timescale / duration;
+}
+
+// Measure the average bitrate of the track and the peak bitrate of its
+// (smooth streaming) fragments. The samples before the first smooth sync
+// sample are counted with the first fragment.
+static void trak_measure_bitrates(trak_t* trak)
+{
+  uint32_t timescale = trak->mdia_->mdhd_->timescale_;
+  samples_t const* first = trak->samples_;
+  samples_t const* last = trak->samples_ + trak->samples_size_;
+  samples_t const* start = first;
+  samples_t const* sample;
+  int has_fragment;
+  uint64_t total_bytes = 0;
+  uint64_t fragment_bytes = 0;
+  uint64_t max_bitrate = 0;
+  uint64_t bitrate;
+
+  trak->avg_bitrate_ = 0;
+  trak->max_bitrate_ = 0;
+
+  if(first == NULL || first == last || timescale == 0)
+  {
+    return;
+  }
+
+  has_fragment = first->is_smooth_ss_;
+  for(sample = first; sample != last; ++sample)
+  {
+    if(sample != first && sample->is_smooth_ss_)
+    {
+      if(has_fragment)
+      {
+        bitrate = fragment_bitrate(fragment_bytes,
+                                   sample->pts_ - start->pts_, timescale);
+        if(bitrate > max_bitrate)
+        {
+          max_bitrate = bitrate;
+        }
+        start = sample;
+        fragment_bytes = 0;
+      }
+      has_fragment = 1;
+    }
+    fragment_bytes += sample->size_;
+    total_bytes += sample->size_;
+  }
+
+  // the last fragment
+  bitrate = fragment_bitrate(fragment_bytes, last->pts_ - start->pts_,
+                             timescale);
+  if(bitrate > max_bitrate)
+  {
+    max_bitrate = bitrate;
+  }
+
+  trak->avg_bitrate_ = (uint32_t)
+    fragment_bitrate(total_bytes, last->pts_ - first->pts_, timescale);
+  trak->max_bitrate_ = (uint32_t)max_bitrate;
+  if(trak->max_bitrate_ < trak->avg_bitrate_)
+  {
+    trak->max_bitrate_ = trak->avg_bitrate_;
+  }
+}
+
+// Reduces a track to its sync samples, for scrubbing and trick play. The
+// keyframes keep their decoding times, so each keyframe lasts until the next
+// one (the first one from the start of the track). Every keyframe becomes a
+// chunk of its own and the sample tables are rebuilt from the index.
+static void trak_reduce_to_keyframes(mp4_context_t const* mp4_context,
+                                     trak_t* trak)
+{
+  stbl_t* stbl = trak->mdia_->minf_->stbl_;
+  samples_t* samples = trak->samples_;
+  chunks_t* chunks = NULL;
+  unsigned int keyframes = 0;
+  unsigned int chunk = 0;
+  uint64_t start_pts;
+  unsigned int s;
+
+  // without an 'stss' every sample already is a sync sample
+  if(stbl->stss_ == NULL || samples == NULL)
+  {
+    return;
+  }
+
+  if(trak->chunks_size_)
+  {
+    // the index may mark fewer sync samples than there are 'stss' entries
+    for(s = 0; s != trak->samples_size_; ++s)
+    {
+      if(samples[s].is_ss_)
+      {
+        ++keyframes;
+      }
+    }
+    chunks = (chunks_t*)malloc((keyframes + 1) * sizeof(chunks_t));
+    keyframes = 0;
+  }
+
+  start_pts = samples[0].pts_;
+  for(s = 0; s != trak->samples_size_; ++s)
+  {
+    if(!samples[s].is_ss_)
+    {
+      continue;
+    }
+
+    if(chunks)
+    {
+      while(chunk + 1 != trak->chunks_size_ &&
+            trak->chunks_[chunk + 1].sample_ <= s)
+      {
+        ++chunk;
+      }
+      chunks[keyframes].sample_ = keyframes;
+      chunks[keyframes].size_ = 1;
+      chunks[keyframes].id_ = trak->chunks_[chunk].id_;
+      chunks[keyframes].pos_ = samples[s].pos_;
+    }
+
+    samples[keyframes] = samples[s];
+    ++keyframes;
+  }
+  // the end information
+  samples[keyframes] = samples[trak->samples_size_];
+  if(keyframes)
+  {
+    samples[0].pts_ = start_pts;
+  }
+  trak->samples_size_ = keyframes;
+
+  if(chunks)
+  {
+    free(trak->chunks_);
+    trak->chunks_ = chunks;
+    trak->chunks_size_ = keyframes;
+  }
+
+  MP4_INFO("trak %u: trick play with %u keyframes\n",
+           trak->tkhd_->track_id_, keyframes);
+
+  stss_exit(stbl->stss_);
+  stbl->stss_ = NULL;
+
+  // stts and ctts, run-length encoded
+  {
+    stts_t* stts = stbl->stts_;
+    stts->table_ = (stts_table_t*)
+      realloc(stts->table_, (keyframes + 1) * sizeof(stts_table_t));
+    stts->entries_ = 0;
+    for(s = 0; s != keyframes; ++s)
+    {
+      uint32_t duration = (uint32_t)(samples[s + 1].pts_ - samples[s].pts_);
+      if(s != 0 && stts->table_[stts->entries_ - 1].sample_duration_ == duration)
+      {
+        ++stts->table_[stts->entries_ - 1].sample_count_;
+      }
+      else
+      {
+        stts->table_[stts->entries_].sample_count_ = 1;
+        stts->table_[stts->entries_].sample_duration_ = duration;
+        ++stts->entries_;
+      }
+    }
+  }
+
+  if(stbl->ctts_)
+  {
+    ctts_t* ctts = stbl->ctts_;
+    ctts->table_ = (ctts_table_t*)
+      realloc(ctts->table_, (keyframes + 1) * sizeof(ctts_table_t));
+    ctts->entries_ = 0;
+    for(s = 0; s != keyframes; ++s)
+    {
+      if(s != 0 && ctts->table_[ctts->entries_ - 1].sample_offset_ == samples[s].cto_)
+      {
+        ++ctts->table_[ctts->entries_ - 1].sample_count_;
+      }
+      else
+      {
+        ctts->table_[ctts->entries_].sample_count_ = 1;
+        ctts->table_[ctts->entries_].sample_offset_ = samples[s].cto_;
+        ++ctts->entries_;
+      }
+    }
+  }
+
+  if(stbl->stsz_)
+  {
+    stsz_t* stsz = stbl->stsz_;
+    if(stsz->sample_size_ == 0)
+    {
+      for(s = 0; s != keyframes; ++s)
+      {
+        stsz->sample_sizes_[s] = samples[s].size_;
+      }
+    }
+    stsz->entries_ = keyframes;
+  }
+
+  // one keyframe per chunk
+  if(chunks && stbl->stsc_ && stbl->stco_)
+  {
+    stsc_t* stsc = stbl->stsc_;
+    stco_t* stco = stbl->stco_;
+    stsc->table_ = (stsc_table_t*)
+      realloc(stsc->table_, (keyframes + 1) * sizeof(stsc_table_t));
+    stsc->entries_ = 0;
+    stco->chunk_offsets_ = (uint64_t*)
+      realloc(stco->chunk_offsets_, (keyframes + 1) * sizeof(uint64_t));
+    stco->entries_ = keyframes;
+    for(s = 0; s != keyframes; ++s)
+    {
+      if(s == 0 ||
+         stsc->table_[stsc->entries_ - 1].id_ != (uint32_t)chunks[s].id_)
+      {
+        stsc->table_[stsc->entries_].chunk_ = s;
+        stsc->table_[stsc->entries_].samples_ = 1;
+        stsc->table_[stsc->entries_].id_ = chunks[s].id_;
+        ++stsc->entries_;
+      }
+      stco->chunk_offsets_[s] = chunks[s].pos_;
+    }
+  }
+}
+
 extern int moov_build_index(struct mp4_context_t const* mp4_context,
-                            struct moov_t* moov)
+                            struct moov_t* moov,
+                            struct mp4_split_options_t const* options)
 {
   // Build the track index
   trak_t* audio_trak = NULL;
   trak_t* video_trak = NULL;
+  int plan_fragments = options && options->fragment_duration > 0.0;
   unsigned int track;
   for(track = 0; track != moov->tracks_; ++track)
   {
@@ -1894,19 +2226,79 @@ extern int moov_build_index(struct mp4_context_t const* mp4_context,
       video_trak = trak;
       break;
     }
-    if(!trak_build_index(mp4_context, trak))
+    if(!trak_build_index(mp4_context, trak,
+                         options && options->index_times_only))
     {
       return 0;
     }
+
+    // Skip keyframes so that the fragments have the requested duration.
+    if(plan_fragments && trak->mdia_->minf_->stbl_->stss_ &&
+       trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
+    {
+      trak_plan_fragments_in_seconds(trak, options);
+    }
   }
 
-  // Copy the sync sample markers for smooth streaming from the video trak
-  // to the audio trak in case the audio track doesn't have an 'stss'.
-  if(audio_trak && !audio_trak->mdia_->minf_->stbl_->stss_)
+  if(plan_fragments)
   {
+    // The other tracks follow the fragments of the video track, so that
+    // their boundaries don't drift apart. Without a video track every track
+    // is planned on its own (every audio sample is a sync sample).
+    for(track = 0; track != moov->tracks_; ++track)
+    {
+      trak_t* trak = moov->traks_[track];
+      if(trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e') ||
+         (trak != audio_trak && !trak->mdia_->minf_->stbl_->stss_))
+      {
+        continue;
+      }
+      if(video_trak)
+      {
+        unsigned int i;
+        for(i = 0; i != trak->samples_size_; ++i)
+        {
+          trak->samples_[i].is_smooth_ss_ = 0;
+        }
+        copy_sync_samples_to_audio_track(video_trak, trak);
+      }
+      else
+      {
+        trak_plan_fragments_in_seconds(trak, options);
+      }
+    }
+  }
+  else if(audio_trak && !audio_trak->mdia_->minf_->stbl_->stss_)
+  {
+    // Copy the sync sample markers for smooth streaming from the video trak
+    // to the audio trak in case the audio track doesn't have an 'stss'.
     copy_sync_samples_to_audio_track(video_trak, audio_trak);
   }
 
+  // Trick play only keeps the keyframes of the video tracks. The smooth sync
+  // samples are keyframes, so the fragments keep their times.
+  if(options && options->trickplay)
+  {
+    for(track = 0; track != moov->tracks_; ++track)
+    {
+      trak_t* trak = moov->traks_[track];
+      if(trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
+      {
+        trak_reduce_to_keyframes(mp4_context, trak);
+      }
+    }
+  }
+
+  // The fragments are known now, so measure the bitrates
+  for(track = 0; track != moov->tracks_; ++track)
+  {
+    trak_measure_bitrates(moov->traks_[track]);
+    MP4_INFO("trak %u: avg_bitrate=%u max_bitrate=%u\n",
+             moov->traks_[track]->tkhd_->track_id_,
+             moov->traks_[track]->avg_bitrate_,
+             moov->traks_[track]->max_bitrate_);
+  }
+
   return 1;
 }
 
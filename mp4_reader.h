@@ -24,6 +24,7 @@ extern "C" {
 
 struct mp4_context_t;
 struct moov_t;
+struct mp4_split_options_t;
 
 struct atom_read_list_t
 {
@@ -48,7 +49,8 @@ void* moov_read(struct mp4_context_t const* mp4_context,
 
 MOD_STREAMING_DLL_LOCAL extern
 int moov_build_index(struct mp4_context_t const* mp4_context,
-                     struct moov_t* moov);
+                     struct moov_t* moov,
+                     struct mp4_split_options_t const* options);
 
 #ifdef __cplusplus
 } /* extern C definitions */
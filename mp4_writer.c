@@ -437,11 +437,55 @@ static unsigned char* mdia_write(void const* atom, unsigned char* buffer)
   return buffer;
 }
 
+static unsigned char* elst_write(void const* atom, unsigned char* buffer)
+{
+  elst_t const* elst = (elst_t const*)atom;
+  unsigned int i;
+
+  buffer = write_8(buffer, elst->version_);
+  buffer = write_24(buffer, elst->flags_);
+  buffer = write_32(buffer, elst->entries_);
+  for(i = 0; i != elst->entries_; ++i)
+  {
+    elst_table_t const* entry = &elst->table_[i];
+    if(elst->version_ == 0)
+    {
+      buffer = write_32(buffer, (uint32_t)entry->segment_duration_);
+      buffer = write_32(buffer, (uint32_t)entry->media_time_);
+    }
+    else
+    {
+      buffer = write_64(buffer, entry->segment_duration_);
+      buffer = write_64(buffer, (uint64_t)entry->media_time_);
+    }
+    buffer = write_16(buffer, (uint16_t)entry->media_rate_integer_);
+    buffer = write_16(buffer, (uint16_t)entry->media_rate_fraction_);
+  }
+
+  return buffer;
+}
+
+static unsigned char* edts_write(void const* atom, unsigned char* buffer)
+{
+  edts_t const* edts = (edts_t const*)atom;
+  atom_write_list_t atom_write_list[] = {
+    { FOURCC('e', 'l', 's', 't'), edts->elst_, &elst_write }
+  };
+
+  buffer = atom_writer(NULL,
+                       atom_write_list,
+                       sizeof(atom_write_list) / sizeof(atom_write_list[0]),
+                       buffer);
+
+  return buffer;
+}
+
 static unsigned char* trak_write(void const* atom, unsigned char* buffer)
 {
   trak_t const* trak = (trak_t const*)atom;
   atom_write_list_t atom_write_list[] = {
     { FOURCC('t', 'k', 'h', 'd'), trak->tkhd_, &tkhd_write },
+    { FOURCC('e', 'd', 't', 's'), trak->edts_, &edts_write },
     { FOURCC('m', 'd', 'i', 'a'), trak->mdia_, &mdia_write }
   };
 
@@ -497,6 +541,42 @@ static unsigned char* mvhd_write(void const* atom, unsigned char* buffer)
   return buffer;
 }
 
+static unsigned char* trex_write(void const* atom, unsigned char* buffer)
+{
+  trex_t const* trex = (trex_t const*)atom;
+
+  buffer = write_8(buffer, trex->version_);
+  buffer = write_24(buffer, trex->flags_);
+  buffer = write_32(buffer, trex->track_id_);
+  buffer = write_32(buffer, trex->default_sample_description_index_);
+  buffer = write_32(buffer, trex->default_sample_duration_);
+  buffer = write_32(buffer, trex->default_sample_size_);
+  buffer = write_32(buffer, trex->default_sample_flags_);
+
+  return buffer;
+}
+
+static unsigned char* mvex_write(void const* atom, unsigned char* buffer)
+{
+  mvex_t const* mvex = (mvex_t const*)atom;
+  unsigned int i;
+
+  buffer = atom_writer(mvex->unknown_atoms_, NULL, 0, buffer);
+
+  for(i = 0; i != mvex->tracks_; ++i)
+  {
+    atom_write_list_t trex_atom_write_list[] = {
+      { FOURCC('t', 'r', 'e', 'x'), mvex->trexs_[i], &trex_write },
+    };
+    buffer = atom_writer(0,
+                         trex_atom_write_list,
+                         sizeof(trex_atom_write_list) / sizeof(trex_atom_write_list[0]),
+                         buffer);
+  }
+
+  return buffer;
+}
+
 extern void moov_write(struct moov_t* atom, unsigned char* buffer)
 {
   unsigned i;
@@ -528,6 +608,16 @@ extern void moov_write(struct moov_t* atom, unsigned char* buffer)
                          sizeof(trak_atom_write_list) / sizeof(trak_atom_write_list[0]),
                          buffer);
   }
+
+  {
+    atom_write_list_t mvex_atom_write_list[] = {
+      { FOURCC('m', 'v', 'e', 'x'), atom->mvex_, &mvex_write },
+    };
+    buffer = atom_writer(0,
+                         mvex_atom_write_list,
+                         sizeof(mvex_atom_write_list) / sizeof(mvex_atom_write_list[0]),
+                         buffer);
+  }
   write_32(atom_start, (uint32_t)(buffer - atom_start));
 }
 
@@ -13,6 +13,7 @@
 
 #ifdef __cplusplus
 #define __STDC_FORMAT_MACROS // C++ should define this for PRIu64
+#define __STDC_LIMIT_MACROS  // C++ should define this for UINT64_MAX
 #endif
 
 #include "output_flv.h"
@@ -28,102 +29,534 @@
 #define RTMP_AVC_SEQUENCE_HEADER  0
 #define RTMP_AVC_NALU             1
 
+#define FLV_TAG_AUDIO             8
+#define FLV_TAG_VIDEO             9
+#define FLV_TAG_SCRIPT            18
+
+#define FLV_HEADER_SIZE           9
+#define FLV_TAG_HEADER_SIZE       11
+#define FLV_PREVIOUS_TAG_SIZE     4
+
+// AAC (44kHz, 16 bit, stereo as required by the spec)
+#define FLV_SOUND_AAC             0xaf
+
+// AVC
+#define FLV_CODEC_AVC             7
+
+// the audiocodecid (SoundFormat) of AAC and MP3
+#define FLV_SOUND_FORMAT_AAC      10
+#define FLV_SOUND_FORMAT_MP3      2
+#define FLV_SOUND_FORMAT_MP3_8KHZ 14
+
+#define AMF0_NUMBER               0x00
+#define AMF0_BOOLEAN              0x01
+#define AMF0_STRING               0x02
+#define AMF0_OBJECT               0x03
+#define AMF0_ECMA_ARRAY           0x08
+#define AMF0_OBJECT_END           0x09
+#define AMF0_STRICT_ARRAY         0x0a
+
+// an upper bound for the onMetaData tag without the keyframe index
+#define FLV_METADATA_SIZE         512
+
+struct flv_track_t
+{
+  struct trak_t const* trak_;
+  struct sample_entry_t const* sample_entry_;
+  unsigned int tag_type_;
+  unsigned int sound_format_;       // the SoundFormat (audiocodecid)
+  unsigned int sound_header_;       // the first byte of the AUDIODATA
+  // the size of the AUDIODATA/VIDEODATA header in front of the sample
+  unsigned int media_header_size_;
+  unsigned int sample_;
+  unsigned int end_;
+};
+
+struct flv_metadata_t
+{
+  double duration_;
+  unsigned int width_;
+  unsigned int height_;
+  unsigned int videocodecid_;
+  unsigned int audiocodecid_;
+  double filesize_;
+  // the keyframe index, the times (in seconds) and the byte offsets of the
+  // tags of the video keyframes.
+  unsigned int keyframes_;
+  double* times_;
+  double* filepositions_;
+};
+
+// FLV uses a fixed 1000 timescale
+static uint64_t flv_time(struct flv_track_t const* track, uint64_t t)
+{
+  return trak_time_to_moov_time(t, 1000,
+    track->trak_->mdia_->mdhd_->timescale_);
+}
+
+// The composition time offsets of a 'ctts' version 1 are signed, and so is
+// the CompositionTime of the AVCVIDEOPACKET.
+static int flv_composition_time(struct flv_track_t const* track,
+                                unsigned int cto)
+{
+  int32_t offset = (int32_t)cto;
+
+  return offset < 0 ? -(int)flv_time(track, (uint64_t)(-(int64_t)offset))
+                    : (int)flv_time(track, (uint64_t)offset);
+}
+
+// The SoundFormat in the upper 4 bits, followed by the SoundRate (5.5, 11, 22
+// or 44kHz), the SoundSize (8 or 16 bit) and the SoundType (mono or stereo)
+static unsigned int flv_sound_header(unsigned int sound_format,
+                                     struct sample_entry_t const* sample_entry)
+{
+  unsigned int samplerate = sample_entry->nSamplesPerSec;
+  unsigned int sound_rate = samplerate >= 44100 ? 3 :
+                            samplerate >= 22050 ? 2 :
+                            samplerate >= 11025 ? 1 : 0;
+  unsigned int sound_size = sample_entry->wBitsPerSample == 8 ? 0 : 1;
+  unsigned int sound_type = sample_entry->nChannels == 1 ? 0 : 1;
+
+  return (sound_format << 4) + (sound_rate << 2) + (sound_size << 1) +
+         sound_type;
+}
+
+static unsigned char* flv_write_tag_header(unsigned char* p,
+                                           unsigned int tag_type,
+                                           unsigned int data_size,
+                                           uint32_t timestamp)
+{
+  p = write_8(p, tag_type);
+  p = write_24(p, data_size);
+  p = write_24(p, timestamp & 0xffffff);
+  p = write_8(p, timestamp >> 24);   // TimestampExtended
+  p = write_24(p, 0);                // StreamID
+
+  return p;
+}
+
+static unsigned char* amf0_write_name(unsigned char* p, char const* name)
+{
+  unsigned int len = (unsigned int)strlen(name);
+
+  p = write_16(p, len);
+  memcpy(p, name, len);
+
+  return p + len;
+}
+
+static unsigned char* amf0_write_number(unsigned char* p, double v)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &v, sizeof(bits));
+  p = write_8(p, AMF0_NUMBER);
+  p = write_64(p, bits);
+
+  return p;
+}
+
+static unsigned char* amf0_write_boolean(unsigned char* p, int v)
+{
+  p = write_8(p, AMF0_BOOLEAN);
+  p = write_8(p, v ? 1 : 0);
+
+  return p;
+}
+
+static unsigned char* amf0_write_strict_array(unsigned char* p,
+                                              double const* v,
+                                              unsigned int n)
+{
+  unsigned int i;
+
+  p = write_8(p, AMF0_STRICT_ARRAY);
+  p = write_32(p, n);
+  for(i = 0; i != n; ++i)
+  {
+    p = amf0_write_number(p, v[i]);
+  }
+
+  return p;
+}
+
+static unsigned char* amf0_write_object_end(unsigned char* p)
+{
+  p = write_16(p, 0);
+  p = write_8(p, AMF0_OBJECT_END);
+
+  return p;
+}
+
+// The onMetaData script tag. The size of the tag only depends on the tracks
+// and the number of keyframes, not on the values.
+static unsigned char* flv_write_metadata(unsigned char* p,
+                                         struct flv_metadata_t const* meta)
+{
+  unsigned char* tag = p;
+  unsigned char* data;
+  unsigned int properties = 2;
+  unsigned int data_size;
+
+  if(meta->videocodecid_)
+  {
+    properties += 3;
+  }
+  if(meta->audiocodecid_)
+  {
+    properties += 1;
+  }
+  if(meta->keyframes_)
+  {
+    properties += 2;
+  }
+
+  p += FLV_TAG_HEADER_SIZE;
+  data = p;
+
+  p = write_8(p, AMF0_STRING);
+  p = amf0_write_name(p, "onMetaData");
+
+  p = write_8(p, AMF0_ECMA_ARRAY);
+  p = write_32(p, properties);
+  p = amf0_write_name(p, "duration");
+  p = amf0_write_number(p, meta->duration_);
+  if(meta->videocodecid_)
+  {
+    p = amf0_write_name(p, "width");
+    p = amf0_write_number(p, meta->width_);
+    p = amf0_write_name(p, "height");
+    p = amf0_write_number(p, meta->height_);
+    p = amf0_write_name(p, "videocodecid");
+    p = amf0_write_number(p, meta->videocodecid_);
+  }
+  if(meta->audiocodecid_)
+  {
+    p = amf0_write_name(p, "audiocodecid");
+    p = amf0_write_number(p, meta->audiocodecid_);
+  }
+  p = amf0_write_name(p, "filesize");
+  p = amf0_write_number(p, meta->filesize_);
+  if(meta->keyframes_)
+  {
+    p = amf0_write_name(p, "hasKeyframes");
+    p = amf0_write_boolean(p, 1);
+    p = amf0_write_name(p, "keyframes");
+    p = write_8(p, AMF0_OBJECT);
+    p = amf0_write_name(p, "times");
+    p = amf0_write_strict_array(p, meta->times_, meta->keyframes_);
+    p = amf0_write_name(p, "filepositions");
+    p = amf0_write_strict_array(p, meta->filepositions_, meta->keyframes_);
+    p = amf0_write_object_end(p);
+  }
+  p = amf0_write_object_end(p);
+
+  data_size = (unsigned int)(p - data);
+  flv_write_tag_header(tag, FLV_TAG_SCRIPT, data_size, 0);
+  p = write_32(p, FLV_TAG_HEADER_SIZE + data_size);
+
+  return p;
+}
+
+static unsigned char* flv_write_media_header(unsigned char* p,
+                                             struct flv_track_t const* track,
+                                             int is_sequence_header,
+                                             int is_keyframe,
+                                             int composition_time)
+{
+  if(track->tag_type_ == FLV_TAG_VIDEO)
+  {
+    // VIDEODATA + AVCVIDEOPACKET
+    p = write_8(p, ((is_keyframe ? 1 : 2) << 4) + FLV_CODEC_AVC);
+    p = write_8(p, is_sequence_header ? RTMP_AVC_SEQUENCE_HEADER
+                                      : RTMP_AVC_NALU);
+    p = write_24(p, (unsigned int)composition_time & 0xffffff);
+  }
+  else
+  {
+    // AUDIODATA (+ AACAUDIODATA)
+    p = write_8(p, track->sound_header_);
+    if(track->sound_format_ == FLV_SOUND_FORMAT_AAC)
+    {
+      p = write_8(p, is_sequence_header ? RTMP_AAC_SEQUENCE_HEADER
+                                        : RTMP_AAC_RAW);
+    }
+  }
+
+  return p;
+}
+
+// The tracks that can be carried in FLV: AVC video and AAC/MP3 audio
+static unsigned int flv_tracks_init(struct mp4_context_t const* mp4_context,
+                                    unsigned int* trak_sample_start,
+                                    unsigned int* trak_sample_end,
+                                    struct flv_track_t* tracks)
+{
+  struct moov_t const* moov = mp4_context->moov;
+  unsigned int flv_tracks = 0;
+  unsigned int i;
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trak_t const* trak = moov->traks_[i];
+    struct sample_entry_t const* sample_entry =
+      &trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0];
+    struct flv_track_t* track = &tracks[flv_tracks];
+
+    track->trak_ = trak;
+    track->sample_entry_ = sample_entry;
+    track->sound_format_ = 0;
+    track->sound_header_ = 0;
+    track->sample_ = trak_sample_start[i];
+    track->end_ = trak_sample_end[i];
+
+    switch(trak->mdia_->hdlr_->handler_type_)
+    {
+    case FOURCC('v', 'i', 'd', 'e'):
+      if(sample_entry->fourcc_ != FOURCC('a', 'v', 'c', '1'))
+      {
+        MP4_WARNING("%s", "[Warning] skipping non-AVC video track\n");
+        continue;
+      }
+      track->tag_type_ = FLV_TAG_VIDEO;
+      track->media_header_size_ = 5;
+      break;
+    case FOURCC('s', 'o', 'u', 'n'):
+      if(sample_entry->wFormatTag == 0x00ff)
+      {
+        track->sound_format_ = FLV_SOUND_FORMAT_AAC;
+        track->sound_header_ = FLV_SOUND_AAC;
+        track->media_header_size_ = 2;
+      }
+      else if(sample_entry->wFormatTag == 0x0055)
+      {
+        track->sound_format_ = sample_entry->nSamplesPerSec == 8000
+                             ? FLV_SOUND_FORMAT_MP3_8KHZ : FLV_SOUND_FORMAT_MP3;
+        track->sound_header_ =
+          flv_sound_header(track->sound_format_, sample_entry);
+        track->media_header_size_ = 1;
+      }
+      else
+      {
+        MP4_WARNING("%s", "[Warning] skipping non-AAC/MP3 audio track\n");
+        continue;
+      }
+      track->tag_type_ = FLV_TAG_AUDIO;
+      break;
+    default:
+      continue;
+    }
+    ++flv_tracks;
+  }
+
+  return flv_tracks;
+}
+
+// The FLV is a single memory block with all the headers (the file header, the
+// onMetaData tag, the sequence headers and the tag headers), interleaved with
+// the samples as file buckets. The samples of the tracks are merged in
+// decoding order. The onMetaData tag has a fixed size, so its space is reserved
+// up front and it is filled in once the layout of the tags is known.
 extern int output_flv(struct mp4_context_t const* mp4_context,
                       unsigned int* trak_sample_start,
                       unsigned int* trak_sample_end,
                       struct bucket_t** buckets,
                       struct mp4_split_options_t* options)
 {
-  struct moov_t* moov = mp4_context->moov;
-  unsigned int track = 0;
+  struct flv_track_t tracks[MAX_TRACKS];
+  unsigned int flv_tracks;
+  unsigned int i;
+  size_t block_size = FLV_HEADER_SIZE + FLV_PREVIOUS_TAG_SIZE;
+  unsigned char* block;
+  unsigned char* piece;
+  unsigned char* p;
+  unsigned char* metadata;
+  struct bucket_shared_t* shared;
+  struct flv_metadata_t meta;
+  struct flv_track_t const* keyframe_track = NULL;
+  unsigned int keyframe = 0;
+  uint64_t start_time = UINT64_MAX;
+  uint64_t end_time = 0;
+  uint64_t payload = 0;
+  int has_audio = 0;
+  int has_video = 0;
+
+  flv_tracks = flv_tracks_init(mp4_context, trak_sample_start, trak_sample_end,
+                               tracks);
 
-  for(track = 0; track != moov->tracks_; ++track)
+  memset(&meta, 0, sizeof(meta));
+
+  for(i = 0; i != flv_tracks; ++i)
   {
-    struct trak_t* trak = moov->traks_[track];
-    struct stsd_t const* stsd = trak->mdia_->minf_->stbl_->stsd_;
-    struct sample_entry_t const* sample_entry = &stsd->sample_entries_[0];
-    unsigned int start_sample = trak_sample_start[track];
-    unsigned int end_sample = trak_sample_end[track];
-    unsigned int s;
-
-    if(trak->mdia_->hdlr_->handler_type_ != FOURCC('v', 'i', 'd', 'e'))
-      continue;
+    struct flv_track_t const* track = &tracks[i];
+    block_size += FLV_TAG_HEADER_SIZE + track->media_header_size_ +
+                  track->sample_entry_->codec_private_data_length_ +
+                  FLV_PREVIOUS_TAG_SIZE;
+    block_size += (track->end_ - track->sample_) *
+      (FLV_TAG_HEADER_SIZE + track->media_header_size_ +
+       FLV_PREVIOUS_TAG_SIZE);
 
-    if(trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
+    if(track->sample_ != track->end_)
     {
-      unsigned char* buffer = (unsigned char*)malloc(1 + 1 + 3 + sample_entry->codec_private_data_length_);
-      unsigned char* p = buffer;
-
-      p = write_8(p, 0x17);
-      p = write_8(p, RTMP_AVC_SEQUENCE_HEADER);
-      p = write_24(p, 0);
-      memcpy(p, sample_entry->codec_private_data_,
-             sample_entry->codec_private_data_length_);
-      p += sample_entry->codec_private_data_length_;
-      bucket_insert_tail(buckets, bucket_init_memory(buffer, p - buffer));
-      free(buffer);
-    } else
-    if(trak->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n'))
+      uint64_t t = flv_time(track, track->trak_->samples_[track->sample_].pts_);
+      if(t < start_time)
+      {
+        start_time = t;
+      }
+      t = flv_time(track, track->trak_->samples_[track->end_].pts_);
+      if(t > end_time)
+      {
+        end_time = t;
+      }
+    }
+    if(track->tag_type_ == FLV_TAG_AUDIO)
     {
-      unsigned char* buffer = (unsigned char*)malloc(1 + 1 + sample_entry->codec_private_data_length_);
-      unsigned char* p = buffer;
-
-      p = write_8(p, 0xaf);
-      p = write_8(p, RTMP_AAC_SEQUENCE_HEADER);
-
-      memcpy(p, sample_entry->codec_private_data_,
-             sample_entry->codec_private_data_length_);
-      p += sample_entry->codec_private_data_length_;
-      bucket_insert_tail(buckets, bucket_init_memory(buffer, p - buffer));
-      free(buffer);
-    } else
+      if(!has_audio)
+      {
+        meta.audiocodecid_ = track->sound_format_;
+      }
+      has_audio = 1;
+    }
+    else
     {
-      continue;
+      if(!has_video)
+      {
+        unsigned int s;
+        keyframe_track = track;
+        meta.width_ = track->trak_->tkhd_->width_ / 65536;
+        meta.height_ = track->trak_->tkhd_->height_ / 65536;
+        meta.videocodecid_ = FLV_CODEC_AVC;
+        for(s = track->sample_; s != track->end_; ++s)
+        {
+          if(track->trak_->samples_[s].is_ss_)
+          {
+            ++meta.keyframes_;
+          }
+        }
+      }
+      has_video = 1;
     }
+  }
+  if(start_time == UINT64_MAX)
+  {
+    start_time = 0;
+    end_time = 0;
+  }
+  meta.duration_ = (double)(end_time - start_time) / 1000.0;
 
-    for(s = start_sample; s != end_sample; ++s)
+  if(meta.keyframes_)
+  {
+    meta.times_ = (double*)calloc(meta.keyframes_ * 2, sizeof(double));
+    meta.filepositions_ = meta.times_ + meta.keyframes_;
+  }
+  block_size += FLV_METADATA_SIZE + meta.keyframes_ * 2 * 9;
+
+  block = (unsigned char*)malloc(block_size);
+  shared = bucket_shared_init(block);
+  p = block;
+
+  // FLV header
+  p = write_8(p, 'F');
+  p = write_8(p, 'L');
+  p = write_8(p, 'V');
+  p = write_8(p, 1);
+  p = write_8(p, (has_audio ? 4 : 0) | (has_video ? 1 : 0));
+  p = write_32(p, FLV_HEADER_SIZE);
+  p = write_32(p, 0);                 // PreviousTagSize0
+
+  // reserve the onMetaData tag
+  metadata = p;
+  p = flv_write_metadata(p, &meta);
+
+  // sequence headers (MP3 doesn't have one)
+  for(i = 0; i != flv_tracks; ++i)
+  {
+    struct flv_track_t const* track = &tracks[i];
+    struct sample_entry_t const* sample_entry = track->sample_entry_;
+    unsigned int data_size;
+
+    if(track->tag_type_ == FLV_TAG_AUDIO &&
+       track->sound_format_ != FLV_SOUND_FORMAT_AAC)
     {
-      uint64_t sample_pos = trak->samples_[s].pos_;
-      unsigned int sample_size = trak->samples_[s].size_;
-      int cto = trak->samples_[s].cto_;
+      continue;
+    }
 
-      // FLV uses a fixed 1000 timescale
-      unsigned int composition_time = (unsigned int)
-        (trak_time_to_moov_time(cto, 1000, trak->mdia_->mdhd_->timescale_));
+    data_size = track->media_header_size_ +
+                sample_entry->codec_private_data_length_;
+    p = flv_write_tag_header(p, track->tag_type_, data_size, 0);
+    p = flv_write_media_header(p, track, 1, 1, 0);
+    memcpy(p, sample_entry->codec_private_data_,
+           sample_entry->codec_private_data_length_);
+    p += sample_entry->codec_private_data_length_;
+    p = write_32(p, FLV_TAG_HEADER_SIZE + data_size);
+  }
 
-      MP4_INFO(
-        "frame=%u pts=%u offset=%llu size=%u\n",
-        s, composition_time, sample_pos, sample_size);
+  piece = block;
+  for(;;)
+  {
+    struct flv_track_t* track = NULL;
+    struct samples_t const* sample;
+    uint64_t dts = 0;
+    unsigned int data_size;
+    int composition_time;
 
-      if(trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
+    // the track with the earliest next sample
+    for(i = 0; i != flv_tracks; ++i)
+    {
+      struct flv_track_t* t = &tracks[i];
+      if(t->sample_ != t->end_)
       {
-//        if(is_avc)
+        uint64_t t_dts = flv_time(t, t->trak_->samples_[t->sample_].pts_);
+        if(track == NULL || t_dts < dts)
         {
-          // VIDEODATA
-          unsigned char header[5];
-          unsigned int is_keyframe = trak->samples_[s].is_ss_;
-          unsigned int codec_id = 7;          // AVC
-          write_8(header, ((is_keyframe ? 1 : 2) << 4) + codec_id);
-
-          write_8(header + 1, RTMP_AVC_NALU);
-          write_24(header + 2, composition_time);
-          bucket_insert_tail(buckets, bucket_init_memory(header, 5));
-          bucket_insert_tail(buckets, bucket_init_file(sample_pos, sample_size));
+          track = t;
+          dts = t_dts;
         }
       }
-      else
-      {
-        // AUDIODATA
-        unsigned char header[2];
-        write_8(header, 0xaf);
-        write_8(header + 1, RTMP_AAC_RAW);
-        // AACAUDIODATA
-        bucket_insert_tail(buckets, bucket_init_memory(header, 2));
-        bucket_insert_tail(buckets, bucket_init_file(sample_pos, sample_size));
-      }
     }
+    if(track == NULL)
+    {
+      break;
+    }
+
+    sample = &track->trak_->samples_[track->sample_];
+    composition_time = flv_composition_time(track, sample->cto_);
+    data_size = track->media_header_size_ + sample->size_;
+
+    MP4_INFO("frame=%u dts=%llu cto=%d offset=%llu size=%u\n",
+             track->sample_, dts, composition_time, sample->pos_,
+             sample->size_);
+
+    if(track == keyframe_track && sample->is_ss_)
+    {
+      meta.times_[keyframe] = (double)(dts - start_time) / 1000.0;
+      meta.filepositions_[keyframe] = (double)((p - block) + payload);
+      ++keyframe;
+    }
+
+    p = flv_write_tag_header(p, track->tag_type_, data_size,
+                             (uint32_t)(dts - start_time));
+    p = flv_write_media_header(p, track, 0, sample->is_ss_,
+                               composition_time);
+    bucket_insert_tail(buckets,
+      bucket_init_shared(shared, piece - block, p - piece));
+    bucket_insert_tail(buckets, bucket_init_file(sample->pos_, sample->size_));
+    payload += sample->size_;
+
+    piece = p;
+    p = write_32(p, FLV_TAG_HEADER_SIZE + data_size);
+    ++track->sample_;
   }
 
+  bucket_insert_tail(buckets,
+    bucket_init_shared(shared, piece - block, p - piece));
+
+  meta.filesize_ = (double)((p - block) + payload);
+  flv_write_metadata(metadata, &meta);
+  free(meta.times_);
+
+  bucket_shared_exit(shared);
+
   return 1;
 }
 
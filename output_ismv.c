@@ -57,29 +57,12 @@ static __inline unsigned int
 #endif
 #endif
 
-static const uint32_t aac_samplerates[] =
-{
-  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
-  16000, 12000, 11025,  8000,  7350,     0,     0,     0
-};
-
 static const uint32_t aac_channels[] =
 {
   0, 1, 2, 3, 4, 5, 6, 8,
   0, 0, 0, 0, 0, 0, 0, 0
 };
 
-static int mp4_samplerate_to_index(unsigned int samplerate)
-{
-  unsigned int i;
-  for(i = 0; i != 13; ++i)
-  {
-    if(aac_samplerates[i] == samplerate)
-      return i;
-  }
-  return 4;
-}
-
 static uint16_t byteswap16(uint16_t val)
 {
 #ifdef WIN32
@@ -99,6 +82,38 @@ static uint32_t byteswap32(uint32_t val)
 }
 
 // find track index for audio/video fragment
+static enum fragment_type_t trak_fragment_type(struct trak_t const* trak)
+{
+  switch(trak->mdia_->hdlr_->handler_type_)
+  {
+  case FOURCC('v', 'i', 'd', 'e'):
+    return FRAGMENT_TYPE_VIDEO;
+  case FOURCC('s', 'o', 'u', 'n'):
+    return FRAGMENT_TYPE_AUDIO;
+  case FOURCC('t', 'e', 'x', 't'):
+  case FOURCC('s', 'b', 't', 'l'):
+  case FOURCC('s', 'u', 'b', 't'):
+    return FRAGMENT_TYPE_TEXT;
+  default:
+    return FRAGMENT_TYPE_UNKNOWN;
+  }
+}
+
+// The ISO-639-2/T language of the track. A language that isn't set (packed
+// as 0) is undetermined.
+static void trak_language(struct trak_t const* trak, char* language)
+{
+  unsigned int const* packed = trak->mdia_->mdhd_->language_;
+
+  strcpy(language, "und");
+  if(packed[0] != 0x60 || packed[1] != 0x60 || packed[2] != 0x60)
+  {
+    language[0] = (char)packed[0];
+    language[1] = (char)packed[1];
+    language[2] = (char)packed[2];
+  }
+}
+
 static int
 get_fragment_track(struct mp4_context_t const* mp4_context,
                    struct mp4_split_options_t const* options)
@@ -107,25 +122,24 @@ get_fragment_track(struct mp4_context_t const* mp4_context,
   for(i = 0; i != mp4_context->moov->tracks_; ++i)
   {
     struct trak_t* trak = mp4_context->moov->traks_[i];
-    switch(trak->mdia_->hdlr_->handler_type_)
+    char language[4];
+    if(trak_fragment_type(trak) != options->fragment_type)
     {
-    case FOURCC('v', 'i', 'd', 'e'):
-      if(options->fragment_type == FRAGMENT_TYPE_VIDEO)
-      {
-        return i;
-      }
-      break;
-     case FOURCC('s', 'o', 'u', 'n'):
-      if(options->fragment_type == FRAGMENT_TYPE_AUDIO)
-      {
-        return i;
-      }
-      break;
+      continue;
+    }
+    // the other languages are requested by name (e.g. audio_nld)
+    trak_language(trak, language);
+    if(options->fragment_language[0] &&
+       strcmp(options->fragment_language, language))
+    {
+      continue;
     }
+    return i;
   }
 
   MP4_ERROR("Requested %s track not found in moov atom\n",
-    options->fragment_type == FRAGMENT_TYPE_VIDEO ? "video" : "audio");
+    options->fragment_type == FRAGMENT_TYPE_VIDEO ? "video" :
+    options->fragment_type == FRAGMENT_TYPE_AUDIO ? "audio" : "text");
 
   return -1;
 }
@@ -526,6 +540,29 @@ static void tfhd_exit(struct tfhd_t* atom)
   free(atom);
 }
 
+struct tfdt_t
+{
+  unsigned int version_;
+  unsigned int flags_;
+  uint64_t base_media_decode_time_;
+};
+
+static struct tfdt_t* tfdt_init()
+{
+  struct tfdt_t* tfdt = (struct tfdt_t*)malloc(sizeof(struct tfdt_t));
+
+  tfdt->version_ = 1;
+  tfdt->flags_ = 0;
+  tfdt->base_media_decode_time_ = 0;
+
+  return tfdt;
+}
+
+static void tfdt_exit(struct tfdt_t* atom)
+{
+  free(atom);
+}
+
 struct trun_table_t
 {
   uint32_t sample_duration_;
@@ -576,6 +613,7 @@ struct traf_t
 {
   struct unknown_atom_t* unknown_atoms_;
   struct tfhd_t* tfhd_;
+  struct tfdt_t* tfdt_;
   struct trun_t* trun_;
 };
 
@@ -584,6 +622,7 @@ static struct traf_t* traf_init()
   struct traf_t* traf = (struct traf_t*)malloc(sizeof(struct traf_t));
   traf->unknown_atoms_ = 0;
   traf->tfhd_ = 0;
+  traf->tfdt_ = 0;
   traf->trun_ = 0;
 
   return traf;
@@ -599,6 +638,10 @@ static void traf_exit(struct traf_t* atom)
   {
     tfhd_exit(atom->tfhd_);
   }
+  if(atom->tfdt_)
+  {
+    tfdt_exit(atom->tfdt_);
+  }
   if(atom->trun_)
   {
     trun_exit(atom->trun_);
@@ -675,6 +718,25 @@ static unsigned char* tfhd_write(void const* atom, unsigned char* buffer)
   return buffer;
 }
 
+static unsigned char* tfdt_write(void const* atom, unsigned char* buffer)
+{
+  struct tfdt_t const* tfdt = (struct tfdt_t const*)atom;
+
+  buffer = write_8(buffer, tfdt->version_);
+  buffer = write_24(buffer, tfdt->flags_);
+
+  if(tfdt->version_ == 0)
+  {
+    buffer = write_32(buffer, (uint32_t)tfdt->base_media_decode_time_);
+  }
+  else
+  {
+    buffer = write_64(buffer, tfdt->base_media_decode_time_);
+  }
+
+  return buffer;
+}
+
 static unsigned char* trun_write(void const* atom, unsigned char* buffer)
 {
   struct trun_t const* trun = (struct trun_t const*)atom;
@@ -732,6 +794,7 @@ static unsigned char* traf_write(void const* atom, unsigned char* buffer)
   struct traf_t const* traf = (struct traf_t const*)atom;
   struct atom_write_list_t atom_write_list[] = {
     { FOURCC('t', 'f', 'h', 'd'), traf->tfhd_, &tfhd_write },
+    { FOURCC('t', 'f', 'd', 't'), traf->tfdt_, &tfdt_write },
     { FOURCC('t', 'r', 'u', 'n'), traf->trun_, &trun_write }
   };
 
@@ -777,6 +840,99 @@ static void moof_write(struct moof_t* atom, unsigned char* buffer)
   write_32(atom_start, (uint32_t)(buffer - atom_start));
 }
 
+// Move the sample fields that are the same for every sample in the run into
+// the track fragment header defaults and drop them from the trun table.
+// Durations that differ by no more than 'rounding' count as the same.
+static void traf_compact(struct traf_t* traf, struct trak_t const* trak,
+                         unsigned int start, unsigned int end,
+                         unsigned int rounding)
+{
+  struct tfhd_t* tfhd = traf->tfhd_;
+  struct trun_t* trun = traf->trun_;
+  struct trun_table_t const* first = trun->table_;
+  struct trun_table_t const* last = trun->table_ + trun->sample_count_;
+  struct trun_table_t const* entry;
+  uint32_t min_duration = first->sample_duration_;
+  uint32_t max_duration = first->sample_duration_;
+  uint64_t total_duration = 0;
+  int same_size = 1;
+  int zero_cto = 1;
+  int all_sync = 1;
+  unsigned int s;
+
+  if(first == last)
+  {
+    return;
+  }
+
+  for(entry = first; entry != last; ++entry)
+  {
+    if(entry->sample_duration_ < min_duration)
+    {
+      min_duration = entry->sample_duration_;
+    }
+    if(entry->sample_duration_ > max_duration)
+    {
+      max_duration = entry->sample_duration_;
+    }
+    total_duration += entry->sample_duration_;
+    same_size &= entry->sample_size_ == first->sample_size_;
+    zero_cto &= entry->sample_composition_time_offset_ == 0;
+  }
+
+  for(s = start; s != end; ++s)
+  {
+    all_sync &= trak->samples_[s].is_ss_;
+  }
+
+  // When the durations are rescaled to the 10MHz timescale, a constant
+  // duration in the track's timescale may alternate between two values.
+  // Treat that rounding as constant, but only while the times of the
+  // samples with the default duration stay within the rounding. Otherwise
+  // the error adds up over the fragment (e.g. almost half a tick per sample
+  // for 1024 AAC samples at 44.1KHz).
+  if(max_duration - min_duration <= rounding)
+  {
+    uint32_t duration = (uint32_t)
+      ((total_duration + trun->sample_count_ / 2) / trun->sample_count_);
+    int64_t drift = 0;
+    int in_time = 1;
+
+    for(entry = first; entry != last && in_time; ++entry)
+    {
+      drift += (int64_t)entry->sample_duration_ - duration;
+      in_time = drift <= (int64_t)rounding && drift >= -(int64_t)rounding;
+    }
+
+    if(in_time)
+    {
+      tfhd->flags_ |= 0x000008;
+      tfhd->default_sample_duration_ = duration;
+      trun->flags_ &= ~0x000100;
+    }
+  }
+
+  if(same_size)
+  {
+    tfhd->flags_ |= 0x000010;
+    tfhd->default_sample_size_ = first->sample_size_;
+    trun->flags_ &= ~0x000200;
+  }
+
+  if(zero_cto)
+  {
+    trun->flags_ &= ~0x000800;
+  }
+
+  // every sample is a sync sample (e.g. audio), so the flags of the first
+  // sample are the flags for all the samples
+  if(all_sync)
+  {
+    tfhd->default_sample_flags_ = trun->first_sample_flags_;
+    trun->flags_ &= ~0x000004;
+  }
+}
+
 static int moof_create(struct mp4_context_t const* mp4_context,
                        struct moof_t* moof,
                        struct trak_t const* trak,
@@ -786,7 +942,11 @@ static int moof_create(struct mp4_context_t const* mp4_context,
 {
   uint32_t mdat_size = ATOM_PREAMBLE_SIZE;
   struct bucket_t* mdat_bucket = 0;
-  if(options->output_format == OUTPUT_FORMAT_MP4)
+  // CMAF keeps the track's own timescale and the length prefixed NAL units
+  int is_cmaf = options->output_format == OUTPUT_FORMAT_CMAF;
+  // SmoothStreaming uses a fixed 10000000 timescale
+  uint32_t timescale = is_cmaf ? trak->mdia_->mdhd_->timescale_ : 10000000;
+  if(options->output_format == OUTPUT_FORMAT_MP4 || is_cmaf)
   {
     unsigned char mdat_buffer[32];
     struct mp4_atom_t mdat_atom;
@@ -817,6 +977,7 @@ static int moof_create(struct mp4_context_t const* mp4_context,
     struct stsd_t const* stsd = trak->mdia_->minf_->stbl_->stsd_;
     struct sample_entry_t const* sample_entry = &stsd->sample_entries_[0];
     int is_avc = sample_entry->fourcc_ == FOURCC('a', 'v', 'c', '1');
+    int is_annex_b = is_avc && !is_cmaf;
 
     struct traf_t* traf = traf_init();
     moof->trafs_[moof->tracks_] = traf;
@@ -833,6 +994,24 @@ static int moof_create(struct mp4_context_t const* mp4_context,
       traf->tfhd_->flags_ = 0x000020;
       traf->tfhd_->track_id_ = trak->tkhd_->track_id_;
       traf->tfhd_->default_sample_flags_ = 0x0000c0;
+      if(is_cmaf)
+      {
+        // 0x020000 = default-base-is-moof
+        traf->tfhd_->flags_ |= 0x020000;
+        // sample_depends_on=1 and sample_is_non_sync_sample
+        traf->tfhd_->default_sample_flags_ = 0x01010000;
+
+        traf->tfdt_ = tfdt_init();
+        traf->tfdt_->base_media_decode_time_ = trak->samples_[start].pts_;
+      }
+      else if(options->chunk_duration > 0.0)
+      {
+        // a response has several chunks, so every chunk has its own time
+        traf->tfdt_ = tfdt_init();
+        traf->tfdt_->base_media_decode_time_ = trak_time_to_moov_time(
+          trak->samples_[start].pts_, timescale,
+          trak->mdia_->mdhd_->timescale_);
+      }
 
       traf->trun_ = trun_init();
       // 0x0004 = first_sample_flags is present
@@ -848,23 +1027,34 @@ static int moof_create(struct mp4_context_t const* mp4_context,
 //      traf->trun_->sample_count_ = stts_get_samples(stts);
       traf->trun_->sample_count_ = end - start;
       traf->trun_->first_sample_flags_= 0x00000040;
+      if(is_cmaf)
+      {
+        // 0x0001 = data-offset is present (patched when the moof is written)
+        traf->trun_->flags_ |= 0x000001;
+        // sample_depends_on=2 (an I-frame)
+        traf->trun_->first_sample_flags_= 0x02000000;
+      }
+      // a chunk that doesn't start with a sync sample uses the default flags
+      if(!trak->samples_[start].is_ss_)
+      {
+        traf->trun_->flags_ &= ~0x000004;
+      }
       traf->trun_->table_ = (struct trun_table_t*)malloc(traf->trun_->sample_count_ * sizeof(struct trun_table_t));
 
       for(s = start; s != end; ++s)
       {
-        // SmoothStreaming uses a fixed 10000000 timescale
         uint32_t timescale_ = trak->mdia_->mdhd_->timescale_;
         uint64_t pts1 = (trak_time_to_moov_time(
-          trak->samples_[s + 1].pts_, 10000000, timescale_));
+          trak->samples_[s + 1].pts_, timescale, timescale_));
         uint64_t pts0 = (trak_time_to_moov_time(
-          trak->samples_[s + 0].pts_, 10000000, timescale_));
+          trak->samples_[s + 0].pts_, timescale, timescale_));
 
         unsigned int sample_duration = (unsigned int)(pts1 - pts0);
 
         uint64_t sample_pos = trak->samples_[s].pos_;
         unsigned int sample_size = trak->samples_[s].size_;
         unsigned int cto = (unsigned int)(trak_time_to_moov_time(
-          trak->samples_[s].cto_, 10000000, timescale_));
+          trak->samples_[s].cto_, timescale, timescale_));
 
         traf->trun_->table_[trun_index].sample_duration_ = sample_duration;
         traf->trun_->table_[trun_index].sample_size_ = sample_size;
@@ -880,10 +1070,11 @@ static int moof_create(struct mp4_context_t const* mp4_context,
 
         if(trak->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
         {
-          if(bucket_prev == NULL)
+          // a chunk that doesn't start with a sync sample has no SPS and PPS
+          if(bucket_prev == NULL && trak->samples_[s].is_ss_)
           {
             // TODO: return error when no SPS and PPS are available
-            if(is_avc)
+            if(is_annex_b)
             {
               unsigned char* buffer;
               unsigned char* p;
@@ -910,15 +1101,14 @@ static int moof_create(struct mp4_context_t const* mp4_context,
               memcpy(p, sample_entry->pps_, sample_entry->pps_length_);
               p += sample_entry->pps_length_;
 
-              bucket_insert_tail(buckets, bucket_init_memory(buffer, sps_pps_size));
-              free(buffer);
+              bucket_insert_tail(buckets, bucket_init_owned(buffer, sps_pps_size));
 
               traf->trun_->table_[trun_index].sample_size_ += sps_pps_size;
               mdat_size += sps_pps_size;
             }
           }
 
-          if(is_avc)
+          if(is_annex_b)
           {
             static const char nal_marker[4] = { 0, 0, 0, 1 };
             uint64_t first = sample_pos;
@@ -927,7 +1117,7 @@ static int moof_create(struct mp4_context_t const* mp4_context,
             {
               unsigned char buffer[4];
               unsigned int nal_size;
-              bucket_insert_tail(buckets, bucket_init_memory(nal_marker, 4));
+              bucket_insert_tail(buckets, bucket_init_reference(nal_marker, 4));
 
               if(_fseeki64(mp4_context->infile, first, SEEK_SET) != 0)
               {
@@ -967,54 +1157,18 @@ static int moof_create(struct mp4_context_t const* mp4_context,
               bucket_insert_tail(buckets, bucket_prev);
             }
           }
-        } else
-        if(trak->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n'))
+        }
+        else
         {
+          // audio, or samples that are copied as is (e.g. subtitles)
+
           // ADTS frame header
           if(sample_entry->wFormatTag == 0x00ff &&
              options->output_format == OUTPUT_FORMAT_RAW)
           {
-            unsigned int syncword = 0xfff;
-            unsigned int ID = 0; // MPEG-4
-            unsigned int layer = 0;
-            unsigned int protection_absent = 1;
-            // 0 = Main profile AAC MAIN
-            // 1 = Low Complexity profile (LC) AAC LC
-            // 2 = Scalable Sample Rate profile (SSR) AAC SSR
-            // 3 = (reserved) AAC LTP
-            unsigned int profile = 1;
-            unsigned int sampling_frequency_index =
-              mp4_samplerate_to_index(sample_entry->nSamplesPerSec);
-            unsigned int private_bit = 0;
-            unsigned int channel_configuration = sample_entry->nChannels;
-            unsigned int original_copy = 0;
-            unsigned int home = 0;
-            unsigned int copyright_identification_bit = 0;
-            unsigned int copyright_identification_start = 0;
-            unsigned int aac_frame_length = 7 + sample_size;
-            unsigned int adts_buffer_fullness = 0x7ff;
-            unsigned int no_raw_data_blocks_in_frame = 0;
-            unsigned char buffer[8];
-
-            uint64_t adts = 0;
-            adts = (adts << 12) | syncword;
-            adts = (adts << 1) | ID;
-            adts = (adts << 2) | layer;
-            adts = (adts << 1) | protection_absent;
-            adts = (adts << 2) | profile;
-            adts = (adts << 4) | sampling_frequency_index;
-            adts = (adts << 1) | private_bit;
-            adts = (adts << 3) | channel_configuration;
-            adts = (adts << 1) | original_copy;
-            adts = (adts << 1) | home;
-            adts = (adts << 1) | copyright_identification_bit;
-            adts = (adts << 1) | copyright_identification_start;
-            adts = (adts << 13) | aac_frame_length;
-            adts = (adts << 11) | adts_buffer_fullness;
-            adts = (adts << 2) | no_raw_data_blocks_in_frame;
-
-            write_64(buffer, adts);
-            bucket_insert_tail(buckets, bucket_init_memory(buffer + 1, 7));
+            unsigned char buffer[7];
+            sample_entry_write_adts(sample_entry, sample_size, buffer);
+            bucket_insert_tail(buckets, bucket_init_memory(buffer, 7));
 
             traf->trun_->table_[trun_index].sample_size_ += 7;
             mdat_size += 7;
@@ -1039,6 +1193,9 @@ static int moof_create(struct mp4_context_t const* mp4_context,
 
         ++trun_index;
       }
+
+      traf_compact(traf, trak, start, end, is_cmaf ? 0 : 1);
+
       // update size of mdat atom
       if(mdat_bucket)
       {
@@ -1050,13 +1207,174 @@ static int moof_create(struct mp4_context_t const* mp4_context,
   return 1;
 }
 
+// Returns the next Smooth Streaming Sync Sample after start
+static unsigned int trak_fragment_end(struct trak_t const* trak,
+                                      unsigned int start)
+{
+  unsigned int end = start;
+  if(end != trak->samples_size_)
+  {
+    ++end;
+    while(end != trak->samples_size_)
+    {
+      if(trak->samples_[end].is_smooth_ss_)
+        break;
+      ++end;
+    }
+  }
+
+  return end;
+}
+
+// Returns the end of the chunk that starts at sample start. Without a chunk
+// duration the chunk is the whole fragment [start, end>.
+static unsigned int trak_chunk_end(struct trak_t const* trak,
+                                   unsigned int start, unsigned int end,
+                                   struct mp4_split_options_t const* options)
+{
+  uint64_t chunk_duration;
+  unsigned int s = start;
+
+  if(options->chunk_duration <= 0.0f || start == end)
+  {
+    return end;
+  }
+
+  chunk_duration = (uint64_t)
+    (options->chunk_duration * trak->mdia_->mdhd_->timescale_ + 0.5);
+  while(++s != end)
+  {
+    if(trak->samples_[s].pts_ - trak->samples_[start].pts_ >= chunk_duration)
+      break;
+  }
+
+  return s;
+}
+
+// The sequence number of the first chunk of the fragment that starts at
+// sample start, which counts the chunks of the preceding fragments.
+static uint32_t trak_chunk_sequence_number(struct trak_t const* trak,
+                                           unsigned int start,
+                                           struct mp4_split_options_t const* options)
+{
+  uint32_t sequence_number = 1;
+  unsigned int s = 0;
+
+  while(s < start)
+  {
+    unsigned int end = trak_fragment_end(trak, s);
+    for(; s != end; ++sequence_number)
+    {
+      s = trak_chunk_end(trak, s, end, options);
+    }
+  }
+
+  return sequence_number;
+}
+
+// Creates the moof and mdat of the samples [start, end> of the track. The
+// buckets are inserted at the tail, the moof precedes the mdat.
+static int moof_create_chunk(struct mp4_context_t const* mp4_context,
+                             struct trak_t const* trak,
+                             unsigned int start, unsigned int end,
+                             uint32_t sequence_number,
+                             struct bucket_t** buckets,
+                             struct mp4_split_options_t const* options)
+{
+  struct bucket_t* chunk_buckets = 0;
+  struct moof_t* moof = moof_init();
+  int result = moof_create(mp4_context, moof, trak, start, end,
+                           &chunk_buckets, options);
+
+  if(result && (options->output_format == OUTPUT_FORMAT_MP4 ||
+                options->output_format == OUTPUT_FORMAT_CMAF))
+  {
+    // moof header plus at most 3 fields per sample in the trun
+    unsigned char* moof_data = (unsigned char*)
+      malloc(256 + (end - start) * 12);
+    unsigned int moof_size;
+
+    moof->mfhd_->sequence_number_ = sequence_number;
+    moof_write(moof, moof_data);
+    moof_size = read_32(moof_data);
+
+    if(options->output_format == OUTPUT_FORMAT_CMAF)
+    {
+      // the sample data follows the mdat header
+      moof->trafs_[0]->trun_->data_offset_ = moof_size + ATOM_PREAMBLE_SIZE;
+      moof_write(moof, moof_data);
+    }
+
+    bucket_insert_head(&chunk_buckets,
+                       bucket_init_owned(moof_data, moof_size));
+  }
+
+  moof_exit(moof);
+
+  if(result)
+  {
+    buckets_insert_tail(buckets, chunk_buckets);
+  }
+  else if(chunk_buckets)
+  {
+    buckets_exit(chunk_buckets);
+  }
+
+  return result;
+}
+
+static uint64_t buckets_size(struct bucket_t const* buckets)
+{
+  uint64_t size = 0;
+
+  if(buckets)
+  {
+    struct bucket_t const* bucket = buckets;
+    do
+    {
+      size += bucket->size_;
+      bucket = bucket->next_;
+    } while(bucket != buckets);
+  }
+
+  return size;
+}
+
+// The time of the sample relative to the sample at start, in seconds
+static double trak_elapsed_time(struct trak_t const* trak,
+                                unsigned int start, unsigned int sample)
+{
+  return (double)(trak->samples_[sample].pts_ - trak->samples_[start].pts_) /
+         trak->mdia_->mdhd_->timescale_;
+}
+
+// A completed chunk is handed to the sink (if any), so that it can be sent
+// before the rest of the fragment is assembled. The chunk starts at time
+// and ends at filepos in the output, which the sink needs for pacing.
+static int chunk_flush(struct bucket_t** buckets, double time,
+                       uint64_t* filepos,
+                       struct mp4_split_options_t* options)
+{
+  struct bucket_t* chunk_buckets = *buckets;
+
+  if(options->sink == NULL || chunk_buckets == NULL)
+  {
+    return 1;
+  }
+
+  *filepos += buckets_size(chunk_buckets);
+  mp4_pace_mark(options, time, *filepos);
+
+  *buckets = 0;
+  return options->sink(options->sink_arg, chunk_buckets);
+}
+
 extern int output_ismv(struct mp4_context_t const* mp4_context,
                        unsigned int* trak_sample_start,
                        unsigned int* trak_sample_end,
                        struct bucket_t** buckets,
-                       struct mp4_split_options_t const* options)
+                       struct mp4_split_options_t* options)
 {
-  struct moof_t* moof;
   int fragment_track = get_fragment_track(mp4_context, options);
 
   if(fragment_track < 0)
@@ -1069,41 +1387,34 @@ extern int output_ismv(struct mp4_context_t const* mp4_context,
 
     // When we're requesting a fragment, then we set the end to
     // the next Smooth Streaming Sync Sample.
-    unsigned int start = trak_sample_start[fragment_track];
-    unsigned int end = start;
-    if(end != trak->samples_size_)
+    unsigned int first = trak_sample_start[fragment_track];
+    unsigned int start = first;
+    unsigned int end = trak_fragment_end(trak, start);
+    uint32_t sequence_number = 1;
+    uint64_t filepos = 0;
+    int result = 1;
+
+    // In chunked mode the fragment is split into multiple moof/mdat pairs,
+    // which are numbered in order.
+    if(options->chunk_duration > 0.0)
     {
-      ++end;
-      while(end != trak->samples_size_)
-      {
-        if(trak->samples_[end].is_smooth_ss_)
-          break;
-        ++end;
-      }
+      sequence_number = trak_chunk_sequence_number(trak, start, options);
     }
-
-    moof = moof_init();
-
-    moof_create(mp4_context, moof, trak, start, end, buckets, options);
-
-    if(options->output_format == OUTPUT_FORMAT_MP4)
+    do
     {
-      unsigned char moof_data[8192];
-      unsigned int moof_size;
-      moof_write(moof, moof_data);
-      moof_size = read_32(moof_data);
-      bucket_insert_head(buckets, bucket_init_memory(moof_data, moof_size));
-    }
-
-    moof_exit(moof);
-
-    return 1;
+      unsigned int chunk_end = trak_chunk_end(trak, start, end, options);
+      result = moof_create_chunk(mp4_context, trak, start, chunk_end,
+                                 sequence_number, buckets, options) &&
+               chunk_flush(buckets, trak_elapsed_time(trak, first, start),
+                           &filepos, options);
+      start = chunk_end;
+      ++sequence_number;
+    } while(result && start != end);
+
+    return result;
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Manifest
-
 static char* hex64(unsigned char* first, unsigned char* last, char* out)
 {
   static const char* hex = "0123456789ABCDEF";
@@ -1126,7 +1437,7 @@ struct quality_level_t
   uint32_t fourcc_;
   uint32_t width_;
   uint32_t height_;
-  char codec_private_data_[256];
+  char* codec_private_data_;
 };
 
 static struct quality_level_t* quality_level_init()
@@ -1134,9 +1445,11 @@ static struct quality_level_t* quality_level_init()
   struct quality_level_t* that = (struct quality_level_t*)
     malloc(sizeof(struct quality_level_t));
 
+  that->bitrate_ = 0;
+  that->fourcc_ = 0;
   that->width_ = 0;
   that->height_ = 0;
-  that->codec_private_data_[0] = '\0';
+  that->codec_private_data_ = NULL;
 
   return that;
 }
@@ -1150,74 +1463,106 @@ static struct quality_level_t* quality_level_copy(struct quality_level_t* rhs)
   that->fourcc_ = rhs->fourcc_;
   that->width_ = rhs->width_;
   that->height_ = rhs->height_;
-  memcpy(that->codec_private_data_, rhs->codec_private_data_,
-    sizeof(that->codec_private_data_) / sizeof(that->codec_private_data_[0]));
+  that->codec_private_data_ = NULL;
+  if(rhs->codec_private_data_)
+  {
+    that->codec_private_data_ = (char*)
+      malloc(strlen(rhs->codec_private_data_) + 1);
+    strcpy(that->codec_private_data_, rhs->codec_private_data_);
+  }
 
   return that;
 }
 
 static void quality_level_exit(struct quality_level_t* that)
 {
+  free(that->codec_private_data_);
   free(that);
 }
 
-static char*
-quality_level_write(struct quality_level_t const* that, char* buffer)
+static void
+quality_level_write(struct quality_level_t const* that,
+                    struct bucket_writer_t* writer)
 {
-  char* p = buffer;
+  char fourcc[4];
+  fourcc[0] = (char)((that->fourcc_ >> 24) & 0xff);
+  fourcc[1] = (char)((that->fourcc_ >> 16) & 0xff);
+  fourcc[2] = (char)((that->fourcc_ >> 8) & 0xff);
+  fourcc[3] = (char)(that->fourcc_ & 0xff);
 
-  p += sprintf(p, "<QualityLevel"
-                  " Bitrate=\"%u\""
-                  " FourCC=\"%c%c%c%c\"",
-               that->bitrate_,
-               (that->fourcc_ >> 24) & 0xff,
-               (that->fourcc_ >> 16) & 0xff,
-               (that->fourcc_ >> 8) & 0xff,
-               that->fourcc_ & 0xff);
+  bucket_writer_puts(writer, "<QualityLevel Bitrate=\"");
+  bucket_writer_putu(writer, that->bitrate_);
+  bucket_writer_puts(writer, "\" FourCC=\"");
+  bucket_writer_write(writer, fourcc, 4);
+  bucket_writer_puts(writer, "\"");
 
   if(that->width_ && that->height_)
   {
-    p += sprintf(p, " Width=\"%u\""
-                    " Height=\"%u\""
-                    " CodecPrivateData=\"%s\"",
-                 that->width_,
-                 that->height_,
-                 that->codec_private_data_);
-
+    bucket_writer_puts(writer, " Width=\"");
+    bucket_writer_putu(writer, that->width_);
+    bucket_writer_puts(writer, "\" Height=\"");
+    bucket_writer_putu(writer, that->height_);
+    bucket_writer_puts(writer, "\" CodecPrivateData=\"");
+    if(that->codec_private_data_)
+    {
+      bucket_writer_puts(writer, that->codec_private_data_);
+    }
+    bucket_writer_puts(writer, "\"");
   }
-  else
+  else if(that->codec_private_data_)
   {
-    p += sprintf(p, " WaveFormatEx=\"%s\"",
-                 that->codec_private_data_);
+    bucket_writer_puts(writer, " WaveFormatEx=\"");
+    bucket_writer_puts(writer, that->codec_private_data_);
+    bucket_writer_puts(writer, "\"");
   }
-  p += sprintf(p, " />\n");
-
-  return p;
+  bucket_writer_puts(writer, " />\n");
 }
 
-#define MAX_QUALITY_LEVELS 6
-#define MAX_STREAMS 2
+static char const* fragment_type_name(enum fragment_type_t type)
+{
+  switch(type)
+  {
+  case FRAGMENT_TYPE_AUDIO:
+    return "audio";
+  case FRAGMENT_TYPE_VIDEO:
+    return "video";
+  case FRAGMENT_TYPE_TEXT:
+    return "text";
+  default:
+    return "unknown";
+  }
+}
 
 struct stream_t
 {
   enum fragment_type_t type_;
   char subtype_[32];
+  char language_[4];
+  char name_[32];               // the name in the fragment urls
   uint32_t chunks_;
   char url_[256];
+  char query_[MP4_FRAGMENT_QUERY_SIZE]; // the query of the fragment urls
   size_t quality_levels_;
-  struct quality_level_t* quality_level_[MAX_QUALITY_LEVELS];
+  struct quality_level_t** quality_level_;
+  uint64_t* times_;             // the start time of every chunk
   uint64_t* durations_;
 };
 
-static struct stream_t* stream_init(enum fragment_type_t type, uint32_t chunks)
+static struct stream_t* stream_init(enum fragment_type_t type,
+                                    char const* language, uint32_t chunks)
 {
   struct stream_t* that = (struct stream_t*)malloc(sizeof(struct stream_t));
 
   that->type_ = type;
   that->subtype_[0] = '\0';
+  strcpy(that->language_, language);
+  strcpy(that->name_, fragment_type_name(type));
   that->chunks_ = chunks;
   that->url_[0] = '\0';
+  that->query_[0] = '\0';
   that->quality_levels_ = 0;
+  that->quality_level_ = NULL;
+  that->times_ = (uint64_t*)malloc(chunks * sizeof(uint64_t));
   that->durations_ = (uint64_t*)malloc(chunks * sizeof(uint64_t));
 
   return that;
@@ -1230,13 +1575,20 @@ static struct stream_t* stream_copy(struct stream_t* rhs)
 
   that->type_ = rhs->type_;
   strcpy(that->subtype_, rhs->subtype_);
+  strcpy(that->language_, rhs->language_);
+  strcpy(that->name_, rhs->name_);
   that->chunks_ = rhs->chunks_;
   strcpy(that->url_, rhs->url_);
+  strcpy(that->query_, rhs->query_);
   that->quality_levels_ = rhs->quality_levels_;
+  that->quality_level_ = (struct quality_level_t**)
+    malloc(rhs->quality_levels_ * sizeof(struct quality_level_t*));
   for(i = 0; i != rhs->quality_levels_; ++i)
   {
     that->quality_level_[i] = quality_level_copy(rhs->quality_level_[i]);
   }
+  that->times_ = (uint64_t*)malloc(that->chunks_ * sizeof(uint64_t));
+  memcpy(that->times_, rhs->times_, that->chunks_ * sizeof(uint64_t));
   that->durations_ = (uint64_t*)malloc(that->chunks_ * sizeof(uint64_t));
   memcpy(that->durations_, rhs->durations_, that->chunks_ * sizeof(uint64_t));
 
@@ -1253,6 +1605,8 @@ static void stream_exit(struct stream_t* that)
     ++first;
   }
 
+  free(that->quality_level_);
+  free(that->times_);
   free(that->durations_);
   free(that);
 }
@@ -1260,15 +1614,19 @@ static void stream_exit(struct stream_t* that)
 static void stream_add_quality_level(struct stream_t* that,
                                      struct quality_level_t* child)
 {
+  that->quality_level_ = (struct quality_level_t**)
+    realloc(that->quality_level_,
+            (that->quality_levels_ + 1) * sizeof(struct quality_level_t*));
   that->quality_level_[that->quality_levels_] = child;
   ++that->quality_levels_;
 }
 
 struct smooth_streaming_media_t
 {
+  unsigned int major_version_;  // 1 or 2 (with repeat counts)
   uint64_t duration_;
   size_t streams_;
-  struct stream_t* stream_[MAX_STREAMS]; // audio and video
+  struct stream_t** stream_;    // a stream per type and language
 };
 
 static struct smooth_streaming_media_t* smooth_streaming_media_init()
@@ -1276,7 +1634,9 @@ static struct smooth_streaming_media_t* smooth_streaming_media_init()
   struct smooth_streaming_media_t* that = (struct smooth_streaming_media_t*)
     malloc(sizeof(struct smooth_streaming_media_t));
 
+  that->major_version_ = 1;
   that->streams_ = 0;
+  that->stream_ = NULL;
 
   return that;
 }
@@ -1290,17 +1650,19 @@ static void smooth_streaming_media_exit(struct smooth_streaming_media_t* that)
     stream_exit(*first);
     ++first;
   }
+  free(that->stream_);
   free(that);
 }
 
 static struct stream_t* smooth_streaming_media_find_stream(
-  struct smooth_streaming_media_t* that, enum fragment_type_t type)
+  struct smooth_streaming_media_t* that, enum fragment_type_t type,
+  char const* language)
 {
   struct stream_t** first = that->stream_;
   struct stream_t** last = that->stream_ + that->streams_;
   while(first != last)
   {
-    if((*first)->type_ == type)
+    if((*first)->type_ == type && !strcmp((*first)->language_, language))
     {
       return *first;
     }
@@ -1310,110 +1672,192 @@ static struct stream_t* smooth_streaming_media_find_stream(
   return NULL;
 }
 
+// The first stream of a type is named after the type (e.g. 'audio'), the
+// other languages get the language appended (e.g. 'audio_nld').
+static void smooth_streaming_media_add_stream(
+  struct smooth_streaming_media_t* that, struct stream_t* stream)
+{
+  size_t i;
+  char const* name = fragment_type_name(stream->type_);
+
+  strcpy(stream->name_, name);
+  for(i = 0; i != that->streams_; ++i)
+  {
+    if(that->stream_[i]->type_ == stream->type_)
+    {
+      sprintf(stream->name_, "%s_%s", name, stream->language_);
+      break;
+    }
+  }
+
+  that->stream_ = (struct stream_t**)
+    realloc(that->stream_, (that->streams_ + 1) * sizeof(struct stream_t*));
+  that->stream_[that->streams_] = stream;
+  ++that->streams_;
+}
+
 static struct stream_t* smooth_streaming_media_new_stream(
   struct smooth_streaming_media_t* that, enum fragment_type_t type,
-  uint32_t chunks)
+  char const* language, uint32_t chunks)
 {
-  struct stream_t* stream = smooth_streaming_media_find_stream(that, type);
+  struct stream_t* stream =
+    smooth_streaming_media_find_stream(that, type, language);
   if(!stream)
   {
-    stream = stream_init(type, chunks);
-    that->stream_[that->streams_] = stream;
-    ++that->streams_;
+    stream = stream_init(type, language, chunks);
+    smooth_streaming_media_add_stream(that, stream);
   }
 
   return stream;
 }
 
-static char*
-stream_write(struct stream_t const* that, char* buffer)
+// The language is only written when there are several languages of the
+// stream type.
+static void
+stream_write(struct stream_t const* that, unsigned int major_version,
+             int has_languages, struct bucket_writer_t* writer)
 {
-  char* p = buffer;
+  const char* type = fragment_type_name(that->type_);
 
-  const char* type = (that->type_ == FRAGMENT_TYPE_AUDIO ? "audio" :
-                     (that->type_ == FRAGMENT_TYPE_VIDEO ? "video" :
-                     ("unknown")));
-
-  p += sprintf(p, "<StreamIndex"
-                  " Type=\"%s\""
-                  " Subtype=\"%s\""
-                  " Chunks=\"%u\""
-                  " Url=\"%sFragments(%s={start time})\">\n",
-               type, that->subtype_, that->chunks_, that->url_, type);
+  bucket_writer_puts(writer, "<StreamIndex Type=\"");
+  bucket_writer_puts(writer, type);
+  if(strcmp(that->name_, type))
+  {
+    bucket_writer_puts(writer, "\" Name=\"");
+    bucket_writer_puts(writer, that->name_);
+  }
+  if(has_languages && strcmp(that->language_, "und"))
+  {
+    bucket_writer_puts(writer, "\" Language=\"");
+    bucket_writer_puts(writer, that->language_);
+  }
+  bucket_writer_puts(writer, "\" Subtype=\"");
+  bucket_writer_puts(writer, that->subtype_);
+  bucket_writer_puts(writer, "\" Chunks=\"");
+  bucket_writer_putu(writer, that->chunks_);
+  bucket_writer_puts(writer, "\" Url=\"");
+  bucket_writer_puts(writer, that->url_);
+  bucket_writer_puts(writer, "Fragments(");
+  bucket_writer_puts(writer, that->name_);
+  bucket_writer_puts(writer, "={start time})");
+  bucket_writer_puts(writer, that->query_);
+  bucket_writer_puts(writer, "\">\n");
 
   {
     struct quality_level_t* const* first = that->quality_level_;
     struct quality_level_t* const* last = that->quality_level_ + that->quality_levels_;
     while(first != last)
     {
-      p = quality_level_write(*first, p);
+      quality_level_write(*first, writer);
       ++first;
     }
   }
 
+  // Version 1 manifests have a numbered element for every chunk. Version 2
+  // manifests have a repeat count for runs of chunks with the same duration
+  // and the start time is only written at a discontinuity.
   {
-    uint64_t const* first = that->durations_;
-    uint64_t const* last = that->durations_ + that->chunks_;
     uint32_t chunk = 0;
-    while(first != last)
+    while(chunk != that->chunks_)
     {
-      p += sprintf(p, "<c"
-                      " n=\"%u\""
-                      " d=\"%llu\""
-                      " />\n",
-                   chunk, *first);
-      ++chunk;
-      ++first;
+      uint64_t time = that->times_[chunk];
+      uint64_t duration = that->durations_[chunk];
+      uint32_t repeat = 1;
+      int is_discontinuity = chunk == 0 ? time != 0 :
+        time != that->times_[chunk - 1] + that->durations_[chunk - 1];
+
+      if(major_version >= 2)
+      {
+        while(chunk + repeat != that->chunks_ &&
+              that->durations_[chunk + repeat] == duration &&
+              that->times_[chunk + repeat] ==
+                that->times_[chunk + repeat - 1] + duration)
+        {
+          ++repeat;
+        }
+      }
+
+      bucket_writer_puts(writer, "<c");
+      if(major_version < 2)
+      {
+        bucket_writer_puts(writer, " n=\"");
+        bucket_writer_putu(writer, chunk);
+        bucket_writer_puts(writer, "\"");
+      }
+      if(major_version >= 2 && is_discontinuity)
+      {
+        bucket_writer_puts(writer, " t=\"");
+        bucket_writer_putu(writer, time);
+        bucket_writer_puts(writer, "\"");
+      }
+      bucket_writer_puts(writer, " d=\"");
+      bucket_writer_putu(writer, duration);
+      bucket_writer_puts(writer, "\"");
+      if(repeat > 1)
+      {
+        bucket_writer_puts(writer, " r=\"");
+        bucket_writer_putu(writer, repeat);
+        bucket_writer_puts(writer, "\"");
+      }
+      bucket_writer_puts(writer, " />\n");
+
+      chunk += repeat;
     }
   }
 
-  p += sprintf(p, "</StreamIndex>\n");
-
-  return p;
+  bucket_writer_puts(writer, "</StreamIndex>\n");
 }
 
-static char*
+static void
 smooth_streaming_media_write(struct smooth_streaming_media_t* that,
-                             char* buffer)
+                             struct bucket_writer_t* writer)
 {
-  char* p = buffer;
   struct stream_t** first = that->stream_;
   struct stream_t** last = that->stream_ + that->streams_;
 
-  p += sprintf(p, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-  p += sprintf(p, "<!--Created with mod_smooth_streaming(%s)-->\n",
-               X_MOD_SMOOTH_STREAMING_VERSION);
+  bucket_writer_puts(writer, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+  bucket_writer_puts(writer, "<!--Created with mod_smooth_streaming("
+                             X_MOD_SMOOTH_STREAMING_VERSION ")-->\n");
 
   // write SmoothStreamingMedia
-  {
-    p += sprintf(p, "<SmoothStreamingMedia"
-                    " MajorVersion=\"1\""
-                    " MinorVersion=\"0\""
-                    " Duration=\"%llu\""
-                    ">\n",
-                 that->duration_);
-  }
+  bucket_writer_puts(writer, that->major_version_ < 2 ?
+                     "<SmoothStreamingMedia"
+                     " MajorVersion=\"1\""
+                     " MinorVersion=\"0\""
+                     " Duration=\"" :
+                     "<SmoothStreamingMedia"
+                     " MajorVersion=\"2\""
+                     " MinorVersion=\"2\""
+                     " Duration=\"");
+  bucket_writer_putu(writer, that->duration_);
+  bucket_writer_puts(writer, "\">\n");
 
   while(first != last)
   {
-    p = stream_write(*first, p);
+    int has_languages = 0;
+    size_t i;
+    for(i = 0; i != that->streams_; ++i)
+    {
+      has_languages |= that->stream_[i] != *first &&
+                       that->stream_[i]->type_ == (*first)->type_;
+    }
+    stream_write(*first, that->major_version_, has_languages, writer);
     ++first;
   }
 
-  p += sprintf(p, "</SmoothStreamingMedia>\n");
-
-  return p;
+  bucket_writer_puts(writer, "</SmoothStreamingMedia>\n");
 }
 
 static struct smooth_streaming_media_t*
 create_manifest(struct mp4_context_t const* mp4_context,
-                struct moov_t* moov, int is_mbr)
+                struct moov_t* moov, int is_mbr,
+                struct mp4_split_options_t const* options)
 {
   struct smooth_streaming_media_t* smooth_streaming_media = NULL;
   unsigned int track;
   uint64_t first_pts; 
 
-  if(!moov_build_index(mp4_context, moov))
+  if(!moov_build_index(mp4_context, moov, options))
   {
     return smooth_streaming_media;
   }
@@ -1429,19 +1873,15 @@ create_manifest(struct mp4_context_t const* mp4_context,
     struct trak_t* trak = moov->traks_[track];
     uint32_t chunks = 0;
     struct stream_t* stream;
+    char language[4];
 
-    enum fragment_type_t type = FRAGMENT_TYPE_UNKNOWN;
+    enum fragment_type_t type = trak_fragment_type(trak);
 
-    switch(trak->mdia_->hdlr_->handler_type_)
+    // there is a stream for every audio and text language
+    strcpy(language, "und");
+    if(type == FRAGMENT_TYPE_AUDIO || type == FRAGMENT_TYPE_TEXT)
     {
-    case FOURCC('s', 'o', 'u', 'n'):
-      type = FRAGMENT_TYPE_AUDIO;
-      break;
-    case FOURCC('v', 'i', 'd', 'e'):
-      type = FRAGMENT_TYPE_VIDEO;
-      break;
-    default:
-      break;
+      trak_language(trak, language);
     }
 
     // count the number of smooth streaming chunks
@@ -1457,13 +1897,23 @@ create_manifest(struct mp4_context_t const* mp4_context,
     }
 
     stream =
-      smooth_streaming_media_new_stream(smooth_streaming_media, type, chunks);
+      smooth_streaming_media_new_stream(smooth_streaming_media, type,
+                                        language, chunks);
 
     if(is_mbr)
     {
       strcpy(stream->url_, "QualityLevels({bitrate})/");
     }
 
+    // the fragments are only the same with the same plan
+    if(mp4_split_options_fragment_query(options, "?", "&amp;", stream->query_,
+                                        sizeof(stream->query_)) < 0)
+    {
+      MP4_ERROR("%s", "The fragment query is too long\n");
+      smooth_streaming_media_exit(smooth_streaming_media);
+      return 0;
+    }
+
     // write StreamIndex
     {
       struct stsd_t const* stsd = trak->mdia_->minf_->stbl_->stsd_;
@@ -1488,6 +1938,9 @@ create_manifest(struct mp4_context_t const* mp4_context,
                   (sample_entry->fourcc_ >>  8),
                   (sample_entry->fourcc_ >>  0));
         break;
+      case FRAGMENT_TYPE_TEXT:
+        sprintf(stream->subtype_, "SUBT");
+        break;
       default:
         break;
       }
@@ -1497,10 +1950,11 @@ create_manifest(struct mp4_context_t const* mp4_context,
         struct quality_level_t* quality_level = quality_level_init();
         stream_add_quality_level(stream, quality_level);
         quality_level->fourcc_ = sample_entry->fourcc_;
+        // the bitrate as measured by moov_build_index
+        quality_level->bitrate_ = trak->avg_bitrate_;
         switch(type)
         {
         case FRAGMENT_TYPE_VIDEO:
-          quality_level->bitrate_ = 4500 * 1000;
           quality_level->width_ = trak->tkhd_->width_ / 65536;
           quality_level->height_ = trak->tkhd_->height_ / 65536;
 
@@ -1512,6 +1966,8 @@ create_manifest(struct mp4_context_t const* mp4_context,
             MP4_WARNING("%s", "[Warning]: No codec private data found\n");
           }
 
+          quality_level->codec_private_data_ = (char*)
+            malloc(sample_entry->codec_private_data_length_ * 2 + 1);
           hex64(sample_entry->codec_private_data_,
                 sample_entry->codec_private_data_ +
                 sample_entry->codec_private_data_length_,
@@ -1519,9 +1975,17 @@ create_manifest(struct mp4_context_t const* mp4_context,
           break;
         case FRAGMENT_TYPE_AUDIO:
         {
-          char* out = &quality_level->codec_private_data_[0];
-          quality_level->bitrate_ = sample_entry->avg_bitrate_;
-
+          char* out;
+          // the WAVEFORMATEX and the codec private data in hex
+          quality_level->codec_private_data_ = (char*)
+            malloc((18 + sample_entry->codec_private_data_length_) * 2 + 1);
+          out = quality_level->codec_private_data_;
+          *out = '\0';
+          // fall back to the bitrates from the sample description
+          if(!quality_level->bitrate_)
+          {
+            quality_level->bitrate_ = sample_entry->avg_bitrate_;
+          }
           if(!quality_level->bitrate_)
           {
             quality_level->bitrate_ = sample_entry->max_bitrate_;
@@ -1647,6 +2111,7 @@ create_manifest(struct mp4_context_t const* mp4_context,
 
           if(begin_pts != (uint64_t)(-1))
           {
+            stream->times_[chunk] = begin_pts;
             stream->durations_[chunk] = first_pts - begin_pts;
             ++chunk;
           }
@@ -1671,14 +2136,12 @@ static void manifest_merge(struct mp4_context_t* mp4_context,
     smooth_streaming_media->stream_ + smooth_streaming_media->streams_;
   while(first != last)
   {
-    // merge with stream of same type or add new stream
-    struct stream_t* stream =
-      smooth_streaming_media_find_stream(manifest, (*first)->type_);
+    // merge with stream of same type and language or add new stream
+    struct stream_t* stream = smooth_streaming_media_find_stream(
+      manifest, (*first)->type_, (*first)->language_);
     if(!stream)
     {
-      stream = stream_copy(*first);
-      manifest->stream_[manifest->streams_] = stream;
-      ++manifest->streams_;
+      smooth_streaming_media_add_stream(manifest, stream_copy(*first));
     }
     else
     {
@@ -1698,28 +2161,76 @@ static void manifest_merge(struct mp4_context_t* mp4_context,
   }
 }
 
+struct manifest_plan_t
+{
+  struct mp4_context_t** mp4_context_;
+  unsigned int mp4_contexts_;
+  struct mp4_split_options_t const* options_;
+  struct smooth_streaming_media_t** smooth_streaming_media_;
+};
+
+// Indexes the renditions and creates their manifests
+static int manifest_worker(void* arg, unsigned int worker,
+                           unsigned int workers)
+{
+  struct manifest_plan_t* plan = (struct manifest_plan_t*)arg;
+  int is_mbr = plan->mp4_contexts_ > 1 ? 1 : 0;
+  int result = 1;
+  unsigned int i;
+
+  for(i = worker; i < plan->mp4_contexts_; i += workers)
+  {
+    struct mp4_context_t* context = plan->mp4_context_[i];
+    plan->smooth_streaming_media_[i] =
+      create_manifest(context, context->moov, is_mbr, plan->options_);
+    if(plan->smooth_streaming_media_[i] == NULL)
+    {
+      result = 0;
+    }
+  }
+
+  return result;
+}
+
 extern int mp4_create_manifest(struct mp4_context_t** mp4_context,
                                unsigned int mp4_contexts,
-                               struct bucket_t** buckets)
+                               struct bucket_t** buckets,
+                               struct mp4_split_options_t const* options)
 {
   unsigned int file;
   struct smooth_streaming_media_t* manifest = NULL;
-  int result = 1;
+  struct mp4_split_options_t manifest_options = *options;
+  struct manifest_plan_t plan;
+  unsigned int workers = options->threads < mp4_contexts ?
+                         options->threads : mp4_contexts;
+  int result;
+
+  // the manifest only needs the timestamps, sizes and the sync samples
+  manifest_options.index_times_only = 1;
+
+  plan.mp4_context_ = mp4_context;
+  plan.mp4_contexts_ = mp4_contexts;
+  plan.options_ = &manifest_options;
+  plan.smooth_streaming_media_ = (struct smooth_streaming_media_t**)
+    malloc(mp4_contexts * sizeof(struct smooth_streaming_media_t*));
+
+  result = mp4_run_workers(workers, manifest_worker, &plan);
+
+  // merge the manifests in the order of the files
   for(file = 0; file != mp4_contexts; ++file)
   {
     struct mp4_context_t* context = mp4_context[file];
-    struct moov_t* moov = context->moov;
-    int is_mbr = mp4_contexts > 1 ? 1 : 0;
     struct smooth_streaming_media_t* smooth_streaming_media =
-      create_manifest(context, moov, is_mbr);
+      plan.smooth_streaming_media_[file];
 
     if(smooth_streaming_media == NULL)
     {
-      result = 0;
+      continue;
     }
     else
     {
-      // patch the bitrate field with the number from the filename
+      // quality levels without a measured bitrate (no samples) take the
+      // number from the filename
       // E.g.: (video_1394000.ismv) -> bitrate = 1394000
       const char* underscore = strrchr(context->filename_, '_');
       if(underscore)
@@ -1738,7 +2249,10 @@ extern int mp4_create_manifest(struct mp4_context_t** mp4_context,
             (*first)->quality_level_ + (*first)->quality_levels_;
           while(ql_first != ql_last)
           {
-            (*ql_first)->bitrate_ = bitrate;
+            if(!(*ql_first)->bitrate_)
+            {
+              (*ql_first)->bitrate_ = bitrate;
+            }
             ++ql_first;
           }
           ++first;
@@ -1757,12 +2271,15 @@ extern int mp4_create_manifest(struct mp4_context_t** mp4_context,
     }
   }
 
+  free(plan.smooth_streaming_media_);
+
   if(manifest)
   {
-    char* buffer = (char*)malloc(1024 * 256);
-    char* p = smooth_streaming_media_write(manifest, buffer);
-    bucket_insert_tail(buckets, bucket_init_memory(buffer, p - buffer));
-    free(buffer);
+    struct bucket_writer_t writer;
+    bucket_writer_init(&writer, buckets);
+    manifest->major_version_ = options->manifest_version;
+    smooth_streaming_media_write(manifest, &writer);
+    bucket_writer_flush(&writer);
 
     smooth_streaming_media_exit(manifest);
   }
@@ -1770,22 +2287,266 @@ extern int mp4_create_manifest(struct mp4_context_t** mp4_context,
   return result;
 }
 
+// A fragmented file has a 'trex' for every track
+static struct mvex_t* mvex_create(struct moov_t const* moov)
+{
+  unsigned int i;
+  struct mvex_t* mvex = mvex_init();
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trex_t* trex = trex_init();
+    trex->track_id_ = moov->traks_[i]->tkhd_->track_id_;
+    mvex->trexs_[i] = trex;
+  }
+  mvex->tracks_ = moov->tracks_;
+
+  return mvex;
+}
+
+struct fragment_t
+{
+  struct trak_t const* trak_;
+  unsigned int track_;          // index of the trak in the moov
+  unsigned int start_;          // first sample of the fragment
+  unsigned int end_;            // one past the last sample of the fragment
+  uint64_t time_;               // start time (in 10000000 timescale)
+  struct tfra_table_t* tfra_;   // entry in the mfra for this fragment
+  struct bucket_t* buckets_;    // the moof and mdat
+  uint64_t size_;               // total size of the buckets
+};
+
+struct fragment_plan_t
+{
+  struct mp4_context_t const* mp4_context_;
+  struct mp4_split_options_t const* options_;
+  unsigned int fragments_;
+  struct fragment_t* fragment_;
+};
+
+static unsigned int trak_count_fragments(struct trak_t const* trak)
+{
+  unsigned int fragments = 0;
+  unsigned int start = 0;
+  while(start != trak->samples_size_)
+  {
+    while(++start != trak->samples_size_)
+    {
+      if(trak->samples_[start].is_smooth_ss_)
+        break;
+    }
+    ++fragments;
+  }
+
+  return fragments;
+}
+
+// Order fragments by start time, and by track for fragments starting at the
+// same time.
+static int fragment_compare_time(void const* a, void const* b)
+{
+  struct fragment_t const* lhs = (struct fragment_t const*)a;
+  struct fragment_t const* rhs = (struct fragment_t const*)b;
+
+  if(lhs->time_ != rhs->time_)
+    return lhs->time_ < rhs->time_ ? -1 : 1;
+  if(lhs->track_ != rhs->track_)
+    return lhs->track_ < rhs->track_ ? -1 : 1;
+  return lhs->start_ < rhs->start_ ? -1 : (lhs->start_ > rhs->start_);
+}
+
+// Builds the moof and mdat of a single fragment into its own bucket list.
+static int fragment_create(struct mp4_context_t const* mp4_context,
+                           struct fragment_t* fragment,
+                           struct mp4_split_options_t const* options)
+{
+  int result;
+  struct moof_t* moof = moof_init();
+
+  result = moof_create(mp4_context, moof, fragment->trak_,
+                       fragment->start_, fragment->end_,
+                       &fragment->buckets_, options);
+
+  if(result && options->output_format == OUTPUT_FORMAT_MP4)
+  {
+    // moof header plus at most 3 fields per sample in the trun
+    unsigned char* moof_data = (unsigned char*)
+      malloc(256 + (fragment->end_ - fragment->start_) * 12);
+    unsigned int moof_size;
+    moof_write(moof, moof_data);
+    moof_size = read_32(moof_data);
+    bucket_insert_head(&fragment->buckets_,
+                       bucket_init_owned(moof_data, moof_size));
+  }
+
+  moof_exit(moof);
+
+  fragment->size_ = buckets_size(fragment->buckets_);
+
+  return result;
+}
+
+// Each worker builds every n-th fragment of the plan, using its own file
+// handle as moof_create reads the NAL sizes from the input file.
+static int fragment_worker(void* arg, unsigned int worker,
+                           unsigned int workers)
+{
+  struct fragment_plan_t* plan = (struct fragment_plan_t*)arg;
+  struct mp4_context_t context = *plan->mp4_context_;
+  unsigned int i;
+  int result = 1;
+
+  if(workers > 1)
+  {
+    context.infile = fopen(context.filename_, "rb");
+    if(context.infile == NULL)
+    {
+      struct mp4_context_t const* mp4_context = plan->mp4_context_;
+      MP4_ERROR("Error opening %s\n", context.filename_);
+      return 0;
+    }
+  }
+
+  for(i = worker; i < plan->fragments_ && result; i += workers)
+  {
+    result = fragment_create(&context, &plan->fragment_[i], plan->options_);
+  }
+
+  if(workers > 1)
+  {
+    fclose(context.infile);
+  }
+
+  return result;
+}
+
+// The size of a (version 1) segment index with the given number of references
+static uint32_t sidx_size(unsigned int references)
+{
+  return ATOM_PREAMBLE_SIZE + 4 + 4 + 4 + 8 + 8 + 2 + 2 + references * 12;
+}
+
+// Writes a segment index for one track. Every reference starts at a moof of
+// the track and runs up to the next moof of the same track, so with an
+// interleaved layout a subsegment also holds the fragments of other tracks.
+// The fragment offsets must be known (as set in the tfra tables). Returns
+// NULL when a reference doesn't fit (2GB or more, or a duration of 2^32
+// ticks or more), as a reference can't be split within a fragment.
+static unsigned char* sidx_write(struct fragment_plan_t const* plan,
+                                 unsigned int track,
+                                 uint64_t anchor,
+                                 unsigned char* buffer)
+{
+  struct fragment_t const* first = plan->fragment_;
+  struct fragment_t const* last = plan->fragment_ + plan->fragments_;
+  struct fragment_t const* fragment;
+  struct fragment_t const* next;
+  struct trak_t const* trak = NULL;
+  unsigned int references = 0;
+  unsigned char* atom_start = buffer;
+
+  for(fragment = first; fragment != last; ++fragment)
+  {
+    if(fragment->track_ == track)
+    {
+      trak = fragment->trak_;
+      ++references;
+    }
+  }
+
+  buffer = write_32(buffer, 0);
+  buffer = write_32(buffer, FOURCC('s', 'i', 'd', 'x'));
+  buffer = write_8(buffer, 1);        // version
+  buffer = write_24(buffer, 0);       // flags
+  buffer = write_32(buffer, trak == NULL ? 0 : trak->tkhd_->track_id_);
+  // SmoothStreaming uses a fixed 10000000 timescale
+  buffer = write_32(buffer, 10000000);
+
+  // skip the fragments of the other tracks before the first fragment
+  fragment = first;
+  while(fragment != last && fragment->track_ != track)
+  {
+    ++fragment;
+  }
+  if(fragment == last)
+  {
+    buffer = write_64(buffer, 0);
+    buffer = write_64(buffer, 0);
+  }
+  else
+  {
+    uint32_t timescale = trak->mdia_->mdhd_->timescale_;
+    uint64_t cto = trak_time_to_moov_time(
+      trak->samples_[fragment->start_].cto_, 10000000, timescale);
+    // earliest_presentation_time
+    buffer = write_64(buffer, fragment->time_ + cto);
+    // first_offset
+    buffer = write_64(buffer, fragment->tfra_->moof_offset_ - anchor);
+  }
+  buffer = write_16(buffer, 0);       // reserved
+  buffer = write_16(buffer, (uint16_t)references);
+
+  while(fragment != last)
+  {
+    uint64_t referenced_size;
+    uint64_t subsegment_duration;
+    unsigned int starts_with_sap = trak->samples_[fragment->start_].is_ss_;
+
+    next = fragment + 1;
+    while(next != last && next->track_ != track)
+    {
+      ++next;
+    }
+
+    if(next == last)
+    {
+      uint64_t end_time = trak_time_to_moov_time(
+        trak->samples_[trak->samples_size_].pts_, 10000000,
+        trak->mdia_->mdhd_->timescale_);
+      referenced_size = fragment->size_;
+      subsegment_duration = end_time - fragment->time_;
+    }
+    else
+    {
+      referenced_size = next->tfra_->moof_offset_ -
+                        fragment->tfra_->moof_offset_;
+      subsegment_duration = next->time_ - fragment->time_;
+    }
+
+    if(referenced_size > 0x7fffffff || subsegment_duration > UINT32_MAX)
+    {
+      return NULL;
+    }
+
+    // reference_type (0 = media) and referenced_size
+    buffer = write_32(buffer, (uint32_t)referenced_size);
+    buffer = write_32(buffer, (uint32_t)subsegment_duration);
+    // starts_with_SAP, SAP_type and SAP_delta_time
+    buffer = write_32(buffer, starts_with_sap ? (1u << 31) | (1 << 28) : 0);
+
+    fragment = next;
+  }
+
+  write_32(atom_start, (uint32_t)(buffer - atom_start));
+
+  return buffer;
+}
+
 extern int mp4_fragment_file(struct mp4_context_t const* mp4_context,
                              struct bucket_t** buckets,
-                             struct mp4_split_options_t const* options)
+                             struct mp4_split_options_t* options)
 {
-  struct moof_t* moof;
   unsigned char* mfra_data;
-  unsigned int tfra_entries = 0;
-  unsigned int tfra_index = 0;
   struct mfra_t* mfra;
   uint32_t mfra_size;
   uint64_t filepos = 0;
+  uint32_t sidx_bytes = 0;
   int result = 1;
+  struct fragment_plan_t plan;
 
   struct moov_t* moov = mp4_context->moov;
 
-  moov_build_index(mp4_context, mp4_context->moov);
+  moov_build_index(mp4_context, mp4_context->moov, options);
 
   // Start with the ftyp
   {
@@ -1804,7 +2565,7 @@ extern int mp4_fragment_file(struct mp4_context_t const* mp4_context,
   // A fragmented MPEG4 file starts with a MOOV atom with only the mandatory
   // atoms
   {
-	      unsigned int i;
+    unsigned int i;
     struct moov_t* fmoov = moov_init();
     fmoov->mvhd_ = mvhd_copy(moov->mvhd_);
     fmoov->tracks_ = moov->tracks_;
@@ -1851,121 +2612,772 @@ extern int mp4_fragment_file(struct mp4_context_t const* mp4_context,
       }
     }
 
-	{
-		unsigned char* moov_data;
-		uint32_t moov_size;
-		moov_data = mp4_context->moov_data;
-		moov_write(fmoov, moov_data);
-		moov_size = read_32(moov_data);
-		bucket_insert_tail(buckets, bucket_init_memory(moov_data, moov_size));
-		filepos += moov_size;
-		moov_exit(fmoov);
-	}
-  }
-
-  {
-	  unsigned int i;
-
-	  mfra = mfra_init();
-	  mfra->tracks_ = moov->tracks_;
-	  for(i = 0; i != moov->tracks_; ++i)
-	  {
-		  unsigned int start;
-		  struct trak_t const* trak = moov->traks_[i];
-
-		  struct tfra_t* tfra = tfra_init();
-		  mfra->tfras_[i] = tfra;
-		  tfra->version_ = 1;
-		  tfra->flags_ = 0;
-		  tfra->track_id_ = trak->tkhd_->track_id_;
-		  tfra->length_size_of_traf_num_ = 1;
-		  tfra->length_size_of_trun_num_ = 1;
-		  tfra->length_size_of_sample_num_ = 1;
-
-		  // count the number of smooth sync samples (nr of moofs)
-		  tfra->number_of_entry_ = 0;
-		  for(start = 0; start != trak->samples_size_; ++start)
-		  {
-			  {
-				  if(trak->samples_[start].is_smooth_ss_)
-				  {
-					  ++tfra->number_of_entry_;
-				  }
-			  }
-		  }
-		  tfra->table_ = (struct tfra_table_t*)
-			  malloc(tfra->number_of_entry_ * sizeof(struct tfra_table_t));
-
-		  tfra_entries += tfra->number_of_entry_;
-
-		  start = 0;
-		  while(start != trak->samples_size_)
-		  {
-			  struct bucket_t* bucket;
-			  struct tfra_table_t* table;
-			  unsigned int end = start;
-			  
-			  while(++end != trak->samples_size_)
-			  {
-				  if(trak->samples_[end].is_smooth_ss_)
-					  break;
-			  }
-			 
-			  bucket= bucket_init(BUCKET_TYPE_MEMORY);
-			  bucket_insert_tail(buckets, bucket);
-
-			  moof = moof_init();
-
-			  moof_create(mp4_context, moof, trak, start, end, buckets, options);
-
-			  if(options->output_format == OUTPUT_FORMAT_MP4)
-			  {
-				  unsigned char moof_data[8192];
-				  unsigned int moof_size;
-				  moof_write(moof, moof_data);
-				  moof_size = read_32(moof_data);
-
-				  bucket->buf_ = malloc(moof_size);
-				  bucket->size_ = moof_size;
-				  memcpy(bucket->buf_, moof_data, (size_t)bucket->size_);
-				  //        bucket_insert_head(buckets, bucket_init_memory(moof_data, moof_size));
-			  }
-
-			  moof_exit(moof);
-
-			  table = &tfra->table_[tfra_index];
-			  // SmoothStreaming uses a fixed 10000000 timescale
-			  table->time_ = trak_time_to_moov_time(
-				  trak->samples_[start].pts_, 10000000, trak->mdia_->mdhd_->timescale_);
-			  table->moof_offset_ = filepos;
-			  table->traf_number_ = 0;
-			  table->trun_number_ = 0;
-			  table->sample_number_ = 0;
-
-			  // advance filepos for moof and mdat atom
-			  while(*buckets != bucket)
-			  {
-				  filepos += bucket->size_;
-				  bucket = bucket->next_;
-			  }
-
-			  // next fragment
-			  ++tfra_index;
-			  start = end;
-		  }
-		  // next track
-	  }
-  }
-  
-	mfra_data = (unsigned char*)malloc(8192 + tfra_entries * 28);
-    mfra_size = mfra_write(mfra, mfra_data);
-    bucket_insert_tail(buckets, bucket_init_memory(mfra_data, mfra_size));
-    mfra_exit(mfra);
-    free(mfra_data);
-  
+    fmoov->mvex_ = mvex_create(fmoov);
+
+    {
+      unsigned char* moov_data;
+      uint32_t moov_size;
+      moov_data = mp4_context->moov_data;
+      moov_write(fmoov, moov_data);
+      moov_size = read_32(moov_data);
+      bucket_insert_tail(buckets, bucket_init_memory(moov_data, moov_size));
+      filepos += moov_size;
+      moov_exit(fmoov);
+    }
+  }
+
+  // Plan the fragment boundaries of all tracks up front from the sample index
+  plan.mp4_context_ = mp4_context;
+  plan.options_ = options;
+  plan.fragments_ = 0;
+  {
+    unsigned int i;
+    for(i = 0; i != moov->tracks_; ++i)
+    {
+      plan.fragments_ += trak_count_fragments(moov->traks_[i]);
+    }
+  }
+  plan.fragment_ = (struct fragment_t*)
+    malloc(plan.fragments_ * sizeof(struct fragment_t));
+
+  mfra = mfra_init();
+  mfra->tracks_ = moov->tracks_;
+  {
+    unsigned int i;
+    struct fragment_t* fragment = plan.fragment_;
+
+    for(i = 0; i != moov->tracks_; ++i)
+    {
+      unsigned int start;
+      unsigned int tfra_index = 0;
+      struct trak_t const* trak = moov->traks_[i];
+
+      struct tfra_t* tfra = tfra_init();
+      mfra->tfras_[i] = tfra;
+      tfra->version_ = 1;
+      tfra->flags_ = 0;
+      tfra->track_id_ = trak->tkhd_->track_id_;
+      tfra->length_size_of_traf_num_ = 1;
+      tfra->length_size_of_trun_num_ = 1;
+      tfra->length_size_of_sample_num_ = 1;
+      tfra->number_of_entry_ = trak_count_fragments(trak);
+      tfra->table_ = (struct tfra_table_t*)
+        malloc(tfra->number_of_entry_ * sizeof(struct tfra_table_t));
+
+      start = 0;
+      while(start != trak->samples_size_)
+      {
+        unsigned int end = start;
+
+        while(++end != trak->samples_size_)
+        {
+          if(trak->samples_[end].is_smooth_ss_)
+            break;
+        }
+
+        fragment->trak_ = trak;
+        fragment->track_ = i;
+        fragment->start_ = start;
+        fragment->end_ = end;
+        // SmoothStreaming uses a fixed 10000000 timescale
+        fragment->time_ = trak_time_to_moov_time(
+          trak->samples_[start].pts_, 10000000, trak->mdia_->mdhd_->timescale_);
+        fragment->tfra_ = &tfra->table_[tfra_index];
+        fragment->buckets_ = 0;
+        fragment->size_ = 0;
+        ++fragment;
+
+        // next fragment
+        ++tfra_index;
+        start = end;
+      }
+      // next track
+    }
+  }
+
+  // Interleave the moof/mdat pairs of all tracks by the fragment start time,
+  // so that fragments for the same time are stored next to each other.
+  if(options->interleave)
+  {
+    qsort(plan.fragment_, plan.fragments_, sizeof(struct fragment_t),
+          &fragment_compare_time);
+  }
+
+  // Build the moofs of the independent fragments on the worker pool
+  {
+    unsigned int workers = options->threads;
+    if(workers > plan.fragments_)
+    {
+      workers = plan.fragments_;
+    }
+    result = mp4_run_workers(workers, &fragment_worker, &plan);
+  }
+
+  // Optionally, a segment index for every track follows the moov, so that
+  // a client can resolve a seek from the start of the file.
+  if(options->sidx)
+  {
+    unsigned int i;
+    for(i = 0; i != moov->tracks_; ++i)
+    {
+      sidx_bytes += sidx_size(mfra->tfras_[i]->number_of_entry_);
+    }
+  }
+
+  // The file positions follow from the sizes of the fragments.
+  {
+    unsigned int i;
+    uint64_t moof_offset = filepos + sidx_bytes;
+    for(i = 0; i != plan.fragments_; ++i)
+    {
+      struct fragment_t* fragment = &plan.fragment_[i];
+      struct tfra_table_t* table = fragment->tfra_;
+
+      table->time_ = fragment->time_;
+      table->moof_offset_ = moof_offset;
+      table->traf_number_ = 0;
+      table->trun_number_ = 0;
+      table->sample_number_ = 0;
+
+      moof_offset += fragment->size_;
+    }
+  }
+
+  if(sidx_bytes)
+  {
+    unsigned int i;
+    unsigned char* sidx_data = (unsigned char*)malloc(sidx_bytes);
+    unsigned char* buffer = sidx_data;
+    for(i = 0; i != moov->tracks_ && buffer; ++i)
+    {
+      buffer = sidx_write(&plan, i,
+                          filepos + (buffer - sidx_data) +
+                          sidx_size(mfra->tfras_[i]->number_of_entry_),
+                          buffer);
+    }
+    if(buffer == NULL)
+    {
+      MP4_ERROR("%s", "Error: a fragment is too large for the sidx\n");
+      free(sidx_data);
+      result = 0;
+    }
+    else
+    {
+      bucket_insert_tail(buckets, bucket_init_owned(sidx_data, sidx_bytes));
+    }
+    filepos += sidx_bytes;
+  }
+
+  // Assemble the fragments in order. The pacing follows the order of the
+  // fragments, so it needs the fragments of the tracks to be interleaved.
+  {
+    unsigned int i;
+    for(i = 0; i != plan.fragments_; ++i)
+    {
+      struct fragment_t* fragment = &plan.fragment_[i];
+
+      filepos += fragment->size_;
+      mp4_pace_mark(options,
+                    trak_elapsed_time(fragment->trak_, 0, fragment->start_),
+                    filepos);
+
+      if(result)
+      {
+        buckets_insert_tail(buckets, fragment->buckets_);
+      }
+      else if(fragment->buckets_)
+      {
+        buckets_exit(fragment->buckets_);
+      }
+    }
+    free(plan.fragment_);
+  }
+
+  mfra_data = (unsigned char*)malloc(8192 + plan.fragments_ * 28);
+  mfra_size = mfra_write(mfra, mfra_data);
+  bucket_insert_tail(buckets, bucket_init_owned(mfra_data, mfra_size));
+  mfra_exit(mfra);
 
   return result;
 }
 
+// CMAF (DASH)
+
+static struct trak_t* moov_find_track(struct moov_t const* moov,
+                                      uint32_t track_id)
+{
+  unsigned int i;
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    if(moov->traks_[i]->tkhd_->track_id_ == track_id)
+    {
+      return moov->traks_[i];
+    }
+  }
+
+  return NULL;
+}
+
+extern int output_cmaf_init(struct mp4_context_t const* mp4_context,
+                            struct bucket_t** buckets,
+                            struct mp4_split_options_t const* options)
+{
+  struct moov_t* moov = mp4_context->moov;
+  struct trak_t const* trak = moov_find_track(moov, options->cmaf_track_id);
+
+  if(trak == NULL)
+  {
+    MP4_ERROR("No track with id %u\n", options->cmaf_track_id);
+    return 0;
+  }
+
+  {
+    unsigned char ftyp[28];
+    unsigned char* buffer = ftyp;
+    buffer = write_32(buffer, 28);
+    buffer = write_32(buffer, FOURCC('f', 't', 'y', 'p'));
+    buffer = write_32(buffer, FOURCC('c', 'm', 'f', 'c'));
+    buffer = write_32(buffer, 0);
+    buffer = write_32(buffer, FOURCC('c', 'm', 'f', 'c'));
+    buffer = write_32(buffer, FOURCC('i', 's', 'o', '6'));
+    buffer = write_32(buffer, FOURCC('d', 'a', 's', 'h'));
+    bucket_insert_tail(buckets, bucket_init_memory(ftyp, sizeof(ftyp)));
+  }
+
+  // The init segment has a single track with empty sample tables, in the
+  // native timescale of the track.
+  {
+    struct moov_t* fmoov = moov_init();
+    struct trak_t* ftrak = trak_init();
+    struct mdia_t const* mdia = trak->mdia_;
+    struct mdia_t* fmdia = mdia_init();
+    struct minf_t const* minf = mdia->minf_;
+    struct minf_t* fminf = minf_init();
+    struct stbl_t* fstbl = stbl_init();
+    unsigned char* moov_data = mp4_context->moov_data;
+    uint32_t moov_size;
+
+    fmoov->mvhd_ = mvhd_copy(moov->mvhd_);
+    fmoov->mvhd_->duration_ = 0;
+    fmoov->tracks_ = 1;
+    fmoov->traks_[0] = ftrak;
+
+    ftrak->tkhd_ = tkhd_copy(trak->tkhd_);
+    ftrak->tkhd_->duration_ = 0;
+    ftrak->mdia_ = fmdia;
+    fmdia->mdhd_ = mdhd_copy(mdia->mdhd_);
+    fmdia->mdhd_->duration_ = 0;
+    fmdia->hdlr_ = hdlr_copy(mdia->hdlr_);
+    fmdia->minf_ = fminf;
+    fminf->smhd_ = minf->smhd_ == NULL ? NULL : smhd_copy(minf->smhd_);
+    fminf->vmhd_ = minf->vmhd_ == NULL ? NULL : vmhd_copy(minf->vmhd_);
+    fminf->dinf_ = dinf_copy(minf->dinf_);
+    fminf->stbl_ = fstbl;
+    fstbl->stsd_ = stsd_copy(minf->stbl_->stsd_);
+    fstbl->stts_ = stts_init();
+    fstbl->stsc_ = stsc_init();
+    fstbl->stsc_->version_ = 0;
+    fstbl->stsc_->flags_ = 0;
+    fstbl->stsc_->entries_ = 0;
+    fstbl->stsz_ = stsz_init();
+    fstbl->stsz_->version_ = 0;
+    fstbl->stsz_->flags_ = 0;
+    fstbl->stsz_->sample_size_ = 0;
+    fstbl->stsz_->entries_ = 0;
+    fstbl->stco_ = stco_init();
+    fstbl->stco_->version_ = 0;
+    fstbl->stco_->flags_ = 0;
+    fstbl->stco_->entries_ = 0;
+
+    // The segment timeline has the decode times of the fragments. With
+    // composition offsets (B-frames) an edit list moves the presentation back
+    // by the offset of the first sample, so that the keyframes are presented
+    // at their decode times.
+    {
+      struct ctts_t const* ctts = minf->stbl_->ctts_;
+      int32_t cto = ctts && ctts->entries_ ?
+        (int32_t)ctts->table_[0].sample_offset_ : 0;
+      if(cto > 0)
+      {
+        struct elst_t* elst = elst_init();
+        elst->entries_ = 1;
+        elst->table_ = (elst_table_t*)malloc(sizeof(elst_table_t));
+        elst->table_[0].segment_duration_ = 0;
+        elst->table_[0].media_time_ = cto;
+        elst->table_[0].media_rate_integer_ = 1;
+        elst->table_[0].media_rate_fraction_ = 0;
+        ftrak->edts_ = edts_init();
+        ftrak->edts_->elst_ = elst;
+      }
+    }
+
+    fmoov->mvex_ = mvex_create(fmoov);
+
+    moov_write(fmoov, moov_data);
+    moov_size = read_32(moov_data);
+    bucket_insert_tail(buckets, bucket_init_memory(moov_data, moov_size));
+    moov_exit(fmoov);
+  }
+
+  return 1;
+}
+
+extern int output_cmaf_segment(struct mp4_context_t const* mp4_context,
+                               struct bucket_t** buckets,
+                               struct mp4_split_options_t* options)
+{
+  struct moov_t* moov = mp4_context->moov;
+  struct trak_t const* trak;
+  struct mp4_split_options_t cmaf_options = *options;
+  unsigned int first;
+  unsigned int start;
+  unsigned int end;
+  uint32_t sequence_number;
+  uint64_t filepos = 0;
+  int result = 1;
+
+  if(!moov_build_index(mp4_context, moov, options))
+  {
+    return 0;
+  }
+
+  trak = moov_find_track(moov, options->cmaf_track_id);
+  if(trak == NULL)
+  {
+    MP4_ERROR("No track with id %u\n", options->cmaf_track_id);
+    return 0;
+  }
+
+  // The segment boundaries are the smooth sync samples, the same as for
+  // the fragments of SmoothStreaming. The sequence number counts the chunks
+  // of the preceding segments.
+  start = 0;
+  while(start != trak->samples_size_ &&
+        trak->samples_[start].pts_ != options->cmaf_time)
+  {
+    start = trak_fragment_end(trak, start);
+  }
+  if(start == trak->samples_size_)
+  {
+    MP4_ERROR("No segment at time %llu\n", options->cmaf_time);
+    return 0;
+  }
+  sequence_number = trak_chunk_sequence_number(trak, start, options);
+
+  first = start;
+  end = trak_fragment_end(trak, start);
+
+  cmaf_options.output_format = OUTPUT_FORMAT_CMAF;
+
+  {
+    unsigned char styp[24];
+    unsigned char* buffer = styp;
+    buffer = write_32(buffer, 24);
+    buffer = write_32(buffer, FOURCC('s', 't', 'y', 'p'));
+    buffer = write_32(buffer, FOURCC('c', 'm', 'f', 's'));
+    buffer = write_32(buffer, 0);
+    buffer = write_32(buffer, FOURCC('c', 'm', 'f', 's'));
+    buffer = write_32(buffer, FOURCC('m', 's', 'd', 'h'));
+    bucket_insert_tail(buckets, bucket_init_memory(styp, sizeof(styp)));
+  }
+
+  // In chunked mode the segment is a sequence of CMAF chunks, each with its
+  // own moof/mdat.
+  do
+  {
+    unsigned int chunk_end = trak_chunk_end(trak, start, end, options);
+    result = moof_create_chunk(mp4_context, trak, start, chunk_end,
+                               sequence_number, buckets, &cmaf_options) &&
+             chunk_flush(buckets, trak_elapsed_time(trak, first, start),
+                         &filepos, options);
+    start = chunk_end;
+    ++sequence_number;
+  } while(result && start != end);
+
+  return result;
+}
+
+static char* trak_write_segment_timeline(struct trak_t const* trak, char* p)
+{
+  samples_t const* first = trak->samples_;
+  samples_t const* last = trak->samples_ + trak->samples_size_;
+  uint64_t duration = 0;
+  unsigned int repeat = 0;
+  int is_first = 1;
+
+  p += sprintf(p, "<SegmentTimeline>\n");
+
+  while(first != last)
+  {
+    samples_t const* next = first;
+    uint64_t d;
+
+    while(++next != last)
+    {
+      if(next->is_smooth_ss_)
+        break;
+    }
+    d = next->pts_ - first->pts_;
+
+    if(!is_first && d == duration)
+    {
+      ++repeat;
+    }
+    else
+    {
+      if(!is_first)
+      {
+        p += sprintf(p, " d=\"%llu\"", duration);
+        if(repeat)
+        {
+          p += sprintf(p, " r=\"%u\"", repeat);
+        }
+        p += sprintf(p, " />\n");
+        p += sprintf(p, "<S");
+      }
+      else
+      {
+        p += sprintf(p, "<S t=\"%llu\"", first->pts_);
+        is_first = 0;
+      }
+      duration = d;
+      repeat = 0;
+    }
+    first = next;
+  }
+
+  if(!is_first)
+  {
+    p += sprintf(p, " d=\"%llu\"", duration);
+    if(repeat)
+    {
+      p += sprintf(p, " r=\"%u\"", repeat);
+    }
+    p += sprintf(p, " />\n");
+  }
+
+  p += sprintf(p, "</SegmentTimeline>\n");
+
+  return p;
+}
+
+// The number of keyframes and the peak bitrate of the segments when only
+// the keyframes are sent (the trick play representation).
+static uint32_t trak_trickplay_bitrate(struct trak_t const* trak,
+                                       unsigned int* keyframes)
+{
+  uint32_t timescale = trak->mdia_->mdhd_->timescale_;
+  samples_t const* first = trak->samples_;
+  samples_t const* last = trak->samples_ + trak->samples_size_;
+  uint64_t max_bitrate = 0;
+
+  *keyframes = 0;
+  while(first != last)
+  {
+    samples_t const* next = first;
+    uint64_t bytes = 0;
+    uint64_t duration;
+
+    do
+    {
+      if(next->is_ss_)
+      {
+        bytes += next->size_;
+        ++*keyframes;
+      }
+    } while(++next != last && !next->is_smooth_ss_);
+
+    duration = next->pts_ - first->pts_;
+    if(duration != 0 && bytes * 8 * timescale / duration > max_bitrate)
+    {
+      max_bitrate = bytes * 8 * timescale / duration;
+    }
+    first = next;
+  }
+
+  return (uint32_t)max_bitrate;
+}
+
+extern int mp4_create_mpd(struct mp4_context_t** mp4_context,
+                          unsigned int mp4_contexts,
+                          struct bucket_t** buckets,
+                          struct mp4_split_options_t const* options)
+{
+  // the adaptation sets, the last one is the trick play version of the
+  // video adaptation set
+  static const uint32_t handler_types[] = {
+    FOURCC('v', 'i', 'd', 'e'), FOURCC('s', 'o', 'u', 'n'),
+    FOURCC('v', 'i', 'd', 'e')
+  };
+  unsigned int const trick_type = 2;
+  unsigned int file;
+  unsigned int type;
+  unsigned int representation = 0;
+  size_t buffer_size = 4096;
+  double duration = 0.0;
+  char* buffer;
+  char* p;
+  // the segments are only the same with the same fragment plan
+  char query[MP4_FRAGMENT_QUERY_SIZE];
+  // the trick play representations are described from the full index
+  struct mp4_split_options_t index_options = *options;
+  index_options.trickplay = 0;
+
+  if(mp4_split_options_fragment_query(options, "&amp;", "&amp;",
+                                      query, sizeof(query)) < 0)
+  {
+    return 0;
+  }
+
+  for(file = 0; file != mp4_contexts; ++file)
+  {
+    struct mp4_context_t const* context = mp4_context[file];
+    struct moov_t* moov = context->moov;
+    unsigned int track;
+
+    if(!moov_build_index(context, moov, &index_options))
+    {
+      return 0;
+    }
+
+    for(track = 0; track != moov->tracks_; ++track)
+    {
+      struct trak_t const* trak = moov->traks_[track];
+      double trak_duration =
+        (double)trak->samples_[trak->samples_size_].pts_ /
+        trak->mdia_->mdhd_->timescale_;
+      if(trak_duration > duration)
+      {
+        duration = trak_duration;
+      }
+      // at most one segment per sample (twice for a trick play version)
+      buffer_size += 2 * (2048 + 64 * trak->samples_size_);
+    }
+  }
+
+  buffer = (char*)malloc(buffer_size);
+  p = buffer;
+
+  p += sprintf(p, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+  p += sprintf(p, "<!--Created with mod_smooth_streaming(%s)-->\n",
+               X_MOD_SMOOTH_STREAMING_VERSION);
+  p += sprintf(p, "<MPD"
+                  " xmlns=\"urn:mpeg:dash:schema:mpd:2011\""
+                  " profiles=\"urn:mpeg:dash:profile:isoff-live:2011,"
+                  "urn:mpeg:dash:profile:cmaf:2019\""
+                  " type=\"static\""
+                  " mediaPresentationDuration=\"PT%.3fS\""
+                  " minBufferTime=\"PT2S\""
+                  ">\n",
+               duration);
+  p += sprintf(p, "<Period id=\"0\" start=\"PT0S\">\n");
+
+  for(type = 0; type != sizeof(handler_types) / sizeof(handler_types[0]);
+      ++type)
+  {
+    int is_video = handler_types[type] == FOURCC('v', 'i', 'd', 'e');
+    int is_trick = type == trick_type;
+    int has_adaptation_set = 0;
+
+    if(is_trick && !options->trickplay)
+    {
+      continue;
+    }
+
+    for(file = 0; file != mp4_contexts; ++file)
+    {
+      struct mp4_context_t const* context = mp4_context[file];
+      struct moov_t const* moov = context->moov;
+      char const* filename = context->filename_;
+      unsigned int track;
+
+      // the segment urls are relative to the manifest
+      {
+        char const* slash = strrchr(filename, '/');
+        if(slash == NULL)
+        {
+          slash = strrchr(filename, '\\');
+        }
+        if(slash)
+        {
+          filename = slash + 1;
+        }
+      }
+
+      for(track = 0; track != moov->tracks_; ++track)
+      {
+        struct trak_t const* trak = moov->traks_[track];
+        uint32_t timescale = trak->mdia_->mdhd_->timescale_;
+        uint32_t track_id = trak->tkhd_->track_id_;
+
+        if(trak->mdia_->hdlr_->handler_type_ != handler_types[type])
+        {
+          continue;
+        }
+
+        if(!has_adaptation_set)
+        {
+          p += sprintf(p, "<AdaptationSet"
+                          " id=\"%u\""
+                          " contentType=\"%s\""
+                          " mimeType=\"%s\""
+                          " segmentAlignment=\"true\""
+                          " startWithSAP=\"1\""
+                          ">\n",
+                       type + 1,
+                       is_video ? "video" : "audio",
+                       is_video ? "video/mp4" : "audio/mp4");
+          // a trick mode adaptation set names the set it is a version of
+          if(is_trick)
+          {
+            p += sprintf(p, "<EssentialProperty"
+                            " schemeIdUri=\"http://dashif.org/guidelines/trickmode\""
+                            " value=\"1\" />\n");
+          }
+          has_adaptation_set = 1;
+        }
+
+        // the peak bitrate of the segments, so that a client that can
+        // sustain the bandwidth never stalls on a segment.
+        if(is_trick)
+        {
+          unsigned int keyframes;
+          uint32_t bitrate = trak_trickplay_bitrate(trak, &keyframes);
+          p += sprintf(p, "<Representation"
+                          " id=\"%u\""
+                          " bandwidth=\"%u\""
+                          " codecs=\"",
+                       ++representation, bitrate);
+          p = trak_write_codecs(trak, p);
+          // played at the original frame rate, the keyframes are this many
+          // times faster than the media
+          p += sprintf(p, "\" maxPlayoutRate=\"%u\" codingDependency=\"false\"",
+                       keyframes == 0 ? 1 :
+                       (trak->samples_size_ + keyframes / 2) / keyframes);
+        }
+        else
+        {
+          p += sprintf(p, "<Representation"
+                          " id=\"%u\""
+                          " bandwidth=\"%u\""
+                          " codecs=\"",
+                       ++representation, trak->max_bitrate_);
+          p = trak_write_codecs(trak, p);
+          p += sprintf(p, "\"");
+        }
+        if(is_video)
+        {
+          p += sprintf(p, " width=\"%u\" height=\"%u\"",
+                       trak->tkhd_->width_ / 65536,
+                       trak->tkhd_->height_ / 65536);
+        }
+        else
+        {
+          p += sprintf(p, " audioSamplingRate=\"%u\"", timescale);
+        }
+        p += sprintf(p, ">\n");
+
+        p += sprintf(p, "<SegmentTemplate"
+                        " timescale=\"%u\""
+                        " initialization=\"%s?cmaf_init=%u\""
+                        " media=\"%s?cmaf_segment=%u&amp;cmaf_time=$Time$%s%s\""
+                        ">\n",
+                     timescale, filename, track_id, filename, track_id,
+                     query, is_trick ? "&amp;trickplay=1" : "");
+        p = trak_write_segment_timeline(trak, p);
+        p += sprintf(p, "</SegmentTemplate>\n");
+        p += sprintf(p, "</Representation>\n");
+      }
+    }
+
+    if(has_adaptation_set)
+    {
+      p += sprintf(p, "</AdaptationSet>\n");
+    }
+  }
+
+  p += sprintf(p, "</Period>\n");
+  p += sprintf(p, "</MPD>\n");
+
+  bucket_insert_tail(buckets, bucket_init_owned(buffer, p - buffer));
+
+  return 1;
+}
+
+// One line per track with the bitrates measured by moov_build_index (CSV).
+
+extern int mp4_create_bitrates(struct mp4_context_t** mp4_context,
+                               unsigned int mp4_contexts,
+                               struct bucket_t** buckets,
+                               struct mp4_split_options_t const* options)
+{
+  struct mp4_split_options_t index_options = *options;
+  bucket_writer_t writer;
+  unsigned int file;
+
+  index_options.index_times_only = 1;
+
+  bucket_writer_init(&writer, buckets);
+  bucket_writer_puts(&writer,
+    "file,track_id,handler,fragments,avg_bitrate,max_bitrate\n");
+
+  for(file = 0; file != mp4_contexts; ++file)
+  {
+    struct mp4_context_t const* context = mp4_context[file];
+    struct moov_t* moov = context->moov;
+    unsigned int track;
+
+    if(!moov_build_index(context, moov, &index_options))
+    {
+      bucket_writer_flush(&writer);
+      return 0;
+    }
+
+    for(track = 0; track != moov->tracks_; ++track)
+    {
+      struct trak_t const* trak = moov->traks_[track];
+      uint32_t handler_type = trak->mdia_->hdlr_->handler_type_;
+      char handler[5];
+      unsigned int fragments = 0;
+      unsigned int s;
+
+      for(s = 0; s != trak->samples_size_; ++s)
+      {
+        if(trak->samples_[s].is_smooth_ss_)
+        {
+          ++fragments;
+        }
+      }
+      if(!fragments && trak->samples_size_)
+      {
+        fragments = 1;
+      }
+
+      handler[0] = (char)(handler_type >> 24);
+      handler[1] = (char)(handler_type >> 16);
+      handler[2] = (char)(handler_type >> 8);
+      handler[3] = (char)(handler_type >> 0);
+      handler[4] = '\0';
+
+      bucket_writer_puts(&writer, context->filename_);
+      bucket_writer_puts(&writer, ",");
+      bucket_writer_putu(&writer, trak->tkhd_->track_id_);
+      bucket_writer_puts(&writer, ",");
+      bucket_writer_puts(&writer, handler);
+      bucket_writer_puts(&writer, ",");
+      bucket_writer_putu(&writer, fragments);
+      bucket_writer_puts(&writer, ",");
+      bucket_writer_putu(&writer, trak->avg_bitrate_);
+      bucket_writer_puts(&writer, ",");
+      bucket_writer_putu(&writer, trak->max_bitrate_);
+      bucket_writer_puts(&writer, "\n");
+    }
+  }
+
+  bucket_writer_flush(&writer);
+
+  return 1;
+}
+
 // End Of File
 
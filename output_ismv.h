@@ -45,21 +45,48 @@ int output_ismv(struct mp4_context_t const* mp4_context,
                 unsigned int* trak_sample_start,
                 unsigned int* trak_sample_end,
                 struct bucket_t** buckets,
-                struct mp4_split_options_t const* options);
+                struct mp4_split_options_t* options);
 
 // Manifest generation
 
 MOD_STREAMING_DLL_LOCAL extern
 int mp4_create_manifest(struct mp4_context_t** mp4_context,
                         unsigned int mp4_contexts,
-                        struct bucket_t** buckets);
+                        struct bucket_t** buckets,
+                        struct mp4_split_options_t const* options);
+
+// CMAF (DASH) init segment, media segment and MPD
+
+MOD_STREAMING_DLL_LOCAL extern
+int output_cmaf_init(struct mp4_context_t const* mp4_context,
+                     struct bucket_t** buckets,
+                     struct mp4_split_options_t const* options);
+
+MOD_STREAMING_DLL_LOCAL extern
+int output_cmaf_segment(struct mp4_context_t const* mp4_context,
+                        struct bucket_t** buckets,
+                        struct mp4_split_options_t* options);
+
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_create_mpd(struct mp4_context_t** mp4_context,
+                   unsigned int mp4_contexts,
+                   struct bucket_t** buckets,
+                   struct mp4_split_options_t const* options);
+
+// The measured average and peak bitrate of every track (CSV)
+
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_create_bitrates(struct mp4_context_t** mp4_context,
+                        unsigned int mp4_contexts,
+                        struct bucket_t** buckets,
+                        struct mp4_split_options_t const* options);
 
 // Fragment a complete file
 
 MOD_STREAMING_DLL_LOCAL extern
 int mp4_fragment_file(struct mp4_context_t const* mp4_context,
                       struct bucket_t** buckets,
-                      struct mp4_split_options_t const* options);
+                      struct mp4_split_options_t* options);
 
 
 #ifdef __cplusplus
@@ -26,8 +26,6 @@
 #include <sys/types.h>  // FreeBSD doesn't define off_t in stdio.h
 
 #if defined HAVE_ZLIB_H && defined HAVE_LIBZ
-// Compress the MOOV atom. Turn this off for Flash as it doesn't support it.
-// # define COMPRESS_MOOV_ATOM
 # include <zlib.h>
 #endif
 
@@ -63,7 +61,10 @@ static void create_traffic_shaping(struct moov_t* moov,
     while(sample != end_sample)
     {
       uint64_t trak_end_offset = 0;
-      while(sample != end_sample && samples[sample].pts_ <= pts)
+      // the last second takes the remaining samples (the samples of a trak
+      // can span more than the duration of the movie, e.g. with an edit list)
+      while(sample != end_sample &&
+            (samples[sample].pts_ <= pts || second + 1 == options->seconds))
       {
         trak_end_offset = samples[sample].pos_;
         trak_end_offset += samples[sample].size_;
@@ -113,101 +114,163 @@ static void moov_shift_offsets_inplace(struct moov_t* moov, int64_t offset)
 }
 
 
-static void compress_moov(struct mp4_context_t* mp4_context,
-                          struct moov_t* moov,
-                          unsigned char* moov_data,
-                          uint64_t* moov_size)
-{
 #if defined HAVE_ZLIB_H && defined HAVE_LIBZ
-  uLong sourceLen = (uLong)(*moov_size - ATOM_PREAMBLE_SIZE);
-  uLong destLen = compressBound(sourceLen);
-  unsigned char* cmov = (unsigned char*)malloc(destLen);
-  int zstatus = compress(cmov, &destLen, moov_data, sourceLen);
-  if(zstatus == Z_OK)
+// Writes the compressed movie atom in moov_data, padded with a free atom
+static void cmov_write(unsigned char* moov_data, uint64_t moov_size,
+                       unsigned char const* cmvd_data, uLong cmvd_size,
+                       uLong uncompressed_size)
+{
+  uint32_t dcom_size = ATOM_PREAMBLE_SIZE + 4;
+  uint32_t cmvd_atom_size = ATOM_PREAMBLE_SIZE + 4 + (uint32_t)cmvd_size;
+  uint32_t cmov_size = ATOM_PREAMBLE_SIZE + dcom_size + cmvd_atom_size;
+  uint32_t free_size = (uint32_t)moov_size - ATOM_PREAMBLE_SIZE - cmov_size;
+  unsigned char* outbuffer = moov_data;
+
+  outbuffer = write_32(outbuffer, (uint32_t)moov_size);
+  outbuffer = write_32(outbuffer, FOURCC('m', 'o', 'o', 'v'));
+
+  outbuffer = write_32(outbuffer, cmov_size);
+  outbuffer = write_32(outbuffer, FOURCC('c', 'm', 'o', 'v'));
   {
-    MP4_INFO("cmov size = %lu (%ld%%)\n", destLen, 100 * destLen / sourceLen);
+    outbuffer = write_32(outbuffer, dcom_size);
+    outbuffer = write_32(outbuffer, FOURCC('d', 'c', 'o', 'm'));
+    outbuffer = write_32(outbuffer, FOURCC('z', 'l', 'i', 'b'));
+
+    outbuffer = write_32(outbuffer, cmvd_atom_size);
+    outbuffer = write_32(outbuffer, FOURCC('c', 'm', 'v', 'd'));
+    outbuffer = write_32(outbuffer, (uint32_t)uncompressed_size);
+    memcpy(outbuffer, cmvd_data, cmvd_size);
+    outbuffer += cmvd_size;
   }
 
+  // the reserved space that the compressed movie didn't use
+  if(free_size)
   {
-    const int extra_space = 4096;
-    if(destLen + extra_space < sourceLen)
-    {
-      const int bytes_saved = sourceLen - destLen;
-      uLong destLen2;
-      int extra = 0;
-      MP4_INFO("shifting offsets by %d\n", -bytes_saved);
-      moov_shift_offsets_inplace(moov, -bytes_saved);
-
-      extra += ATOM_PREAMBLE_SIZE + 4;            // dcom
-      extra += ATOM_PREAMBLE_SIZE + 4;            // cmvd
-      extra += ATOM_PREAMBLE_SIZE;                // cmov
-      extra += ATOM_PREAMBLE_SIZE + extra_space;  // free
-
-      MP4_INFO("shifting offsets by %d\n", extra);
-      moov_shift_offsets_inplace(moov, extra);
+    outbuffer = write_32(outbuffer, free_size);
+    outbuffer = write_32(outbuffer, FOURCC('f', 'r', 'e', 'e'));
+    memset(outbuffer, 0, free_size - ATOM_PREAMBLE_SIZE);
+  }
+}
+#endif
 
-      // recompress
-      destLen2 = compressBound(sourceLen);
-      zstatus = compress(cmov, &destLen2, moov_data, sourceLen);
-      if(zstatus == Z_OK)
+// Replaces the moov by a compressed movie atom ('cmov') when that is smaller.
+// The chunk offsets are shifted by base plus the size of the new moov, so the
+// compressed size depends on the offsets. The size is reserved up front and
+// the remainder is padded with a free atom. Returns the size of the new moov.
+static uint64_t compress_moov(struct mp4_context_t* mp4_context,
+                              struct moov_t* moov,
+                              unsigned char* moov_data,
+                              uint64_t moov_size,
+                              int64_t base,
+                              struct manifest_cache_t* cache)
+{
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+  // the moov, cmov, dcom and cmvd headers
+  uint64_t const cmov_header_size = 4 * ATOM_PREAMBLE_SIZE + 4 + 4;
+  uLong source_size = (uLong)moov_size;
+  unsigned char* cmvd_data = (unsigned char*)malloc(compressBound(source_size));
+  uLong cmvd_size;
+  uint64_t size = moov_size;
+  int64_t shift = base + moov_size;
+  char* variant = NULL;
+  char etag[MANIFEST_CACHE_ETAG_SIZE];
+  int compressed = 0;
+  int pass;
+
+  // the cache is keyed by the clip, the base and the uncompressed moov
+  if(cache != NULL)
+  {
+    struct bucket_t* buckets = NULL;
+    manifest_cache_etag((char const*)moov_data, moov_size, etag);
+    variant = (char*)malloc(strlen(mp4_context->filename_) + 64);
+    sprintf(variant, "%s?cmov=%lld:%s",
+            mp4_context->filename_, (long long)base, etag);
+    if(manifest_cache_get(cache, variant, NULL, 0, &buckets, etag))
+    {
+      struct bucket_iovec_t* iov;
+      uint64_t cached_size;
+      if(buckets_iovec(buckets, &iov, &cached_size) == 1 &&
+         cached_size < moov_size &&
+         read_32((unsigned char const*)iov[0].base_) == cached_size)
       {
-        MP4_INFO("cmov size = %lu (%ld%%)\n", destLen2, 100 * destLen2 / sourceLen);
-
-        if(destLen2 < destLen + extra_space)
-        {
-          // copy compressed movie atom
-          unsigned char* outbuffer = moov_data;
+        MP4_INFO("cmov from cache (ETag: %s)\n", etag);
+        memcpy(moov_data, iov[0].base_, (size_t)cached_size);
+        size = cached_size;
+      }
+      free(iov);
+      buckets_exit(buckets);
+      if(size != moov_size)
+      {
+        free(variant);
+        free(cmvd_data);
+        return size;
+      }
+    }
+  }
 
-          uint32_t dcom_size = ATOM_PREAMBLE_SIZE + 4;
-          uint32_t cmvd_size = ATOM_PREAMBLE_SIZE + 4 + destLen2;
-          uint32_t cmov_size = ATOM_PREAMBLE_SIZE + dcom_size + cmvd_size;
-          uint32_t free_size = ATOM_PREAMBLE_SIZE + extra_space + destLen - destLen2;
-          *moov_size = ATOM_PREAMBLE_SIZE + cmov_size + free_size;
+  moov_shift_offsets_inplace(moov, shift);
 
-          outbuffer = write_32(outbuffer, (uint32_t)*moov_size);
+  // the first pass estimates the size, the next ones check that the
+  // compressed moov (with the final offsets) fits in the reserved size
+  for(pass = 0; pass != 4; ++pass)
+  {
+    cmvd_size = compressBound(source_size);
+    if(compress(cmvd_data, &cmvd_size, moov_data, source_size) != Z_OK)
+    {
+      MP4_ERROR("%s", "Error: compressing moov\n");
+      break;
+    }
+    MP4_INFO("cmov size = %lu (%lu%%)\n",
+             cmvd_size, 100 * cmvd_size / source_size);
 
-          // skip 'moov'
-          outbuffer += 4;
+    if(pass != 0 &&
+       (cmov_header_size + cmvd_size == size ||
+        cmov_header_size + cmvd_size + ATOM_PREAMBLE_SIZE <= size))
+    {
+      compressed = 1;
+      break;
+    }
 
-          outbuffer = write_32(outbuffer, cmov_size);
-          {
-            outbuffer = write_32(outbuffer, FOURCC('c', 'm', 'o', 'v'));
-            outbuffer = write_32(outbuffer, dcom_size);
-            outbuffer = write_32(outbuffer, FOURCC('d', 'c', 'o', 'm'));
-            outbuffer = write_32(outbuffer, FOURCC('z', 'l', 'i', 'b'));
+    // reserve some space for the change in offsets
+    size = cmov_header_size + cmvd_size + ATOM_PREAMBLE_SIZE +
+           cmvd_size / 64 + 64;
+    if(size >= moov_size)
+    {
+      break;
+    }
+    moov_shift_offsets_inplace(moov, base + size - shift);
+    shift = base + size;
+  }
 
-            outbuffer = write_32(outbuffer, cmvd_size);
-            {
-              outbuffer = write_32(outbuffer, FOURCC('c', 'm', 'v', 'd'));
-              outbuffer = write_32(outbuffer, sourceLen);
-              memcpy(outbuffer, cmov, destLen2);
-              outbuffer += destLen2;
-            }
-          }
+  if(!compressed)
+  {
+    // not worth it, keep the uncompressed moov
+    MP4_INFO("%s", "cmov: keeping the uncompressed moov\n");
+    moov_shift_offsets_inplace(moov, base + moov_size - shift);
+    size = moov_size;
+  }
+  else
+  {
+    cmov_write(moov_data, size, cmvd_data, cmvd_size, source_size);
 
-          // add final padding
-          outbuffer = write_32(outbuffer, free_size);
-          outbuffer = write_32(outbuffer, FOURCC('f', 'r', 'e', 'e'));
-          {
-            const char free_bytes[8] =
-            {
-              'C', 'o', 'd', 'e','S','h', 'o', 'p'
-            };
-            uint32_t padding_index;
-            for(padding_index = ATOM_PREAMBLE_SIZE; padding_index != free_size; ++padding_index)
-            {
-              outbuffer[padding_index] = free_bytes[padding_index % 8];
-            }
-          }
-        }
-        else
-        {
-          MP4_ERROR("%s", "2nd pass compress overflow\n");
-        }
-      }
+    if(cache != NULL)
+    {
+      struct bucket_t* buckets = NULL;
+      bucket_insert_tail(&buckets, bucket_init_reference(moov_data, size));
+      manifest_cache_put(cache, variant, NULL, 0, buckets, etag);
+      buckets_exit(buckets);
     }
   }
-  free(cmov);
+
+  free(variant);
+  free(cmvd_data);
+
+  return size;
+#else
+  MP4_WARNING("%s", "cmov: compiled without zlib, moov is not compressed\n");
+  moov_shift_offsets_inplace(moov, base + moov_size);
+
+  return moov_size;
 #endif
 }
 
@@ -297,6 +360,11 @@ static void trak_update_index(struct mp4_context_t const* mp4_context,
         unsigned int stsc_entries = 0;
         unsigned int chunk_start = i;
         unsigned int chunk_end;
+
+        // a partial first and last chunk can each add an entry
+        stsc->table_ = (stsc_table_t*)realloc(stsc->table_,
+          (stsc->entries_ + 3) * sizeof(stsc_table_t));
+
         // problem.mp4: reported by Jin-seok Lee. Second track contains no samples
         if(trak->chunks_size_ != 0)
         {
@@ -403,11 +471,508 @@ static void trak_update_index(struct mp4_context_t const* mp4_context,
 }
 
 
-extern int output_mp4(struct mp4_context_t* mp4_context,
-                      unsigned int const* trak_sample_start,
-                      unsigned int const* trak_sample_end,
-                      struct bucket_t** buckets,
-                      struct mp4_split_options_t* options)
+// Removes the unknown atoms of the given type
+static void unknown_atoms_remove(struct unknown_atom_t** atoms, uint32_t type)
+{
+  while(*atoms)
+  {
+    struct unknown_atom_t* atom = *atoms;
+    if(read_32((unsigned char const*)atom->atom_ + 4) == type)
+    {
+      *atoms = atom->next_;
+      atom->next_ = NULL;
+      unknown_atom_exit(atom);
+    }
+    else
+    {
+      atoms = &atom->next_;
+    }
+  }
+}
+
+// The media time of the first non-empty edit of the (unparsed) edts of the
+// input, e.g. the composition offset of B-frames or the AAC priming. Zero when
+// there is no edit list.
+static uint64_t unknown_atoms_edit_media_time(struct unknown_atom_t const* atoms)
+{
+  for(; atoms; atoms = atoms->next_)
+  {
+    unsigned char const* edts = (unsigned char const*)atoms->atom_;
+    unsigned char const* first;
+    unsigned char const* last;
+
+    if(read_32(edts + 4) != FOURCC('e', 'd', 't', 's'))
+    {
+      continue;
+    }
+
+    first = edts + ATOM_PREAMBLE_SIZE;
+    last = edts + read_32(edts);
+    while(first + ATOM_PREAMBLE_SIZE + 8 <= last)
+    {
+      uint32_t size = read_32(first);
+      if(size < ATOM_PREAMBLE_SIZE || size > (uint32_t)(last - first))
+      {
+        break;
+      }
+      if(read_32(first + 4) == FOURCC('e', 'l', 's', 't'))
+      {
+        unsigned char const* elst_last = first + size;
+        unsigned int version = read_8(first + ATOM_PREAMBLE_SIZE);
+        unsigned int entry_size = version == 0 ? 12 : 20;
+        uint32_t entries = read_32(first + ATOM_PREAMBLE_SIZE + 4);
+        unsigned char const* entry = first + ATOM_PREAMBLE_SIZE + 8;
+        for(; entries && entry + entry_size <= elst_last;
+            --entries, entry += entry_size)
+        {
+          int64_t media_time = version == 0
+            ? (int64_t)(int32_t)read_32(entry + 4)
+            : (int64_t)read_64(entry + 8);
+          if(media_time >= 0)
+          {
+            return (uint64_t)media_time;
+          }
+        }
+        return 0;
+      }
+      first += size;
+    }
+  }
+
+  return 0;
+}
+
+// an edts with a single entry (version 1) elst
+#define EDTS_MAX_SIZE (ATOM_PREAMBLE_SIZE + ATOM_PREAMBLE_SIZE + 8 + 20)
+
+// The edit list that starts the presentation at exactly options->start. The
+// samples from the preceding keyframe are decoded, but not presented. Returns
+// the media time of the edit and updates the duration (of the media) to the
+// duration of the presentation.
+static uint64_t trak_precise_edit(struct trak_t* trak,
+                                  unsigned int start_sample,
+                                  struct mp4_split_options_t const* options,
+                                  long moov_time_scale,
+                                  uint64_t* duration)
+{
+  long trak_time_scale = trak->mdia_->mdhd_->timescale_;
+  uint64_t start = (uint64_t)(options->start * (double)moov_time_scale + 0.5);
+  uint64_t start_time =
+    moov_time_to_trak_time(start, moov_time_scale, trak_time_scale);
+  uint64_t skip = 0;
+  // keep the offset of the input's edit list (composition delay, priming)
+  uint64_t media_time = unknown_atoms_edit_media_time(trak->unknown_atoms_);
+  struct elst_t* elst;
+
+  if(start_time > trak->samples_[start_sample].pts_)
+  {
+    skip = start_time - trak->samples_[start_sample].pts_;
+  }
+  media_time += skip;
+
+  *duration = *duration > skip ? *duration - skip : 0;
+  if(options->end > 0)
+  {
+    uint64_t end = (uint64_t)(options->end * (double)moov_time_scale + 0.5);
+    uint64_t end_time =
+      moov_time_to_trak_time(end, moov_time_scale, trak_time_scale);
+    if(end_time > start_time && *duration > end_time - start_time)
+    {
+      *duration = end_time - start_time;
+    }
+  }
+
+  // replace any edit list of the input
+  unknown_atoms_remove(&trak->unknown_atoms_, FOURCC('e', 'd', 't', 's'));
+  if(trak->edts_)
+  {
+    edts_exit(trak->edts_);
+  }
+
+  elst = elst_init();
+  elst->entries_ = 1;
+  elst->table_ = (elst_table_t*)malloc(sizeof(elst_table_t));
+  elst->table_[0].segment_duration_ = 0;
+  elst->table_[0].media_time_ = (int64_t)media_time;
+  elst->table_[0].media_rate_integer_ = 1;
+  elst->table_[0].media_rate_fraction_ = 0;
+  if(media_time > UINT32_MAX)
+  {
+    elst->version_ = 1;
+  }
+  trak->edts_ = edts_init();
+  trak->edts_->elst_ = elst;
+
+  return media_time;
+}
+
+static int trak_is_selected(struct trak_t const* trak,
+                            struct mp4_split_options_t const* options)
+{
+  enum fragment_type_t type = FRAGMENT_TYPE_UNKNOWN;
+  unsigned int i;
+
+  // trick play only has the (keyframes of the) video tracks
+  if(options->trickplay)
+  {
+    if(trak->mdia_->hdlr_->handler_type_ != FOURCC('v', 'i', 'd', 'e'))
+    {
+      return 0;
+    }
+    if(!options->tracks && !options->track_types)
+    {
+      return 1;
+    }
+  }
+
+  for(i = 0; i != options->tracks; ++i)
+  {
+    if(trak->tkhd_->track_id_ == options->track_ids[i])
+    {
+      return 1;
+    }
+  }
+
+  switch(trak->mdia_->hdlr_->handler_type_)
+  {
+  case FOURCC('v', 'i', 'd', 'e'):
+    type = FRAGMENT_TYPE_VIDEO;
+    break;
+  case FOURCC('s', 'o', 'u', 'n'):
+    type = FRAGMENT_TYPE_AUDIO;
+    break;
+  case FOURCC('t', 'e', 'x', 't'):
+  case FOURCC('s', 'b', 't', 'l'):
+  case FOURCC('s', 'u', 'b', 't'):
+    type = FRAGMENT_TYPE_TEXT;
+    break;
+  }
+
+  return type != FRAGMENT_TYPE_UNKNOWN &&
+         (options->track_types & (1 << type));
+}
+
+// Removes the traks that are not selected (and their sample ranges). Returns
+// the number of remaining traks.
+static unsigned int moov_select_tracks(struct mp4_context_t const* mp4_context,
+                                       struct moov_t* moov,
+                                       unsigned int* trak_sample_start,
+                                       unsigned int* trak_sample_end,
+                                       struct mp4_split_options_t const* options)
+{
+  unsigned int tracks = 0;
+  unsigned int i;
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trak_t* trak = moov->traks_[i];
+    if(trak_is_selected(trak, options))
+    {
+      moov->traks_[tracks] = trak;
+      trak_sample_start[tracks] = trak_sample_start[i];
+      trak_sample_end[tracks] = trak_sample_end[i];
+      ++tracks;
+    }
+    else
+    {
+      MP4_INFO("dropping trak %u\n", trak->tkhd_->track_id_);
+      trak_exit(trak);
+    }
+  }
+  moov->tracks_ = tracks;
+
+  return tracks;
+}
+
+// Appends a range of the input file to the samples of the layout, merged
+// with the last range when contiguous
+static void layout_add_range(struct mp4_output_layout_t* layout,
+                             uint64_t offset, uint64_t size)
+{
+  struct mp4_file_range_t* prev = layout->ranges_ ?
+    &layout->range_[layout->ranges_ - 1] : NULL;
+
+  if(prev && prev->offset_ + prev->size_ == offset)
+  {
+    prev->size_ += size;
+  }
+  else
+  {
+    layout->range_[layout->ranges_].offset_ = offset;
+    layout->range_[layout->ranges_].size_ = size;
+    ++layout->ranges_;
+  }
+}
+
+struct chunk_range_t
+{
+  uint64_t pos_;
+  uint64_t size_;
+  struct trak_t* trak_;
+  unsigned int chunk_;          // the stco entry
+  unsigned int sample_;
+  unsigned int end_;
+};
+
+static int chunk_range_cmp(void const* a, void const* b)
+{
+  struct chunk_range_t const* lhs = (struct chunk_range_t const*)a;
+  struct chunk_range_t const* rhs = (struct chunk_range_t const*)b;
+
+  return lhs->pos_ < rhs->pos_ ? -1 : lhs->pos_ > rhs->pos_ ? 1 : 0;
+}
+
+// Compacts the samples of the traks to only their chunks (in the order of the
+// input file). The chunk offsets and the sample positions become relative to
+// the start of the mdat data and the file ranges of the chunks are stored
+// (merged when contiguous) in the layout.
+static int moov_compact_chunks(struct mp4_context_t const* mp4_context,
+                               struct moov_t* moov,
+                               unsigned int const* trak_sample_start,
+                               unsigned int const* trak_sample_end,
+                               struct mp4_output_layout_t* layout)
+{
+  struct chunk_range_t* chunks;
+  unsigned int entries = 0;
+  unsigned int i;
+  uint64_t pos = 0;
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    entries += moov->traks_[i]->mdia_->minf_->stbl_->stco_->entries_;
+  }
+  chunks = (struct chunk_range_t*)
+    malloc((entries ? entries : 1) * sizeof(struct chunk_range_t));
+  layout->range_ = (struct mp4_file_range_t*)
+    malloc((entries ? entries : 1) * sizeof(struct mp4_file_range_t));
+
+  entries = 0;
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trak_t* trak = moov->traks_[i];
+    struct stco_t const* stco = trak->mdia_->minf_->stbl_->stco_;
+    unsigned int sample = trak_sample_start[i];
+    unsigned int end = trak_sample_end[i];
+    unsigned int chunk = 0;
+    unsigned int stco_entry = 0;
+
+    while(chunk != trak->chunks_size_ &&
+          trak->chunks_[chunk].sample_ + trak->chunks_[chunk].size_ <= sample)
+    {
+      ++chunk;
+    }
+
+    for(; sample != end && chunk != trak->chunks_size_; ++chunk)
+    {
+      struct chunk_range_t* range = &chunks[entries];
+      unsigned int last =
+        trak->chunks_[chunk].sample_ + trak->chunks_[chunk].size_;
+      if(last > end)
+      {
+        last = end;
+      }
+
+      range->trak_ = trak;
+      range->chunk_ = stco_entry;
+      range->sample_ = sample;
+      range->end_ = last;
+      if(last == sample)
+      {
+        range->pos_ = trak->chunks_[chunk].pos_;
+        range->size_ = 0;
+      }
+      else
+      {
+        range->pos_ = trak->samples_[sample].pos_;
+        range->size_ = trak->samples_[last - 1].pos_ +
+                       trak->samples_[last - 1].size_ - range->pos_;
+      }
+      ++entries;
+      ++stco_entry;
+      sample = last;
+    }
+
+    if(stco_entry != stco->entries_)
+    {
+      MP4_ERROR("trak %u: %u chunks, stco has %u entries\n",
+                trak->tkhd_->track_id_, stco_entry, stco->entries_);
+      free(chunks);
+      return 0;
+    }
+  }
+
+  qsort(chunks, entries, sizeof(struct chunk_range_t), chunk_range_cmp);
+
+  layout->ranges_ = 0;
+  for(i = 0; i != entries; ++i)
+  {
+    struct chunk_range_t const* range = &chunks[i];
+    struct trak_t* trak = range->trak_;
+    unsigned int sample;
+
+    trak->mdia_->minf_->stbl_->stco_->chunk_offsets_[range->chunk_] = pos;
+    for(sample = range->sample_; sample != range->end_; ++sample)
+    {
+      trak->samples_[sample].pos_ = pos +
+        (trak->samples_[sample].pos_ - range->pos_);
+    }
+
+    if(range->size_)
+    {
+      layout_add_range(layout, range->pos_, range->size_);
+    }
+    pos += range->size_;
+  }
+  layout->data_size_ = pos;
+
+  MP4_INFO("compacted %u chunks to %u ranges (%llu bytes)\n",
+           entries, layout->ranges_, pos);
+
+  free(chunks);
+
+  return 1;
+}
+
+// The maximum duration (in seconds) of a chunk when reinterleaving
+#define INTERLEAVE_CHUNK_DURATION 0.5
+
+// Plans a new chunk layout for the samples of the traks, with chunks of at most
+// INTERLEAVE_CHUNK_DURATION ordered by decode time across the traks. The stco
+// and stsc are rebuilt for the new chunks, the sample positions become
+// relative to the start of the mdat data and the samples are stored as
+// (merged) file ranges in the layout. Returns the growth of the moov.
+static uint64_t moov_interleave_chunks(struct mp4_context_t const* mp4_context,
+                                       struct moov_t* moov,
+                                       unsigned int const* trak_sample_start,
+                                       unsigned int const* trak_sample_end,
+                                       struct mp4_output_layout_t* layout)
+{
+  unsigned int sample[MAX_TRACKS];
+  unsigned int source_chunk[MAX_TRACKS];
+  unsigned int samples = 0;
+  unsigned int chunks = 0;
+  uint64_t growth = 0;
+  uint64_t pos = 0;
+  unsigned int i;
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trak_t const* trak = moov->traks_[i];
+    struct stbl_t* stbl = trak->mdia_->minf_->stbl_;
+    unsigned int trak_samples = trak_sample_end[i] - trak_sample_start[i];
+
+    // at most a chunk per sample
+    growth += (uint64_t)trak_samples * 16;
+    stbl->stco_->chunk_offsets_ = (uint64_t*)realloc(
+      stbl->stco_->chunk_offsets_, (trak_samples + 1) * sizeof(uint64_t));
+    stbl->stco_->entries_ = 0;
+    stbl->stsc_->table_ = (stsc_table_t*)realloc(
+      stbl->stsc_->table_, (trak_samples + 1) * sizeof(stsc_table_t));
+    stbl->stsc_->entries_ = 0;
+
+    sample[i] = trak_sample_start[i];
+    source_chunk[i] = 0;
+    samples += trak_samples;
+  }
+  layout->range_ = (struct mp4_file_range_t*)
+    malloc((samples ? samples : 1) * sizeof(struct mp4_file_range_t));
+  layout->ranges_ = 0;
+
+  for(;;)
+  {
+    struct trak_t* trak = NULL;
+    struct stco_t* stco;
+    struct stsc_t* stsc;
+    unsigned int track = 0;
+    unsigned int end;
+    unsigned int count = 0;
+    uint64_t chunk_end_time;
+    uint64_t chunk_pos = pos;
+    double dts = 0.0;
+    int id = 0;
+
+    // the trak with the earliest next sample
+    for(i = 0; i != moov->tracks_; ++i)
+    {
+      struct trak_t* t = moov->traks_[i];
+      if(sample[i] != trak_sample_end[i])
+      {
+        double t_dts = (double)t->samples_[sample[i]].pts_ /
+                       t->mdia_->mdhd_->timescale_;
+        if(trak == NULL || t_dts < dts)
+        {
+          trak = t;
+          track = i;
+          dts = t_dts;
+        }
+      }
+    }
+    if(trak == NULL)
+    {
+      break;
+    }
+
+    stco = trak->mdia_->minf_->stbl_->stco_;
+    stsc = trak->mdia_->minf_->stbl_->stsc_;
+    end = trak_sample_end[track];
+    chunk_end_time = trak->samples_[sample[track]].pts_ +
+      (uint64_t)(INTERLEAVE_CHUNK_DURATION * trak->mdia_->mdhd_->timescale_);
+
+    // the samples of the chunk (with the same sample description)
+    while(sample[track] != end)
+    {
+      struct samples_t* s = &trak->samples_[sample[track]];
+      unsigned int c = source_chunk[track];
+
+      while(c + 1 < trak->chunks_size_ &&
+            trak->chunks_[c].sample_ + trak->chunks_[c].size_ <= sample[track])
+      {
+        ++c;
+      }
+      source_chunk[track] = c;
+
+      if(count == 0)
+      {
+        id = trak->chunks_[c].id_;
+      }
+      else if(s->pts_ >= chunk_end_time || trak->chunks_[c].id_ != id)
+      {
+        break;
+      }
+
+      layout_add_range(layout, s->pos_, s->size_);
+      s->pos_ = pos;
+      pos += s->size_;
+      ++sample[track];
+      ++count;
+    }
+
+    if(stsc->entries_ == 0 ||
+       stsc->table_[stsc->entries_ - 1].samples_ != count ||
+       (int)stsc->table_[stsc->entries_ - 1].id_ != id)
+    {
+      stsc->table_[stsc->entries_].chunk_ = stco->entries_;
+      stsc->table_[stsc->entries_].samples_ = count;
+      stsc->table_[stsc->entries_].id_ = id;
+      ++stsc->entries_;
+    }
+    stco->chunk_offsets_[stco->entries_] = chunk_pos;
+    ++stco->entries_;
+    ++chunks;
+  }
+  layout->data_size_ = pos;
+
+  MP4_INFO("interleaved %u samples in %u chunks, %u ranges (%llu bytes)\n",
+           samples, chunks, layout->ranges_, pos);
+
+  return growth;
+}
+
+extern struct mp4_output_layout_t*
+mp4_output_layout_init(struct mp4_context_t* mp4_context,
+                       unsigned int const* trak_sample_start,
+                       unsigned int const* trak_sample_end,
+                       struct mp4_split_options_t* options)
 {
   unsigned int i;
 
@@ -416,7 +981,8 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
   int64_t offset;
 
   struct moov_t* moov = mp4_context->moov;
-  unsigned char* moov_data = mp4_context->moov_data;
+  struct mp4_output_layout_t* layout;
+  unsigned char* moov_data;
 
   uint64_t moov_size;
 
@@ -425,9 +991,37 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
   uint64_t end_offset = 0;
 
   uint64_t moov_duration = 0;
+  uint64_t new_mdat_start = 0;
+
+  // cut at exactly start and end with an edit list
+  int precise = options->precise && (options->start > 0 || options->end > 0);
+
+  // only keep the selected tracks, compacted to their chunks (or to new,
+  // interleaved chunks). Trick play keeps the chunks of the keyframes.
+  int select_tracks =
+    options->tracks || options->track_types || options->trickplay;
+  int compact = select_tracks || options->interleave;
+  unsigned int sample_start[MAX_TRACKS];
+  unsigned int sample_end[MAX_TRACKS];
+
+  // a precise cut adds an edit list to every track that didn't have one
+  uint64_t edts_growth = precise ? moov->tracks_ * EDTS_MAX_SIZE : 0;
+
+  layout = (struct mp4_output_layout_t*)
+    malloc(sizeof(struct mp4_output_layout_t));
+  layout->header_size_ = 0;
+  layout->ranges_ = 0;
+  layout->range_ = NULL;
+  layout->data_size_ = 0;
+
+  // apart from the edit lists, the new moov is never larger than the
+  // original one, so the header fits the ftyp, the free atom, the original
+  // moov, the edit lists and a (large) mdat header
+  layout->header_ = (unsigned char*)malloc((size_t)(
+    mp4_context->ftyp_atom.size_ + 64 + mp4_context->moov_data_size +
+    edts_growth + 16));
 
 #if 1
-  uint64_t new_mdat_start = 0;
   {
     static char const free_data[] = {
       0x0, 0x0, 0x0,  42, 'f', 'r', 'e', 'e',
@@ -439,7 +1033,7 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
     };
     uint32_t size_of_header = (uint32_t)mp4_context->ftyp_atom.size_ +
                               sizeof(free_data);
-    unsigned char* buffer = (unsigned char*)malloc(size_of_header);
+    unsigned char* buffer = layout->header_;
 
     if(mp4_context->ftyp_atom.size_)
     {
@@ -447,8 +1041,8 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
       if(fread(buffer, (off_t)mp4_context->ftyp_atom.size_, 1, mp4_context->infile) != 1)
       {
         MP4_ERROR("%s", "Error reading ftyp atom\n");
-        free(buffer);
-        return 0;
+        mp4_output_layout_exit(layout);
+        return NULL;
       }
     }
 
@@ -458,10 +1052,8 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
 
     if(options->output_format == OUTPUT_FORMAT_MP4)
     {
-      struct bucket_t* bucket = bucket_init_memory(buffer, size_of_header);
-      bucket_insert_tail(buckets, bucket);
+      layout->header_size_ = size_of_header;
     }
-    free(buffer);
 
     new_mdat_start += size_of_header;
   }
@@ -469,6 +1061,19 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
   new_mdat_start += mp4_context->moov_atom.size_;
 #endif
 
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    sample_start[i] = trak_sample_start[i];
+    sample_end[i] = trak_sample_end[i];
+  }
+  if(select_tracks &&
+     !moov_select_tracks(mp4_context, moov, sample_start, sample_end, options))
+  {
+    MP4_ERROR("%s", "No tracks selected\n");
+    mp4_output_layout_exit(layout);
+    return NULL;
+  }
+
   offset = new_mdat_start - mp4_context->mdat_atom.start_;
   // subtract old moov size
   offset -= mp4_context->moov_atom.size_;
@@ -478,15 +1083,15 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
     struct trak_t* trak = moov->traks_[i];
     struct stbl_t* stbl = trak->mdia_->minf_->stbl_;
 
-    unsigned int start_sample = trak_sample_start[i];
-    unsigned int end_sample = trak_sample_end[i];
+    unsigned int start_sample = sample_start[i];
+    unsigned int end_sample = sample_end[i];
 
     trak_update_index(mp4_context, trak, start_sample, end_sample);
 
     if(trak->samples_size_ == 0)
     {
       MP4_WARNING("Trak %u contains no samples. Maybe a fragmented file?", i);
-      return 1;
+      return layout;
     }
 
     {
@@ -512,10 +1117,29 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
       uint64_t trak_duration = stts_get_duration(stbl->stts_);
       long trak_time_scale = trak->mdia_->mdhd_->timescale_;
       {
-        uint64_t duration = trak_time_to_moov_time(trak_duration,
+        uint64_t duration;
+
+        if(precise)
+        {
+          // skip the samples before the start and after the end
+          uint64_t media_time = trak_precise_edit(trak, start_sample,
+                                                  options, moov_time_scale,
+                                                  &trak_duration);
+          MP4_INFO("trak: edit media_time=%llu\n", media_time);
+        }
+
+        duration = trak_time_to_moov_time(trak_duration,
           moov_time_scale, trak_time_scale);
-        trak->mdia_->mdhd_->duration_= trak_duration;
+        trak->mdia_->mdhd_->duration_= stts_get_duration(stbl->stts_);
         trak->tkhd_->duration_ = duration;
+        if(trak->edts_)
+        {
+          trak->edts_->elst_->table_[0].segment_duration_ = duration;
+          if(duration > UINT32_MAX)
+          {
+            trak->edts_->elst_->version_ = 1;
+          }
+        }
         MP4_INFO("trak: new_duration=%llu\n", duration);
 
         if(duration > moov_duration)
@@ -534,30 +1158,63 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
   // subtract bytes we skip at the front of the mdat atom
   offset -= skip_from_start;
 
+  if(compact && !options->adaptive)
+  {
+    if(options->interleave)
+    {
+      // the new chunk tables may be larger than the original ones
+      uint64_t growth = moov_interleave_chunks(mp4_context, moov,
+                                               sample_start, sample_end,
+                                               layout);
+      layout->header_ = (unsigned char*)realloc(layout->header_, (size_t)(
+        layout->header_size_ + mp4_context->moov_data_size + edts_growth +
+        growth + 16));
+    }
+    else
+    if(!moov_compact_chunks(mp4_context, moov, sample_start, sample_end,
+                            layout))
+    {
+      mp4_output_layout_exit(layout);
+      return NULL;
+    }
+  }
+
   MP4_INFO("%s", "moov: writing header\n");
 
+  moov_data = layout->header_ + layout->header_size_;
   moov_write(moov, moov_data);
   moov_size = read_32(moov_data);
 
-  // add new moov size
-  offset += moov_size;
+  if(compact)
+  {
+    // the chunk offsets are relative to the start of the mdat data
+    offset = layout->header_size_ +
+      (layout->data_size_ + ATOM_PREAMBLE_SIZE > UINT32_MAX ? 16 : 8);
+  }
 
-  MP4_INFO("shifting offsets by %llu\n", offset);
-  moov_shift_offsets_inplace(moov, offset);
+  if(options->compress_moov)
+  {
+    moov_size = compress_moov(mp4_context, moov, moov_data, moov_size,
+                              offset, options->moov_cache);
+    offset += moov_size;
+  }
+  else
+  {
+    // add new moov size
+    offset += moov_size;
+
+    MP4_INFO("shifting offsets by %llu\n", offset);
+    moov_shift_offsets_inplace(moov, offset);
+  }
 
   // traffic shaping: create offsets for each second
   create_traffic_shaping(moov,
-                         trak_sample_start,
-                         trak_sample_end,
+                         sample_start,
+                         sample_end,
                          offset,
                          options);
 
-#ifdef COMPRESS_MOOV_ATOM
-  if(!options->client_is_flash)
-  {
-    compress_moov(mp4_context, moov, moov_data, &moov_size);
-  }
-#endif
+  layout->header_size_ += moov_size;
 
   mdat_start += skip_from_start;
   if(end_offset != 0)
@@ -566,10 +1223,9 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
   }
   mdat_size -= skip_from_start;
 
-  bucket_insert_tail(buckets, bucket_init_memory(moov_data, moov_size));
-
   {
     struct mp4_atom_t mdat_atom;
+    int mdat_header_size;
     mdat_atom.type_ = FOURCC('m', 'd', 'a', 't');
     mdat_atom.short_size_ = 0; // TODO: use original small/wide mdat box
 
@@ -578,28 +1234,411 @@ extern int output_mp4(struct mp4_context_t* mp4_context,
       // empty mdat atom
       mdat_atom.size_ = ATOM_PREAMBLE_SIZE;
     }
+    else if(compact)
+    {
+      mdat_atom.size_ = ATOM_PREAMBLE_SIZE + layout->data_size_;
+      if(mdat_atom.size_ > UINT32_MAX)
+      {
+        mdat_atom.short_size_ = 1;
+        mdat_atom.size_ += 8;
+      }
+    }
     else
     {
       mdat_atom.size_ = mdat_size;
     }
 
+    mdat_header_size = mp4_atom_write_header(
+      layout->header_ + layout->header_size_, &mdat_atom);
+    layout->header_size_ += mdat_header_size;
+
+    if(!compact || options->adaptive)
     {
-      unsigned char buffer[32];
-      int mdat_header_size = mp4_atom_write_header(buffer, &mdat_atom);
-      bucket_insert_tail(buckets,
-        bucket_init_memory(buffer, mdat_header_size));
+      layout->data_size_ = mdat_atom.size_ - mdat_header_size;
+      if(layout->data_size_)
+      {
+        layout->range_ = (struct mp4_file_range_t*)
+          malloc(sizeof(struct mp4_file_range_t));
+        layout->range_[0].offset_ = mdat_start + mdat_header_size;
+        layout->range_[0].size_ = layout->data_size_;
+        layout->ranges_ = 1;
+      }
+    }
+  }
+
+  return layout;
+}
+
+extern void mp4_output_layout_exit(struct mp4_output_layout_t* layout)
+{
+  free(layout->header_);
+  free(layout->range_);
+  free(layout);
+}
+
+extern uint64_t mp4_output_size(struct mp4_output_layout_t const* layout)
+{
+  return layout->header_size_ + layout->data_size_;
+}
+
+extern unsigned int mp4_output_range(struct mp4_output_layout_t const* layout,
+                                     uint64_t offset, uint64_t size,
+                                     struct bucket_iovec_t** iov)
+{
+  unsigned int segments = 0;
+  uint64_t total = mp4_output_size(layout);
+  uint64_t range_start = layout->header_size_;
+  unsigned int i;
+
+  *iov = NULL;
+  if(offset >= total || size == 0)
+  {
+    return 0;
+  }
+  if(size > total - offset)
+  {
+    size = total - offset;
+  }
+
+  *iov = (struct bucket_iovec_t*)
+    malloc((layout->ranges_ + 1) * sizeof(struct bucket_iovec_t));
+  if(*iov == NULL)
+  {
+    return 0;
+  }
+
+  // the part of the range in the header
+  if(offset < layout->header_size_)
+  {
+    uint64_t len = layout->header_size_ - offset;
+    if(len > size)
+    {
+      len = size;
+    }
+    (*iov)[segments].type_ = BUCKET_TYPE_MEMORY;
+    (*iov)[segments].base_ = layout->header_ + offset;
+    (*iov)[segments].offset_ = 0;
+    (*iov)[segments].size_ = len;
+    ++segments;
+
+    offset += len;
+    size -= len;
+  }
+
+  // the parts of the range in the samples
+  for(i = 0; i != layout->ranges_ && size; ++i)
+  {
+    struct mp4_file_range_t const* range = &layout->range_[i];
+    uint64_t range_end = range_start + range->size_;
+
+    if(offset < range_end)
+    {
+      uint64_t len = range_end - offset;
+      if(len > size)
+      {
+        len = size;
+      }
+      (*iov)[segments].type_ = BUCKET_TYPE_FILE;
+      (*iov)[segments].base_ = NULL;
+      (*iov)[segments].offset_ = range->offset_ + (offset - range_start);
+      (*iov)[segments].size_ = len;
+      ++segments;
+
+      offset += len;
+      size -= len;
+    }
+    range_start = range_end;
+  }
+
+  return segments;
+}
+
+extern int output_mp4(struct mp4_context_t* mp4_context,
+                      unsigned int const* trak_sample_start,
+                      unsigned int const* trak_sample_end,
+                      struct bucket_t** buckets,
+                      struct mp4_split_options_t* options)
+{
+  struct mp4_output_layout_t* layout;
+  unsigned int i;
+
+  layout = mp4_output_layout_init(mp4_context, trak_sample_start,
+                                  trak_sample_end, options);
+  if(layout == NULL)
+  {
+    return 0;
+  }
+
+  // the header is handed over to the bucket
+  if(layout->header_size_)
+  {
+    bucket_insert_tail(buckets,
+      bucket_init_owned(layout->header_, layout->header_size_));
+    layout->header_ = NULL;
+  }
+  for(i = 0; i != layout->ranges_; ++i)
+  {
+    bucket_insert_tail(buckets,
+      bucket_init_file(layout->range_[i].offset_, layout->range_[i].size_));
+  }
+  mp4_output_layout_exit(layout);
+
+  return 1;
+}
 
-      if(mdat_atom.size_ - mdat_header_size)
+// Fast start: the media data after the new moov starts at the same offset
+// modulo the alignment as in the input (padded with a free atom), so that a
+// file system with shared extents (reflinks) can clone the media data instead
+// of copying it.
+#define FASTSTART_ALIGNMENT 4096
+
+struct faststart_shift_t
+{
+  uint64_t moov_start;          // the old moov
+  uint64_t moov_size;
+  uint64_t delta;               // the move of the media data before the moov
+};
+
+static uint64_t faststart_offset(struct faststart_shift_t const* shift,
+                                 uint64_t offset)
+{
+  // the media data after the old moov moves up by the size of the old moov
+  return offset < shift->moov_start ? offset + shift->delta :
+         offset + shift->delta - shift->moov_size;
+}
+
+// Copies the atoms [first, last> to buffer with the chunk offsets moved.
+// The containers of the sample tables are copied recursively, every other
+// atom as is. A 'stco' is promoted to a 'co64' when an offset doesn't fit in
+// 32 bits anymore, which grows the containers. Returns the end of the copy.
+static unsigned char* faststart_copy_atoms(unsigned char const* first,
+                                           unsigned char const* last,
+                                           unsigned char* buffer,
+                                           struct faststart_shift_t const* shift)
+{
+  while(first + ATOM_PREAMBLE_SIZE <= last)
+  {
+    uint64_t size = read_32(first);
+    uint32_t type = read_32(first + 4);
+    unsigned int header_size = ATOM_PREAMBLE_SIZE;
+
+    if(size == 1)
+    {
+      size = read_64(first + 8);
+      header_size += 8;
+    }
+    else if(size == 0)
+    {
+      size = last - first;
+    }
+    if(size < header_size || size > (uint64_t)(last - first))
+    {
+      // a broken atom is copied as is
+      size = last - first;
+      memcpy(buffer, first, (size_t)size);
+      return buffer + size;
+    }
+
+    switch(type)
+    {
+    case FOURCC('m', 'o', 'o', 'v'):
+    case FOURCC('t', 'r', 'a', 'k'):
+    case FOURCC('m', 'd', 'i', 'a'):
+    case FOURCC('m', 'i', 'n', 'f'):
+    case FOURCC('s', 't', 'b', 'l'):
       {
-        bucket_insert_tail(buckets,
-          bucket_init_file(mdat_start + mdat_header_size,
-                           mdat_atom.size_ - mdat_header_size));
+        unsigned char* atom = buffer;
+        buffer = faststart_copy_atoms(first + header_size, first + size,
+                                      write_32(write_32(buffer, 0), type),
+                                      shift);
+        write_32(atom, (uint32_t)(buffer - atom));
+      }
+      break;
+    case FOURCC('s', 't', 'c', 'o'):
+    case FOURCC('c', 'o', '6', '4'):
+      {
+        int is_64 = type == FOURCC('c', 'o', '6', '4');
+        unsigned int offset_size = is_64 ? 8 : 4;
+        unsigned char const* table = first + header_size + 8;
+        unsigned int entries = read_32(first + header_size + 4);
+        unsigned int i;
+
+        if(header_size + 8 + (uint64_t)entries * offset_size > size)
+        {
+          entries = (unsigned int)
+            ((size - header_size - 8) / offset_size);
+        }
+        for(i = 0; !is_64 && i != entries; ++i)
+        {
+          is_64 = faststart_offset(shift, read_32(table + i * 4)) > UINT32_MAX;
+        }
+
+        buffer = write_32(buffer, 8 + 8 + entries * (is_64 ? 8 : 4));
+        buffer = write_32(buffer, is_64 ? FOURCC('c', 'o', '6', '4') :
+                                          FOURCC('s', 't', 'c', 'o'));
+        // version, flags and entries
+        buffer = write_32(buffer, read_32(first + header_size));
+        buffer = write_32(buffer, entries);
+        for(i = 0; i != entries; ++i)
+        {
+          uint64_t offset = offset_size == 8 ? read_64(table + i * 8) :
+                                               read_32(table + i * 4);
+          offset = faststart_offset(shift, offset);
+          buffer = is_64 ? write_64(buffer, offset) :
+                           write_32(buffer, (uint32_t)offset);
+        }
       }
+      break;
+    default:
+      memcpy(buffer, first, (size_t)size);
+      buffer += size;
+      break;
+    }
+
+    first += size;
+  }
+
+  return buffer;
+}
+
+extern int mp4_faststart(struct mp4_context_t* mp4_context,
+                         struct bucket_t** buckets)
+{
+  uint64_t moov_start = mp4_context->moov_atom.start_;
+  uint64_t moov_end = mp4_context->moov_atom.end_;
+  uint64_t data_start = 0;
+  uint64_t filesize;
+  struct faststart_shift_t shift;
+  unsigned char* moov_data;
+  uint64_t moov_size = 0;
+
+  _fseeki64(mp4_context->infile, 0, SEEK_END);
+  filesize = _ftelli64(mp4_context->infile);
+
+  if(moov_start < mp4_context->mdat_atom.start_)
+  {
+    MP4_INFO("%s", "The moov already precedes the media data\n");
+    bucket_insert_tail(buckets, bucket_init_file(0, filesize));
+    return 1;
+  }
+
+  // the ftyp stays in front
+  if(mp4_context->ftyp_atom.size_ && mp4_context->ftyp_atom.end_ <= moov_start)
+  {
+    data_start = mp4_context->ftyp_atom.end_;
+  }
+
+  shift.moov_start = moov_start;
+  shift.moov_size = moov_end - moov_start;
+
+  // every chunk offset at most doubles in size with a 'co64', plus room for
+  // the free atom that aligns the media data. A compressed moov is written
+  // uncompressed.
+  moov_data = (unsigned char*)malloc((size_t)
+    (2 * mp4_context->moov_data_size + FASTSTART_ALIGNMENT +
+     ATOM_PREAMBLE_SIZE));
+
+  // the size of the new moov decides the move of the media data, which can
+  // promote chunk offsets to 64 bits, which grows the moov. The move only
+  // grows, so this settles.
+  shift.delta = 0;
+  for(;;)
+  {
+    uint64_t delta;
+    moov_size = faststart_copy_atoms(mp4_context->moov_data,
+                                     mp4_context->moov_data +
+                                     mp4_context->moov_data_size,
+                                     moov_data, &shift) - moov_data;
+    delta = (moov_size + ATOM_PREAMBLE_SIZE + FASTSTART_ALIGNMENT - 1) &
+            ~(uint64_t)(FASTSTART_ALIGNMENT - 1);
+    if(delta == shift.delta)
+    {
+      break;
     }
+    shift.delta = delta;
+  }
+
+  MP4_INFO("fast start: moov of %llu bytes, media data moves %llu bytes\n",
+           moov_size, shift.delta);
+
+  // the free atom that pads the moov
+  {
+    unsigned char* free_atom = moov_data + moov_size;
+    uint64_t free_size = shift.delta - moov_size;
+    memset(free_atom, 0, (size_t)free_size);
+    write_32(free_atom, (uint32_t)free_size);
+    write_32(free_atom + 4, FOURCC('f', 'r', 'e', 'e'));
+  }
+
+  if(data_start)
+  {
+    bucket_insert_tail(buckets, bucket_init_file(0, data_start));
+  }
+  bucket_insert_tail(buckets, bucket_init_owned(moov_data, shift.delta));
+  bucket_insert_tail(buckets,
+    bucket_init_file(data_start, moov_start - data_start));
+  if(moov_end < filesize)
+  {
+    bucket_insert_tail(buckets,
+      bucket_init_file(moov_end, filesize - moov_end));
   }
 
   return 1;
 }
 
-// End Of File
+extern int mp4_faststart_inplace(struct mp4_context_t* mp4_context,
+                                 uint64_t* offset,
+                                 struct bucket_t** buckets)
+{
+  uint64_t moov_size = mp4_context->moov_data_size;
+  uint64_t pos = 0;
+
+  if(mp4_context->moov_atom.start_ < mp4_context->mdat_atom.start_)
+  {
+    MP4_INFO("%s", "The moov already precedes the media data\n");
+    return 1;
+  }
+
+  // a free atom in front of the media data that holds the moov, exactly or
+  // with room for a free atom for the remainder
+  while(pos < mp4_context->mdat_atom.start_)
+  {
+    struct mp4_atom_t atom;
+
+    _fseeki64(mp4_context->infile, pos, SEEK_SET);
+    if(!mp4_atom_read_header(mp4_context, mp4_context->infile, &atom))
+    {
+      return 0;
+    }
+    if(atom.type_ == FOURCC('m', 'd', 'a', 't'))
+    {
+      break;
+    }
+    if((atom.type_ == FOURCC('f', 'r', 'e', 'e') ||
+        atom.type_ == FOURCC('s', 'k', 'i', 'p')) &&
+       (atom.size_ == moov_size ||
+        atom.size_ >= moov_size + ATOM_PREAMBLE_SIZE))
+    {
+      *offset = atom.start_;
+      bucket_insert_tail(buckets,
+        bucket_init_memory(mp4_context->moov_data, moov_size));
+      if(atom.size_ != moov_size)
+      {
+        unsigned char free_atom[ATOM_PREAMBLE_SIZE];
+        write_32(free_atom, (uint32_t)(atom.size_ - moov_size));
+        write_32(free_atom + 4, FOURCC('f', 'r', 'e', 'e'));
+        bucket_insert_tail(buckets,
+          bucket_init_memory(free_atom, ATOM_PREAMBLE_SIZE));
+      }
+      MP4_INFO("fast start: moov into the free atom at %llu\n", atom.start_);
+      return 1;
+    }
+    pos = atom.end_;
+  }
+
+  MP4_ERROR("%s", "No free atom in front of the media data holds the moov\n");
 
+  return 0;
+}
+
+// End Of File
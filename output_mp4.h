@@ -30,8 +30,54 @@ extern "C" {
 
 struct mp4_context_t;
 struct bucket_t;
+struct bucket_iovec_t;
 struct mp4_split_options_t;
 
+// The layout of an MP4 output file: a header (the ftyp, the new moov and the
+// mdat header) followed by the samples, as ranges of the input file. There is
+// a single range, unless the samples are compacted to a selection of the
+// tracks. The layout is all that's needed to answer any byte range of the
+// output.
+struct mp4_file_range_t
+{
+  uint64_t offset_;
+  uint64_t size_;
+};
+
+struct mp4_output_layout_t
+{
+  unsigned char* header_;
+  uint64_t header_size_;
+  unsigned int ranges_;
+  struct mp4_file_range_t* range_;
+  uint64_t data_size_;          // the total size of the ranges
+};
+
+// Returns NULL on failure
+MOD_STREAMING_DLL_LOCAL extern
+struct mp4_output_layout_t*
+mp4_output_layout_init(struct mp4_context_t* mp4_context,
+                       unsigned int const* trak_sample_start,
+                       unsigned int const* trak_sample_end,
+                       struct mp4_split_options_t* options);
+
+MOD_STREAMING_DLL_LOCAL extern
+void mp4_output_layout_exit(struct mp4_output_layout_t* layout);
+
+// The size of the complete output file
+MOD_STREAMING_DLL_LOCAL extern
+uint64_t mp4_output_size(struct mp4_output_layout_t const* layout);
+
+// Maps the byte range [offset, offset + size> of the output (clipped to the
+// output size) to the minimal set of segments, the header memory and the file
+// ranges of the samples. Returns the number of segments in *iov (allocated
+// with malloc, NULL when there are none). The memory segment points into the
+// layout, which has to outlive it.
+MOD_STREAMING_DLL_LOCAL extern
+unsigned int mp4_output_range(struct mp4_output_layout_t const* layout,
+                              uint64_t offset, uint64_t size,
+                              struct bucket_iovec_t** iov);
+
 MOD_STREAMING_DLL_LOCAL extern
 int output_mp4(struct mp4_context_t* mp4_context,
                unsigned int const* trak_sample_start,
@@ -39,6 +85,25 @@ int output_mp4(struct mp4_context_t* mp4_context,
                struct bucket_t** buckets,
                struct mp4_split_options_t* options);
 
+// Fast start: the moov is moved in front of the media data. The media data
+// is referenced as ranges of the input file and moves by a multiple of 4KB
+// (see FASTSTART_ALIGNMENT); the chunk offsets are moved along and promoted to
+// 64 bits when needed. A file that already starts with its moov is referenced
+// as a whole.
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_faststart(struct mp4_context_t* mp4_context,
+                  struct bucket_t** buckets);
+
+// Fast start in place: the moov is written into a free atom in front of the
+// media data, so that nothing else moves. Returns the atoms to write at
+// *offset, none when the moov already precedes the media data. Returns 0 when
+// there is no free atom that can hold the moov. The old moov is left to the
+// caller (e.g. to turn into a free atom).
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_faststart_inplace(struct mp4_context_t* mp4_context,
+                          uint64_t* offset,
+                          struct bucket_t** buckets);
+
 #ifdef __cplusplus
 } /* extern C definitions */
 #endif
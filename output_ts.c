@@ -0,0 +1,957 @@
+/*******************************************************************************
+ output_ts.c - A library for writing MPEG2 Transport Streams (HLS).
+
+ Copyright (C) 2009 CodeShop B.V.
+ http://www.code-shop.com
+
+ For licensing see the LICENSE file
+******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef __cplusplus
+#define __STDC_FORMAT_MACROS // C++ should define this for PRIu64
+#endif
+
+#include "output_ts.h"
+#include "mp4_io.h"
+#include "mp4_reader.h"
+#include "moov.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TS_PACKET_SIZE 188
+#define TS_PAYLOAD_SIZE 184
+
+#define TS_PID_PAT 0x0000
+#define TS_PID_PMT 0x1000
+#define TS_PID_VIDEO 0x0100
+#define TS_PID_AUDIO 0x0101
+
+// the maximum size of a PES header (with PTS and DTS)
+#define TS_PES_HEADER_SIZE 19
+
+// the maximum number of AAC frames in a single PES packet
+#define TS_AUDIO_FRAMES_PER_PES 7
+
+// The timestamps are delayed relative to the PCR, so that the PCR never
+// runs ahead of the decoding times (0.7 seconds at 90KHz).
+#define TS_DELAY 63000
+
+struct ts_stream_t
+{
+  struct trak_t const* trak_;
+  struct sample_entry_t const* sample_entry_;
+  unsigned int pid_;
+  unsigned int stream_type_;    // 0x1b = H.264, 0x0f = AAC (ADTS)
+  unsigned int stream_id_;      // 0xe0 = video, 0xc0 = audio
+  unsigned int continuity_counter_;
+
+  // the samples of the current segment
+  unsigned int start_;
+  unsigned int end_;
+};
+
+// The segments are aligned to the smooth sync samples of the first stream
+// (the video), the other stream (the audio) follows its boundaries. For trick
+// play there only is the video, reduced to its keyframes, and every keyframe
+// is a segment of its own (an I-frame segment).
+struct ts_segment_t
+{
+  unsigned int streams_;
+  struct ts_stream_t stream_[2];
+  int keyframes_only_;
+};
+
+// The packetizer writes to a buffer that is allocated once for the whole
+// segment, so there is no allocation per 188 byte packet.
+struct ts_writer_t
+{
+  unsigned char* first_;
+  unsigned char* last_;
+  unsigned char* p_;
+
+  // scratch buffers for a single PES packet and a single sample
+  unsigned char* pes_;
+  unsigned char* sample_;
+};
+
+static uint32_t mpeg_crc32(unsigned char const* first,
+                           unsigned char const* last)
+{
+  uint32_t crc = 0xffffffff;
+  while(first != last)
+  {
+    unsigned int bit;
+    crc ^= (uint32_t)(*first++) << 24;
+    for(bit = 0; bit != 8; ++bit)
+    {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+static int ts_segment_init(struct ts_segment_t* segment,
+                           struct moov_t const* moov, int trickplay)
+{
+  struct trak_t const* video = NULL;
+  struct trak_t const* audio = NULL;
+  unsigned int i;
+
+  for(i = 0; i != moov->tracks_; ++i)
+  {
+    struct trak_t const* trak = moov->traks_[i];
+    struct sample_entry_t const* sample_entry =
+      &trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0];
+
+    switch(trak->mdia_->hdlr_->handler_type_)
+    {
+    case FOURCC('v', 'i', 'd', 'e'):
+      // the NAL units are converted to start codes, which needs the size of
+      // their length fields from the 'avcC'
+      if(video == NULL && sample_entry->fourcc_ == FOURCC('a', 'v', 'c', '1') &&
+         (sample_entry->nal_unit_length_ == 1 ||
+          sample_entry->nal_unit_length_ == 2 ||
+          sample_entry->nal_unit_length_ == 4))
+      {
+        video = trak;
+      }
+      break;
+    case FOURCC('s', 'o', 'u', 'n'):
+      if(audio == NULL && !trickplay &&
+         sample_entry->fourcc_ == FOURCC('m', 'p', '4', 'a'))
+      {
+        audio = trak;
+      }
+      break;
+    }
+  }
+
+  segment->streams_ = 0;
+  segment->keyframes_only_ = trickplay;
+  if(video)
+  {
+    struct ts_stream_t* stream = &segment->stream_[segment->streams_++];
+    stream->trak_ = video;
+    stream->pid_ = TS_PID_VIDEO;
+    stream->stream_type_ = 0x1b;
+    stream->stream_id_ = 0xe0;
+  }
+  if(audio)
+  {
+    struct ts_stream_t* stream = &segment->stream_[segment->streams_++];
+    stream->trak_ = audio;
+    stream->pid_ = TS_PID_AUDIO;
+    stream->stream_type_ = 0x0f;
+    stream->stream_id_ = 0xc0;
+  }
+
+  for(i = 0; i != segment->streams_; ++i)
+  {
+    struct ts_stream_t* stream = &segment->stream_[i];
+    stream->sample_entry_ =
+      &stream->trak_->mdia_->minf_->stbl_->stsd_->sample_entries_[0];
+    stream->continuity_counter_ = 0;
+    stream->start_ = 0;
+    stream->end_ = 0;
+  }
+
+  return segment->streams_ != 0;
+}
+
+// Advances to the next segment. Returns 0 when there are no more segments.
+static int ts_segment_next(struct ts_segment_t* segment)
+{
+  struct ts_stream_t* master = &segment->stream_[0];
+  struct trak_t const* trak = master->trak_;
+  unsigned int i;
+
+  if(master->end_ == trak->samples_size_)
+  {
+    return 0;
+  }
+
+  master->start_ = master->end_;
+  while(++master->end_ != trak->samples_size_)
+  {
+    if(segment->keyframes_only_ || trak->samples_[master->end_].is_smooth_ss_)
+      break;
+  }
+
+  for(i = 1; i != segment->streams_; ++i)
+  {
+    struct ts_stream_t* stream = &segment->stream_[i];
+    struct trak_t const* strak = stream->trak_;
+    stream->start_ = stream->end_;
+    if(master->end_ == trak->samples_size_)
+    {
+      stream->end_ = strak->samples_size_;
+    }
+    else
+    {
+      uint64_t pts = trak_time_to_moov_time(trak->samples_[master->end_].pts_,
+        strak->mdia_->mdhd_->timescale_, trak->mdia_->mdhd_->timescale_);
+      while(stream->end_ != strak->samples_size_ &&
+            strak->samples_[stream->end_].pts_ < pts)
+      {
+        ++stream->end_;
+      }
+    }
+  }
+
+  return 1;
+}
+
+static double ts_segment_duration(struct ts_segment_t const* segment)
+{
+  struct ts_stream_t const* master = &segment->stream_[0];
+  struct trak_t const* trak = master->trak_;
+
+  return (double)(trak->samples_[master->end_].pts_ -
+                  trak->samples_[master->start_].pts_) /
+         trak->mdia_->mdhd_->timescale_;
+}
+
+static uint64_t ts_segment_bytes(struct ts_segment_t const* segment)
+{
+  uint64_t bytes = 0;
+  unsigned int i;
+  for(i = 0; i != segment->streams_; ++i)
+  {
+    struct ts_stream_t const* stream = &segment->stream_[i];
+    unsigned int s;
+    for(s = stream->start_; s != stream->end_; ++s)
+    {
+      bytes += stream->trak_->samples_[s].size_;
+    }
+  }
+
+  return bytes;
+}
+
+// The upper bound of the elementary stream size of a sample
+static unsigned int ts_sample_bound(struct ts_stream_t const* stream,
+                                    unsigned int s)
+{
+  struct sample_entry_t const* sample_entry = stream->sample_entry_;
+  unsigned int size = stream->trak_->samples_[s].size_;
+
+  if(stream->stream_type_ == 0x1b)
+  {
+    // the NAL length fields are replaced by 4 byte start codes
+    unsigned int length_size = sample_entry->nal_unit_length_;
+    return 6 + 4 + sample_entry->sps_length_ + 4 + sample_entry->pps_length_ +
+           size + (4 - length_size) * (size / (length_size + 1) + 1);
+  }
+  else
+  {
+    return 7 + size;
+  }
+}
+
+static uint64_t ts_time(struct ts_stream_t const* stream, uint64_t t)
+{
+  return trak_time_to_moov_time(t, 90000,
+                                stream->trak_->mdia_->mdhd_->timescale_);
+}
+
+static unsigned char* ts_write_timestamp(unsigned char* p, unsigned int prefix,
+                                         uint64_t t)
+{
+  *p++ = (unsigned char)((prefix << 4) | ((t >> 29) & 0x0e) | 1);
+  p = write_16(p, (unsigned int)(((t >> 14) & 0xfffe) | 1));
+  p = write_16(p, (unsigned int)(((t << 1) & 0xfffe) | 1));
+
+  return p;
+}
+
+static unsigned char* ts_write_packet_header(unsigned char* p,
+                                             unsigned int pid,
+                                             int payload_unit_start,
+                                             int has_adaptation_field,
+                                             unsigned int continuity_counter)
+{
+  *p++ = 0x47;
+  *p++ = (unsigned char)((payload_unit_start ? 0x40 : 0) | (pid >> 8));
+  *p++ = (unsigned char)(pid & 0xff);
+  *p++ = (unsigned char)((has_adaptation_field ? 0x30 : 0x10) |
+                         continuity_counter);
+
+  return p;
+}
+
+// Writes a PSI section (PAT or PMT) in a single packet
+static void ts_write_section(struct ts_writer_t* writer, unsigned int pid,
+                             unsigned char const* section, unsigned int size,
+                             unsigned int continuity_counter)
+{
+  unsigned char* p = writer->p_;
+  unsigned char* crc_start;
+
+  p = ts_write_packet_header(p, pid, 1, 0, continuity_counter);
+  *p++ = 0;                     // pointer_field
+  crc_start = p;
+  memcpy(p, section, size);
+  p += size;
+  p = write_32(p, mpeg_crc32(crc_start, p));
+  memset(p, 0xff, writer->p_ + TS_PACKET_SIZE - p);
+
+  writer->p_ += TS_PACKET_SIZE;
+}
+
+// Every segment starts with a single PAT and PMT, so their continuity
+// counters follow from the segment number.
+static void ts_write_pat_pmt(struct ts_writer_t* writer,
+                             struct ts_segment_t const* segment,
+                             unsigned int segment_number)
+{
+  unsigned char section[64];
+  unsigned char* p;
+  unsigned int i;
+
+  // program association table with a single program
+  p = section;
+  *p++ = 0x00;                  // table_id
+  p = write_16(p, 0xb000 | 13); // section_syntax_indicator, section_length
+  p = write_16(p, 1);           // transport_stream_id
+  *p++ = 0xc1;                  // version 0, current_next_indicator
+  *p++ = 0;                     // section_number
+  *p++ = 0;                     // last_section_number
+  p = write_16(p, 1);           // program_number
+  p = write_16(p, 0xe000 | TS_PID_PMT);
+  ts_write_section(writer, TS_PID_PAT, section, (unsigned int)(p - section),
+                   segment_number & 15);
+
+  // program map table
+  p = section;
+  *p++ = 0x02;                  // table_id
+  p = write_16(p, 0xb000 | (13 + 5 * segment->streams_));
+  p = write_16(p, 1);           // program_number
+  *p++ = 0xc1;
+  *p++ = 0;
+  *p++ = 0;
+  // the PCR is carried by the first stream
+  p = write_16(p, 0xe000 | segment->stream_[0].pid_);
+  p = write_16(p, 0xf000);      // program_info_length
+  for(i = 0; i != segment->streams_; ++i)
+  {
+    struct ts_stream_t const* stream = &segment->stream_[i];
+    *p++ = (unsigned char)stream->stream_type_;
+    p = write_16(p, 0xe000 | stream->pid_);
+    p = write_16(p, 0xf000);    // ES_info_length
+  }
+  ts_write_section(writer, TS_PID_PMT, section, (unsigned int)(p - section),
+                   segment_number & 15);
+}
+
+// Splits a PES packet over transport packets. The first packet carries the
+// PCR (when given) and the random access indicator, the last packet is padded
+// with stuffing bytes in the adaptation field.
+//
+// The last PES packet of a stream in the segment is spread over more packets
+// (with stuffing) when needed, so that every segment holds a multiple of 16
+// packets of the stream. The continuity counters then start at 0 in every
+// segment and still continue across the segments.
+static void ts_write_pes(struct ts_writer_t* writer,
+                         struct ts_stream_t* stream,
+                         unsigned char const* pes, unsigned int size,
+                         int has_pcr, uint64_t pcr, int random_access,
+                         int is_last)
+{
+  int first = 1;
+  unsigned int first_af_size =
+    has_pcr || random_access ? 2 + (has_pcr ? 6 : 0) : 0;
+  unsigned int packets = 1;
+
+  if(size > TS_PAYLOAD_SIZE - first_af_size)
+  {
+    packets += (size - (TS_PAYLOAD_SIZE - first_af_size) +
+                TS_PAYLOAD_SIZE - 1) / TS_PAYLOAD_SIZE;
+  }
+  if(is_last)
+  {
+    packets += (16 - ((stream->continuity_counter_ + packets) & 15)) & 15;
+    if(packets > size)
+    {
+      packets = size;
+    }
+  }
+
+  while(size)
+  {
+    unsigned char* p = writer->p_;
+    unsigned char* af;
+    // size of the adaptation field (including its length byte)
+    unsigned int af_size = first ? first_af_size : 0;
+    // leave at least a byte for every packet that follows
+    unsigned int limit = size - (packets - 1);
+    unsigned int payload;
+
+    if(limit < TS_PAYLOAD_SIZE - af_size)
+    {
+      af_size = TS_PAYLOAD_SIZE - limit;
+    }
+    payload = TS_PAYLOAD_SIZE - af_size;
+
+    p = ts_write_packet_header(p, stream->pid_, first, af_size != 0,
+                               stream->continuity_counter_);
+    stream->continuity_counter_ = (stream->continuity_counter_ + 1) & 15;
+    if(packets > 1)
+    {
+      --packets;
+    }
+
+    af = p;
+    if(af_size)
+    {
+      *p++ = (unsigned char)(af_size - 1);
+      if(af_size > 1)
+      {
+        unsigned char flags = 0;
+        if(first && random_access)
+        {
+          flags |= 0x40;
+        }
+        if(first && has_pcr)
+        {
+          flags |= 0x10;
+        }
+        *p++ = flags;
+        if(first && has_pcr)
+        {
+          // program_clock_reference_base (33 bits) and extension (0)
+          p = write_32(p, (uint32_t)(pcr >> 1));
+          *p++ = (unsigned char)(((pcr & 1) << 7) | 0x7e);
+          *p++ = 0;
+        }
+        memset(p, 0xff, af + af_size - p);
+        p = af + af_size;
+      }
+    }
+
+    memcpy(p, pes, payload);
+    pes += payload;
+    size -= payload;
+    writer->p_ += TS_PACKET_SIZE;
+    first = 0;
+  }
+}
+
+static int ts_read_sample(struct mp4_context_t const* mp4_context,
+                          samples_t const* sample, unsigned char* buffer)
+{
+  if(_fseeki64(mp4_context->infile, sample->pos_, SEEK_SET) != 0 ||
+     (sample->size_ &&
+      fread(buffer, sample->size_, 1, mp4_context->infile) != 1))
+  {
+    MP4_ERROR("%s", "Error reading sample data\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+// Writes the video sample as a single PES packet. The H.264 access unit is
+// converted to Annex B with an access unit delimiter and the SPS and PPS in
+// front of every keyframe.
+static int ts_write_video(struct mp4_context_t const* mp4_context,
+                          struct ts_writer_t* writer,
+                          struct ts_stream_t* stream, unsigned int s)
+{
+  static const unsigned char aud[6] = { 0, 0, 0, 1, 0x09, 0xf0 };
+  struct sample_entry_t const* sample_entry = stream->sample_entry_;
+  samples_t const* sample = &stream->trak_->samples_[s];
+  unsigned int length_size = sample_entry->nal_unit_length_;
+  uint64_t dts = ts_time(stream, sample->pts_);
+  uint64_t pts = dts + ts_time(stream, sample->cto_);
+  unsigned char* p = writer->pes_;
+  unsigned char const* first = writer->sample_;
+  unsigned char const* last = writer->sample_ + sample->size_;
+
+  if(!ts_read_sample(mp4_context, sample, writer->sample_))
+  {
+    return 0;
+  }
+
+  // PES header, the packet length is unbounded for video
+  p = write_32(p, 0x00000100 | stream->stream_id_);
+  p = write_16(p, 0);
+  *p++ = 0x80;
+  *p++ = 0xc0;                  // PTS and DTS
+  *p++ = 10;
+  p = ts_write_timestamp(p, 3, pts + TS_DELAY);
+  p = ts_write_timestamp(p, 1, dts + TS_DELAY);
+
+  memcpy(p, aud, sizeof(aud));
+  p += sizeof(aud);
+
+  if(sample->is_ss_)
+  {
+    p = write_32(p, 0x00000001);
+    memcpy(p, sample_entry->sps_, sample_entry->sps_length_);
+    p += sample_entry->sps_length_;
+    p = write_32(p, 0x00000001);
+    memcpy(p, sample_entry->pps_, sample_entry->pps_length_);
+    p += sample_entry->pps_length_;
+  }
+
+  while(first + length_size <= last)
+  {
+    unsigned int nal_size = read_n(first, length_size * 8);
+    first += length_size;
+    if(nal_size > (unsigned int)(last - first))
+    {
+      MP4_ERROR("Invalid NAL size (%u)\n", nal_size);
+      return 0;
+    }
+    // skip the access unit delimiters, we already wrote one
+    if(nal_size && (first[0] & 0x1f) != 9)
+    {
+      p = write_32(p, 0x00000001);
+      memcpy(p, first, nal_size);
+      p += nal_size;
+    }
+    first += nal_size;
+  }
+
+  ts_write_pes(writer, stream, writer->pes_,
+               (unsigned int)(p - writer->pes_), 1, dts, sample->is_ss_,
+               s + 1 == stream->end_);
+
+  return 1;
+}
+
+// Writes the audio samples [start, end) as a single PES packet of ADTS frames
+static int ts_write_audio(struct mp4_context_t const* mp4_context,
+                          struct ts_writer_t* writer,
+                          struct ts_stream_t* stream, int has_pcr,
+                          unsigned int start, unsigned int end)
+{
+  samples_t const* first = &stream->trak_->samples_[start];
+  samples_t const* last = &stream->trak_->samples_[end];
+  uint64_t pts = ts_time(stream, first->pts_);
+  unsigned char* p = writer->pes_;
+  unsigned int pes_size;
+
+  p = write_32(p, 0x00000100 | stream->stream_id_);
+  p += 2;                       // PES_packet_length
+  *p++ = 0x80;
+  *p++ = 0x80;                  // PTS only
+  *p++ = 5;
+  p = ts_write_timestamp(p, 2, pts + TS_DELAY);
+
+  for(; first != last; ++first)
+  {
+    p = sample_entry_write_adts(stream->sample_entry_, first->size_, p);
+    if(!ts_read_sample(mp4_context, first, p))
+    {
+      return 0;
+    }
+    p += first->size_;
+  }
+
+  pes_size = (unsigned int)(p - writer->pes_);
+  write_16(writer->pes_ + 4, pes_size - 6 > 0xffff ? 0 : pes_size - 6);
+
+  ts_write_pes(writer, stream, writer->pes_, pes_size, has_pcr, pts, 1,
+               end == stream->end_);
+
+  return 1;
+}
+
+static int ts_write_segment(struct mp4_context_t const* mp4_context,
+                            struct ts_segment_t* segment,
+                            unsigned int segment_number,
+                            struct bucket_t** buckets)
+{
+  struct ts_writer_t writer;
+  struct ts_stream_t* video = NULL;
+  struct ts_stream_t* audio = NULL;
+  size_t packets = 2;
+  unsigned int pes_size = 0;
+  unsigned int sample_size = 0;
+  unsigned int v = 0;
+  unsigned int a = 0;
+  unsigned int i;
+  int result = 1;
+
+  for(i = 0; i != segment->streams_; ++i)
+  {
+    struct ts_stream_t* stream = &segment->stream_[i];
+    unsigned int s;
+
+    if(stream->stream_type_ == 0x1b)
+    {
+      video = stream;
+      v = stream->start_;
+    }
+    else
+    {
+      audio = stream;
+      a = stream->start_;
+    }
+
+    // Compute the upper bound of the number of transport packets, as if
+    // every sample has its own PES packet.
+    for(s = stream->start_; s != stream->end_; ++s)
+    {
+      unsigned int size = TS_PES_HEADER_SIZE + ts_sample_bound(stream, s);
+      unsigned int samples_pes_size = size;
+      if(stream == audio)
+      {
+        samples_pes_size = TS_PES_HEADER_SIZE +
+          TS_AUDIO_FRAMES_PER_PES * ts_sample_bound(stream, s);
+      }
+      packets += (size + 8 + TS_PAYLOAD_SIZE - 1) / TS_PAYLOAD_SIZE + 1;
+      if(samples_pes_size > pes_size)
+      {
+        pes_size = samples_pes_size;
+      }
+      if(stream->trak_->samples_[s].size_ > sample_size)
+      {
+        sample_size = stream->trak_->samples_[s].size_;
+      }
+    }
+    // and the packets that align the stream to 16 packets
+    packets += 15;
+  }
+
+  writer.first_ = (unsigned char*)malloc(packets * TS_PACKET_SIZE);
+  writer.last_ = writer.first_ + packets * TS_PACKET_SIZE;
+  writer.p_ = writer.first_;
+  writer.pes_ = (unsigned char*)malloc(pes_size);
+  writer.sample_ = (unsigned char*)malloc(sample_size);
+
+  ts_write_pat_pmt(&writer, segment, segment_number);
+
+  // Interleave the video and audio by decoding time
+  while(result &&
+        ((video && v != video->end_) || (audio && a != audio->end_)))
+  {
+    uint64_t video_dts = 0;
+    if(video && v != video->end_)
+    {
+      video_dts = ts_time(video, video->trak_->samples_[v].pts_);
+    }
+
+    if(video && v != video->end_ &&
+       (audio == NULL || a == audio->end_ ||
+        video_dts <= ts_time(audio, audio->trak_->samples_[a].pts_)))
+    {
+      result = ts_write_video(mp4_context, &writer, video, v);
+      ++v;
+    }
+    else
+    {
+      // group the audio frames up to the next video frame
+      unsigned int end = a + 1;
+      while(end != audio->end_ && end - a != TS_AUDIO_FRAMES_PER_PES &&
+            (video == NULL || v == video->end_ ||
+             ts_time(audio, audio->trak_->samples_[end].pts_) < video_dts))
+      {
+        ++end;
+      }
+      result = ts_write_audio(mp4_context, &writer, audio, video == NULL,
+                              a, end);
+      a = end;
+    }
+  }
+
+  if(result)
+  {
+    bucket_insert_tail(buckets, bucket_init_owned(writer.first_,
+                       writer.p_ - writer.first_));
+    writer.first_ = NULL;
+  }
+
+  free(writer.sample_);
+  free(writer.pes_);
+  free(writer.first_);
+
+  return result;
+}
+
+extern int output_ts_segment(struct mp4_context_t const* mp4_context,
+                             struct bucket_t** buckets,
+                             struct mp4_split_options_t const* options)
+{
+  struct ts_segment_t segment;
+  int segment_number;
+
+  if(!moov_build_index(mp4_context, mp4_context->moov, options))
+  {
+    return 0;
+  }
+
+  if(!ts_segment_init(&segment, mp4_context->moov, options->trickplay))
+  {
+    MP4_ERROR("%s", "No H.264 or AAC track for a transport stream\n");
+    return 0;
+  }
+
+  for(segment_number = 0; ; ++segment_number)
+  {
+    if(!ts_segment_next(&segment))
+    {
+      MP4_ERROR("No segment %d\n", options->hls_segment);
+      return 0;
+    }
+    if(segment_number == options->hls_segment)
+    {
+      break;
+    }
+  }
+
+  return ts_write_segment(mp4_context, &segment, segment_number, buckets);
+}
+
+// the segment urls are relative to the playlist
+static char const* hls_basename(char const* filename)
+{
+  char const* slash = strrchr(filename, '/');
+  if(slash == NULL)
+  {
+    slash = strrchr(filename, '\\');
+  }
+
+  return slash ? slash + 1 : filename;
+}
+
+static char* m3u8_write_media_playlist(struct mp4_context_t const* mp4_context,
+                                       struct mp4_split_options_t const* options,
+                                       char* p)
+{
+  struct ts_segment_t segment;
+  char const* filename = hls_basename(mp4_context->filename_);
+  double target_duration = 0.0;
+  unsigned int segment_number;
+  // the segments are only the same with the same fragment plan
+  char query[MP4_FRAGMENT_QUERY_SIZE];
+
+  mp4_split_options_fragment_query(options, "&", "&", query, sizeof(query));
+
+  ts_segment_init(&segment, mp4_context->moov, options->trickplay);
+  while(ts_segment_next(&segment))
+  {
+    double duration = ts_segment_duration(&segment);
+    if(duration > target_duration)
+    {
+      target_duration = duration;
+    }
+  }
+
+  p += sprintf(p, "#EXTM3U\n");
+  // the trick play playlist is an I-frame playlist (version 4)
+  p += sprintf(p, "#EXT-X-VERSION:%u\n", options->trickplay ? 4 : 3);
+  p += sprintf(p, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+  p += sprintf(p, "#EXT-X-TARGETDURATION:%u\n",
+               (unsigned int)(target_duration + 0.5));
+  p += sprintf(p, "#EXT-X-MEDIA-SEQUENCE:0\n");
+  if(options->trickplay)
+  {
+    p += sprintf(p, "#EXT-X-I-FRAMES-ONLY\n");
+  }
+
+  ts_segment_init(&segment, mp4_context->moov, options->trickplay);
+  for(segment_number = 0; ts_segment_next(&segment); ++segment_number)
+  {
+    p += sprintf(p, "#EXTINF:%.3f,\n", ts_segment_duration(&segment));
+    p += sprintf(p, "%s?hls_segment=%u%s%s\n", filename, segment_number,
+                 options->trickplay ? "&trickplay=1" : "", query);
+  }
+
+  p += sprintf(p, "#EXT-X-ENDLIST\n");
+
+  return p;
+}
+
+static char* m3u8_write_variant(struct mp4_context_t const* mp4_context,
+                                struct mp4_split_options_t const* options,
+                                char* p)
+{
+  struct ts_segment_t segment;
+  char const* filename = hls_basename(mp4_context->filename_);
+  double peak_bitrate = 0.0;
+  unsigned int i;
+  char query[MP4_FRAGMENT_QUERY_SIZE];
+
+  mp4_split_options_fragment_query(options, "&", "&", query, sizeof(query));
+
+  ts_segment_init(&segment, mp4_context->moov, 0);
+  while(ts_segment_next(&segment))
+  {
+    double duration = ts_segment_duration(&segment);
+    if(duration > 0.0)
+    {
+      // account for the transport stream packet headers
+      double bitrate = ts_segment_bytes(&segment) * 8.0 / duration *
+                       TS_PACKET_SIZE / TS_PAYLOAD_SIZE;
+      if(bitrate > peak_bitrate)
+      {
+        peak_bitrate = bitrate;
+      }
+    }
+  }
+
+  p += sprintf(p, "#EXT-X-STREAM-INF:BANDWIDTH=%u,CODECS=\"",
+               (unsigned int)peak_bitrate);
+  for(i = 0; i != segment.streams_; ++i)
+  {
+    if(i)
+    {
+      *p++ = ',';
+    }
+    p = trak_write_codecs(segment.stream_[i].trak_, p);
+  }
+  *p++ = '"';
+  if(segment.stream_[0].stream_type_ == 0x1b)
+  {
+    struct trak_t const* trak = segment.stream_[0].trak_;
+    p += sprintf(p, ",RESOLUTION=%ux%u",
+                 trak->tkhd_->width_ / 65536, trak->tkhd_->height_ / 65536);
+  }
+  p += sprintf(p, "\n%s?hls_playlist=1%s\n", filename, query);
+
+  return p;
+}
+
+// The I-frame playlist of the variant, with the keyframes of the video as
+// I-frame segments (see ts_segment_t)
+static char* m3u8_write_iframe_variant(struct mp4_context_t const* mp4_context,
+                                       struct mp4_split_options_t const* options,
+                                       char* p)
+{
+  struct ts_segment_t segment;
+  char const* filename = hls_basename(mp4_context->filename_);
+  struct trak_t const* trak;
+  unsigned int s;
+  double peak_bitrate = 0.0;
+  char query[MP4_FRAGMENT_QUERY_SIZE];
+
+  mp4_split_options_fragment_query(options, "&", "&", query, sizeof(query));
+
+  if(!ts_segment_init(&segment, mp4_context->moov, 1))
+  {
+    return p;
+  }
+
+  // the peak bitrate of an I-frame segment: a keyframe that lasts until the
+  // next keyframe, in a PAT, a PMT and PES packets that are padded to 16
+  // packets (see ts_write_pes)
+  trak = segment.stream_[0].trak_;
+  s = 0;
+  while(s != trak->samples_size_)
+  {
+    unsigned int next = s + 1;
+    while(next != trak->samples_size_ && !trak->samples_[next].is_ss_)
+    {
+      ++next;
+    }
+    if(trak->samples_[next].pts_ != trak->samples_[s].pts_)
+    {
+      double duration = (double)(trak->samples_[next].pts_ -
+                                 trak->samples_[s].pts_) /
+                        trak->mdia_->mdhd_->timescale_;
+      unsigned int packets = (TS_PES_HEADER_SIZE +
+        ts_sample_bound(&segment.stream_[0], s) + TS_PAYLOAD_SIZE - 1) /
+        TS_PAYLOAD_SIZE;
+      double bitrate = (2 + ((packets + 15) & ~15u)) * TS_PACKET_SIZE * 8.0 /
+                       duration;
+      if(bitrate > peak_bitrate)
+      {
+        peak_bitrate = bitrate;
+      }
+    }
+    s = next;
+  }
+
+  p += sprintf(p, "#EXT-X-I-FRAME-STREAM-INF:BANDWIDTH=%u,CODECS=\"",
+               (unsigned int)peak_bitrate);
+  p = trak_write_codecs(trak, p);
+  p += sprintf(p, "\",RESOLUTION=%ux%u",
+               trak->tkhd_->width_ / 65536, trak->tkhd_->height_ / 65536);
+  p += sprintf(p, ",URI=\"%s?hls_playlist=1&trickplay=1%s\"\n",
+               filename, query);
+
+  return p;
+}
+
+extern int mp4_create_m3u8(struct mp4_context_t** mp4_context,
+                           unsigned int mp4_contexts,
+                           struct bucket_t** buckets,
+                           struct mp4_split_options_t const* options)
+{
+  size_t buffer_size = 4096;
+  unsigned int file;
+  char* buffer;
+  char* p;
+  // the variants (and their I-frame playlists) are described from the full
+  // index, a single media playlist with trick play is the I-frame playlist
+  struct mp4_split_options_t index_options = *options;
+  if(mp4_contexts != 1)
+  {
+    index_options.trickplay = 0;
+  }
+
+  for(file = 0; file != mp4_contexts; ++file)
+  {
+    struct mp4_context_t const* context = mp4_context[file];
+    struct moov_t const* moov = context->moov;
+    unsigned int track;
+    struct ts_segment_t segment;
+
+    if(!moov_build_index(context, context->moov, &index_options))
+    {
+      return 0;
+    }
+    if(!ts_segment_init(&segment, moov, index_options.trickplay))
+    {
+      struct mp4_context_t const* mp4_context = context;
+      MP4_ERROR("%s", "No H.264 or AAC track for a transport stream\n");
+      return 0;
+    }
+
+    // at most one segment per sample
+    for(track = 0; track != moov->tracks_; ++track)
+    {
+      buffer_size += (128 + MP4_FRAGMENT_QUERY_SIZE +
+                      strlen(context->filename_)) *
+                     moov->traks_[track]->samples_size_;
+    }
+  }
+
+  buffer = (char*)malloc(buffer_size);
+  p = buffer;
+
+  if(mp4_contexts == 1)
+  {
+    p = m3u8_write_media_playlist(mp4_context[0], options, p);
+  }
+  else
+  {
+    p += sprintf(p, "#EXTM3U\n");
+    for(file = 0; file != mp4_contexts; ++file)
+    {
+      p = m3u8_write_variant(mp4_context[file], options, p);
+    }
+    if(options->trickplay)
+    {
+      for(file = 0; file != mp4_contexts; ++file)
+      {
+        p = m3u8_write_iframe_variant(mp4_context[file], options, p);
+      }
+    }
+  }
+
+  bucket_insert_tail(buckets, bucket_init_owned(buffer, p - buffer));
+
+  return 1;
+}
+
+// End Of File
+
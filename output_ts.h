@@ -0,0 +1,48 @@
+/*******************************************************************************
+ output_ts.h - A library for writing MPEG2 Transport Streams (HLS).
+
+ Copyright (C) 2009 CodeShop B.V.
+ http://www.code-shop.com
+
+ For licensing see the LICENSE file
+******************************************************************************/
+
+#ifndef OUTPUT_TS_H_AKW
+#define OUTPUT_TS_H_AKW
+
+#include "mod_streaming_export.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HAVE_OUTPUT_TS
+
+struct mp4_context_t;
+struct bucket_t;
+struct mp4_split_options_t;
+
+// The .ts segment options->hls_segment (numbered from 0)
+
+MOD_STREAMING_DLL_LOCAL extern
+int output_ts_segment(struct mp4_context_t const* mp4_context,
+                      struct bucket_t** buckets,
+                      struct mp4_split_options_t const* options);
+
+// Playlist generation. A media playlist for a single file, a master playlist
+// with a variant for every file otherwise.
+
+MOD_STREAMING_DLL_LOCAL extern
+int mp4_create_m3u8(struct mp4_context_t** mp4_context,
+                    unsigned int mp4_contexts,
+                    struct bucket_t** buckets,
+                    struct mp4_split_options_t const* options);
+
+#ifdef __cplusplus
+} /* extern C definitions */
+#endif
+
+#endif // OUTPUT_TS_H_AKW
+
+// End Of File
+
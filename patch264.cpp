@@ -37,6 +37,7 @@
 #include "output_mp4.h"
 #include "output_ismv.h"
 #include "output_flv.h"
+#include "output_ts.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,30 +46,30 @@
 #include "pgetopt.c"
 
 #ifdef WIN32
+#include <windows.h>
 #define stat _stat64
 #define strdup _strdup
+#else
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
 namespace // anonymous
 {
 
-#if 0
 uint64_t atoi64(const char* p)
 {
 #ifdef WIN32
   return _atoi64(p);
 #else
-  return atol(p);
-#endif
-}
+  return strtoull(p, NULL, 10);
 #endif
-
-uint64_t get_filesize(const char *path)
-{
-  struct stat status;
-  if(stat(path, &status))
-    perror("get_file_length stat:");
-  return status.st_size;
 }
 
 #define COPY_BUFFER_SIZE 4096
@@ -98,6 +99,341 @@ int copy_data(FILE* infile, FILE* outfile, uint64_t size)
   return 1;
 }
 
+#ifdef __linux__
+// The block size of the file systems that clone extents (e.g. btrfs, XFS)
+#define CLONE_BLOCK_SIZE 4096
+
+// Copies the range [offset, offset + size> of the input file to the output
+// file in the kernel. The whole blocks are cloned (a reflink) when the file
+// system supports it and input and output are equally aligned, the rest is
+// copied with copy_file_range. Returns the number of bytes copied, which is
+// less than size when the kernel can't copy between the files.
+uint64_t copy_file_data(FILE* infile, FILE* outfile,
+                        uint64_t offset, uint64_t size)
+{
+  int in = fileno(infile);
+  int out = fileno(outfile);
+  fflush(outfile);
+  off_t out_start = lseek(out, 0, SEEK_CUR);
+  loff_t in_pos = offset;
+  loff_t out_pos = out_start;
+  uint64_t done = 0;
+
+  if(out_start < 0)
+  {
+    return 0;
+  }
+
+#ifdef FICLONERANGE
+  if(((offset ^ (uint64_t)out_start) & (CLONE_BLOCK_SIZE - 1)) == 0)
+  {
+    uint64_t head = (CLONE_BLOCK_SIZE - (offset & (CLONE_BLOCK_SIZE - 1))) &
+                    (CLONE_BLOCK_SIZE - 1);
+    if(head < size && size - head >= CLONE_BLOCK_SIZE)
+    {
+      struct file_clone_range range;
+      range.src_fd = in;
+      range.src_offset = offset + head;
+      range.src_length = (size - head) & ~(uint64_t)(CLONE_BLOCK_SIZE - 1);
+      range.dest_offset = out_start + head;
+      if(ioctl(out, FICLONERANGE, &range) == 0)
+      {
+        // copy the head, then continue after the cloned blocks
+        while(done != head)
+        {
+          ssize_t bytes = copy_file_range(in, &in_pos, out, &out_pos,
+                                          head - done, 0);
+          if(bytes <= 0)
+          {
+            break;
+          }
+          done += bytes;
+        }
+        if(done == head)
+        {
+          done += range.src_length;
+          in_pos = offset + done;
+          out_pos = out_start + done;
+        }
+        else
+        {
+          // the caller copies the head, the clone is overwritten
+          done = 0;
+          in_pos = offset;
+          out_pos = out_start;
+        }
+      }
+    }
+  }
+#endif
+
+  while(done != size)
+  {
+    ssize_t bytes = copy_file_range(in, &in_pos, out, &out_pos,
+                                    size - done, 0);
+    if(bytes <= 0)
+    {
+      // e.g. EXDEV or ENOSYS
+      break;
+    }
+    done += bytes;
+  }
+
+  lseek(out, out_start + done, SEEK_SET);
+  fseeko(outfile, out_start + done, SEEK_SET);
+
+  return done;
+}
+#endif
+
+int write_iovec(FILE* infile, FILE* outfile, struct bucket_iovec_t const* iov)
+{
+  switch(iov->type_)
+  {
+  case BUCKET_TYPE_MEMORY:
+    return fwrite(iov->base_, (off_t)iov->size_, 1, outfile) == 1;
+  case BUCKET_TYPE_FILE:
+    {
+      uint64_t done = 0;
+#ifdef __linux__
+      done = copy_file_data(infile, outfile, iov->offset_, iov->size_);
+#endif
+      if(_fseeki64(infile, iov->offset_ + done, SEEK_SET) != 0)
+      {
+        return 0;
+      }
+      return copy_data(infile, outfile, iov->size_ - done);
+    }
+  }
+
+  return 0;
+}
+
+// a monotonic clock in milliseconds
+uint64_t clock_ms()
+{
+#ifdef WIN32
+  return GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void sleep_ms(unsigned int ms)
+{
+#ifdef WIN32
+  Sleep(ms);
+#else
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+struct output_sink_t
+{
+  FILE* infile;
+  FILE* outfile;
+  mp4_split_options_t const* options;
+  // the output position and the time the output started (for pacing)
+  uint64_t filepos;
+  uint64_t start_ms;
+};
+
+#define PACE_BLOCK_SIZE 65536
+
+// Writes the bucket, in blocks that are held back until the media time they
+// are needed for (see mp4_pace_delay)
+int paced_write(output_sink_t* sink, struct bucket_iovec_t const* iov)
+{
+  if(sink->options->pace <= 0.0f || sink->options->byte_offsets == NULL)
+  {
+    sink->filepos += iov->size_;
+    return write_iovec(sink->infile, sink->outfile, iov);
+  }
+
+  if(sink->filepos == 0)
+  {
+    sink->start_ms = clock_ms();
+  }
+
+  struct bucket_iovec_t block = *iov;
+  uint64_t done = 0;
+  while(done != iov->size_)
+  {
+    block.size_ = iov->size_ - done;
+    if(block.size_ > PACE_BLOCK_SIZE)
+    {
+      block.size_ = PACE_BLOCK_SIZE;
+    }
+    if(iov->type_ == BUCKET_TYPE_MEMORY)
+    {
+      block.base_ = (unsigned char const*)iov->base_ + done;
+    }
+    else
+    {
+      block.offset_ = iov->offset_ + done;
+    }
+
+    unsigned int delay = mp4_pace_delay(sink->options,
+                                        sink->filepos + block.size_,
+                                        clock_ms() - sink->start_ms);
+    if(delay)
+    {
+      // flush what's been written so far before waiting
+      fflush(sink->outfile);
+      sleep_ms(delay);
+    }
+
+    if(!write_iovec(sink->infile, sink->outfile, &block))
+    {
+      return 0;
+    }
+    sink->filepos += block.size_;
+    done += block.size_;
+  }
+
+  return 1;
+}
+
+// Writes the chunks to the output file as soon as they are created
+int output_sink(void* arg, struct bucket_t* buckets)
+{
+  output_sink_t* sink = (output_sink_t*)arg;
+  struct bucket_iovec_t* iov;
+  uint64_t size;
+  buckets_coalesce(&buckets);
+  unsigned int iovs = buckets_iovec(buckets, &iov, &size);
+  int result = 1;
+  for(unsigned int i = 0; i != iovs && result; ++i)
+  {
+    result = paced_write(sink, &iov[i]);
+  }
+  free(iov);
+
+  if(result)
+  {
+    fflush(sink->outfile);
+  }
+
+  buckets_exit(buckets);
+
+  return result;
+}
+
+// Outputs only the bytes first-last (inclusive, as in an HTTP Range request,
+// to the end when last is left out) of the MP4 file. Only the header of the
+// file is built, the samples are referenced as ranges of the input file.
+int output_mp4_range(struct mp4_context_t* mp4_context,
+                     unsigned int const* trak_sample_start,
+                     unsigned int const* trak_sample_end,
+                     char const* range,
+                     struct bucket_t** buckets,
+                     struct mp4_split_options_t* options)
+{
+  struct mp4_output_layout_t* layout =
+    mp4_output_layout_init(mp4_context, trak_sample_start, trak_sample_end,
+                           options);
+  if(layout == NULL)
+  {
+    return 0;
+  }
+
+  uint64_t total = mp4_output_size(layout);
+  uint64_t first = atoi64(range);
+  char const* dash = strchr(range, '-');
+  uint64_t last = total - 1;
+  if(dash && dash[1] && atoi64(dash + 1) < last)
+  {
+    last = atoi64(dash + 1);
+  }
+
+  int result = 0;
+  if(first >= total || first > last)
+  {
+    printf("[Error] range %s is not satisfiable (%llu bytes)\n",
+           range, total);
+  }
+  else
+  {
+    struct bucket_iovec_t* iov;
+    unsigned int iovs =
+      mp4_output_range(layout, first, last - first + 1, &iov);
+    printf("range bytes %llu-%llu/%llu\n", first, last, total);
+    for(unsigned int i = 0; i != iovs; ++i)
+    {
+      bucket_insert_tail(buckets, iov[i].type_ == BUCKET_TYPE_MEMORY ?
+        bucket_init_memory(iov[i].base_, iov[i].size_) :
+        bucket_init_file(iov[i].offset_, iov[i].size_));
+    }
+    free(iov);
+    result = 1;
+  }
+  mp4_output_layout_exit(layout);
+
+  return result;
+}
+
+// Writes the moov into a free atom in front of the media data and turns the
+// old moov into a free atom. The media data stays where it is.
+int faststart_inplace(char const* filename, struct mp4_context_t* mp4_context)
+{
+  uint64_t offset = 0;
+  struct bucket_t* buckets = 0;
+  if(!mp4_faststart_inplace(mp4_context, &offset, &buckets))
+  {
+    return 0;
+  }
+  if(buckets == NULL)
+  {
+    printf("%s already starts with the moov\n", filename);
+    return 1;
+  }
+
+  int result = 0;
+  FILE* file = fopen(filename, "r+b");
+  if(file == NULL)
+  {
+    perror(filename);
+  }
+  else
+  {
+    struct bucket_iovec_t* iov;
+    uint64_t size;
+    unsigned int iovs = buckets_iovec(buckets, &iov, &size);
+    result = _fseeki64(file, offset, SEEK_SET) == 0;
+    for(unsigned int i = 0; i != iovs && result; ++i)
+    {
+      result = write_iovec(NULL, file, &iov[i]);
+    }
+    free(iov);
+
+    // the new moov is complete before the old one is given up
+    if(result)
+    {
+      static char const free_type[4] = { 'f', 'r', 'e', 'e' };
+      result = fflush(file) == 0 &&
+               _fseeki64(file, mp4_context->moov_atom.start_ + 4,
+                         SEEK_SET) == 0 &&
+               fwrite(free_type, sizeof(free_type), 1, file) == 1;
+    }
+    if(fclose(file) != 0)
+    {
+      result = 0;
+    }
+    if(!result)
+    {
+      printf("Error: writing file %s\n", filename);
+    }
+  }
+  buckets_exit(buckets);
+
+  return result;
+}
+
 } // anonymous
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -106,7 +442,11 @@ int main(int argc, char *argv[])
 {
   char* input_file = 0;
   char* output_file = 0;
+  char* cache_file = 0;
+  char* range = 0;
   int verbose = 1;
+  unsigned int threads = 1;
+  bool faststart = false;
 
   FILE* infile = 0;
   FILE* outfile = 0;
@@ -123,7 +463,7 @@ int main(int argc, char *argv[])
 
   int c;
   bool show_usage = false;
-  char *opt = "i:o:v:";
+  char *opt = "i:o:v:t:c:fr:";
   while(((c = pgetopt(argc, argv, opt)) != EOF) && !show_usage)
   {
     switch (c)
@@ -137,6 +477,26 @@ int main(int argc, char *argv[])
       case 'v':
         verbose = atoi(poptarg);
         break;
+      case 't':
+        {
+          int value = atoi(poptarg);
+          if(value < 1)
+          {
+            printf("[Error] invalid number of threads %s\n", poptarg);
+            return 1;
+          }
+          threads = value < MAX_THREADS ? value : MAX_THREADS;
+        }
+        break;
+      case 'c':
+        cache_file = poptarg;
+        break;
+      case 'f':
+        faststart = true;
+        break;
+      case 'r':
+        range = poptarg;
+        break;
       default:
         show_usage = true;
         return 0;
@@ -149,15 +509,44 @@ int main(int argc, char *argv[])
     printf(
     " -i infile                 MP4 input file and parameters\n"
     "    infile.mp4/manifest    output the SmoothStreaming manifest\n"
+    "    infile.mp4/manifest?manifest_version=2  compact (v2.2) manifest\n"
     "    infile.mp4?start=100.0 output video starting at 01:40\n"
     "    infile.mp4?end=20.0    output first 20 seconds of video\n"
+    "    infile.mp4?start=9.5&precise=1  start exactly at 9.5s (edit list)\n"
     "    infile.mp4?(video=0)   output MP4 fragment\n"
+    "    infile.mp4?interleave=1  interleave the tracks (.ismv or .mp4)\n"
+    "    infile.mp4?fragment_duration=4.0  target fragment duration\n"
+    "    infile.mp4?min_fragment_duration=2.0  minimum fragment duration\n"
+    "    infile.mp4?sidx=1      add a segment index (with -o file.ismv)\n"
+    "    infile.mp4/manifest    with -o file.mpd, output the DASH MPD\n"
+    "    infile.mp4?cmaf_init=1 output the CMAF init segment of track 1\n"
+    "    infile.mp4?cmaf_segment=1&cmaf_time=0  output a CMAF segment\n"
+    "    infile.mp4/manifest    with -o file.m3u8, output the HLS playlist\n"
+    "    infile.mp4/manifest    with -o file.csv, output the track bitrates\n"
+    "    infile.mp4?hls_segment=0  output the first HLS (.ts) segment\n"
+    "    infile.mp4?(video=0)&chunk_duration=0.5  output fragment in chunks\n"
+    "    infile.mp4?tracks=audio  output only the audio (or tracks=1,2)\n"
+    "    infile.mp4?trickplay=1 output only the keyframes of the video (adds\n"
+    "                           a trick mode set to the DASH MPD and I-frame\n"
+    "                           playlists to the HLS master playlist)\n"
+    "    infile.mp4?cmov=1      compress the moov (not for Flash players)\n"
+    "    infile.mp4?pace=1.25&burst=10  write at 1.25x the media rate after\n"
+    "                           the first 10 seconds\n"
     " [-o outfile]              output file\n"
 //    " [-o outfile]              output file, defaults to:\n"
 //    "    infile.ism             for server manifest files\n"
 //    "    infile.ismc            for client manifest files\n"
 //    "    infile.h264            for raw output\n"
     " [-v level]                0=quiet 1=error 2=warning 3=info\n"
+    " [-t threads]              worker threads for fragmenting (.ismv), at\n"
+    "                           most 64\n"
+    " [-c cachefile]            reuse manifests while the files are unchanged\n"
+    "                           (and compressed moovs with cmov=1)\n"
+    " [-f]                      fast start: move the moov in front of the\n"
+    "                           media data (in place, into a free atom, when\n"
+    "                           there is no outfile)\n"
+    " [-r first-last]           output only the bytes first-last of the MP4\n"
+    "                           file (to the end without last)\n"
     "\n");
      return 0;
   }
@@ -171,14 +560,15 @@ int main(int argc, char *argv[])
 
   int result = 1;
   struct mp4_split_options_t* options = mp4_split_options_init();
+  options->threads = threads > 0 ? threads : 1;
 
   if(ends_with(input_file, "/manifest"))
   {
     options->manifest = 1;
     input_file[strlen(input_file) - sizeof("/manifest") + 1] = '\0';
-    printf("Creating manifest file (%s) for %s\n", output_file, input_file);
   }
-  else if(query_params)
+
+  if(query_params)
   {
     result = mp4_split_options_set(options, query_params, strlen(query_params));
 
@@ -186,29 +576,28 @@ int main(int argc, char *argv[])
     {
       printf("Error reading query parameters for %s\n", query_params);
     }
+  }
+
+  if(result && (query_params || options->manifest))
+  {
+    if(options->fragments)
+    {
+      printf("Creating MP4 fragment (%s) for %s\n", output_file, input_file);
+    }
     else
+    if(options->manifest)
     {
-      if(options->fragments)
-      {
-        printf("Creating MP4 fragment (%s) for %s\n", output_file, input_file);
-      }
-      else
-      if(options->manifest)
-      {
-        printf("Creating manifest file (%s) for %s\n", output_file, input_file);
-      }
-      else
-      {
-        printf("Creating MP4 file (%s) for %s [%.2f-%.2f>\n",
-          output_file, input_file, options->start, options->end);
-      }
+      printf("Creating manifest file (%s) for %s\n", output_file, input_file);
+    }
+    else
+    {
+      printf("Creating MP4 file (%s) for %s [%.2f-%.2f>\n",
+        output_file, input_file, options->start, options->end);
     }
   }
 
-#define MAX_FILES 8
-
   unsigned int files = 0;
-  struct mp4_files_t filespecs[MAX_FILES];
+  struct mp4_files_t* filespecs = NULL;
 
   if(result)
   {
@@ -226,14 +615,19 @@ int main(int argc, char *argv[])
 
       if(infile && (file_stat.st_mode & S_IFMT) == S_IFREG)
       {
+        filespecs = (struct mp4_files_t*)malloc(sizeof(struct mp4_files_t));
         filespecs[files].name_ = strdup(input_file);
         ++files;
+        mp4_stat_files(filespecs, files);
       } else
       if(options->manifest && (file_stat.st_mode & S_IFMT) == S_IFDIR)
       {
         // the name is 'video.mp4'. Scan the directory ./video.ism/video_*.ismv
-        files = MAX_FILES;
-        mp4_scanfiles(input_file, &files, filespecs);
+        mp4_scanfiles(input_file, &files, &filespecs);
+        if(!mp4_stat_files(filespecs, files))
+        {
+          perror("stat:");
+        }
       } else
       if((file_stat.st_mode & S_IFMT) != S_IFREG)
       {
@@ -276,6 +670,14 @@ int main(int argc, char *argv[])
     }
   }
 
+  // in chunked mode the chunks are written as soon as they are created
+  output_sink_t sink = { infile, outfile, options, 0, 0 };
+  if(result && outfile && options->chunk_duration > 0.0f)
+  {
+    options->sink = output_sink;
+    options->sink_arg = &sink;
+  }
+
   if(result)
   {
     options->client_is_flash = 1;
@@ -285,31 +687,124 @@ int main(int argc, char *argv[])
 
     printf("found %u files\n", files);
 
-    struct mp4_context_t* mp4_context[MAX_FILES];
+    // manifests are reused while the renditions are unchanged. The output
+    // extension and the query select the variant.
+    struct manifest_cache_t* manifest_cache = 0;
+    char* variant = 0;
+    char etag[MANIFEST_CACHE_ETAG_SIZE];
+    bool cached = false;
+    if(cache_file && options->manifest && output_file)
+    {
+      char const* ext = strrchr(output_file, '.');
+      char const* query = query_params ? query_params : "";
+      if(ext == NULL)
+      {
+        ext = "";
+      }
+      variant = (char*)malloc(strlen(ext) + strlen(query) + 2);
+      sprintf(variant, "%s?%s", ext, query);
+
+      manifest_cache = manifest_cache_init(64);
+      manifest_cache_load(manifest_cache, cache_file);
+      cached = manifest_cache_get(manifest_cache, variant, filespecs, files,
+                                  &buckets, etag) != 0;
+      if(cached)
+      {
+        printf("manifest from cache (ETag: %s)\n", etag);
+      }
+    }
+
+    // the compressed moov is reused while the clip and the cut are unchanged
+    struct manifest_cache_t* moov_cache = 0;
+    if(cache_file && options->compress_moov && !options->manifest)
+    {
+      moov_cache = manifest_cache_init(64);
+      manifest_cache_load(moov_cache, cache_file);
+      options->moov_cache = moov_cache;
+    }
+
+    // the renditions are opened in parallel
+    struct mp4_context_t** mp4_context = (struct mp4_context_t**)
+      malloc((files ? files : 1) * sizeof(struct mp4_context_t*));
     for(unsigned int file = 0; file != files; ++file)
     {
-      uint64_t filesize = get_filesize(filespecs[file].name_);
-      int mfra_only = options->fragments;
-      mp4_context[file] = mp4_open(filespecs[file].name_,
-                                   filesize, mfra_only, verbose);
-      if(mp4_context[file] == NULL)
+      mp4_context[file] = NULL;
+    }
+    int mfra_only = options->fragments;
+    if(!cached && !mp4_open_files(filespecs, files, mfra_only, verbose,
+                                  options->threads, mp4_context))
+    {
+      for(unsigned int file = 0; file != files; ++file)
       {
-        printf("[Error] opening file %s\n", filespecs[file].name_);
-        result = 0;
-        break;
+        if(mp4_context[file] == NULL)
+        {
+          printf("[Error] opening file %s\n", filespecs[file].name_);
+        }
       }
+      result = 0;
     }
 
-    if(result)
+    if(result && !cached)
     {
-      if(fragment_file)
+      if(faststart)
+      {
+        if(outfile)
+        {
+          printf("Creating fast start file (%s) for %s\n",
+                 output_file, input_file);
+          result = mp4_faststart(mp4_context[0], &buckets);
+        }
+        else
+        {
+          printf("Fast start in place for %s\n", input_file);
+          result = faststart_inplace(input_file, mp4_context[0]);
+        }
+      }
+      else if(fragment_file)
+      {
+        result = mp4_fragment_file(mp4_context[0], &buckets, options);
+      }
+      else if(options->manifest &&
+              (options->hls_playlist ||
+               (output_file && ends_with(output_file, ".m3u8"))))
+      {
+        // create the HLS playlist (media playlist, or master playlist for
+        // multiple files)
+        result = mp4_create_m3u8(&mp4_context[0], files, &buckets, options);
+      }
+      else if(options->manifest && output_file &&
+              ends_with(output_file, ".mpd"))
+      {
+        // create MPD for DASH (CMAF segments)
+        result = mp4_create_mpd(&mp4_context[0], files, &buckets, options);
+      }
+      else if(options->manifest && output_file &&
+              ends_with(output_file, ".csv"))
       {
-        mp4_fragment_file(mp4_context[0], &buckets, options);
+        // the measured bitrates of every track
+        result = mp4_create_bitrates(&mp4_context[0], files, &buckets,
+                                     options);
       }
       else if(options->manifest)
       {
         // create manifest file for smooth streaming
-        result = mp4_create_manifest(&mp4_context[0], files, &buckets);
+        result = mp4_create_manifest(&mp4_context[0], files, &buckets,
+                                     options);
+      }
+      else if(options->hls_segment >= 0)
+      {
+        result = output_ts_segment(mp4_context[0], &buckets, options);
+      }
+      else if(options->cmaf_track_id)
+      {
+        if(options->cmaf_init)
+        {
+          result = output_cmaf_init(mp4_context[0], &buckets, options);
+        }
+        else
+        {
+          result = output_cmaf_segment(mp4_context[0], &buckets, options);
+        }
       }
       else
       {
@@ -345,6 +840,13 @@ int main(int argc, char *argv[])
                                   trak_sample_end,
                                   &buckets, options);
             }
+            else if(options->output_format == OUTPUT_FORMAT_MP4 && range)
+            {
+              result = output_mp4_range(mp4_context[0],
+                                        trak_sample_start,
+                                        trak_sample_end,
+                                        range, &buckets, options);
+            }
             else if(options->output_format == OUTPUT_FORMAT_MP4)
             {
               result = output_mp4(mp4_context[0],
@@ -364,50 +866,57 @@ int main(int argc, char *argv[])
         mp4_close(mp4_context[file]);
       }
     }
+    free(mp4_context);
+
+    if(manifest_cache)
+    {
+      if(result && !cached &&
+         manifest_cache_put(manifest_cache, variant, filespecs, files,
+                            buckets, etag))
+      {
+        printf("manifest cached (ETag: %s)\n", etag);
+        if(!manifest_cache_save(manifest_cache, cache_file))
+        {
+          printf("[Error] writing cache file %s\n", cache_file);
+        }
+      }
+      manifest_cache_exit(manifest_cache);
+      free(variant);
+    }
+
+    if(moov_cache)
+    {
+      if(result && !manifest_cache_save(moov_cache, cache_file))
+      {
+        printf("[Error] writing cache file %s\n", cache_file);
+      }
+      options->moov_cache = 0;
+      manifest_cache_exit(moov_cache);
+    }
 
     if(result)
     {
-      for(int second = 0; second != options->seconds; ++second)
+      if(options->pace > 0.0f && options->byte_offsets)
       {
-//        printf("%" PRIu64 ", ", options->byte_offsets[second]);
+        printf("pacing at %.2fx the media rate after a %.2fs burst\n",
+               options->pace, options->burst);
       }
 
       if(outfile)
       {
-        struct bucket_t* bucket = buckets;
-        uint64_t filesize = 0;
-        int bucket_count = 0;
-        if(bucket)
+        struct bucket_iovec_t* iov;
+        uint64_t filesize;
+        buckets_coalesce(&buckets);
+        unsigned int bucket_count = buckets_iovec(buckets, &iov, &filesize);
+        if(bucket_count)
         {
-          do
-          {
-            filesize += bucket->size_;
-            bucket = bucket->next_;
-            ++bucket_count;
-          } while(bucket != buckets && result);
-
-          struct bucket_t* bucket = buckets;
           printf("writing %u buckets for a total of %llu KBytes:\n", bucket_count, filesize >> 10);
           uint64_t filepos = 0;
-          do
+          for(unsigned int i = 0; i != bucket_count && result; ++i)
           {
-            switch(bucket->type_)
-            {
-            case BUCKET_TYPE_MEMORY:
-//              printf("memory (%"PRIu64"), ", bucket->size_);
-              if(fwrite(bucket->buf_, (off_t)bucket->size_, 1, outfile) != 1)
-              {
-                result = 0;
-              }
-              break;
-            case BUCKET_TYPE_FILE:
-//              printf("file (%"PRIu64"), ", bucket->size_);
-              _fseeki64(infile, bucket->offset_, SEEK_SET);
-              result = copy_data(infile, outfile, bucket->size_);
-              break;
-            }
+            result = paced_write(&sink, &iov[i]);
 
-            filepos += bucket->size_;
+            filepos += iov[i].size_;
             static char const* progress0 =
               "======================================================================";
             static char const* progress1 =
@@ -417,10 +926,9 @@ int main(int argc, char *argv[])
                    (unsigned int)(100 * filepos / filesize),
                    done, progress0,
                    70 - done, progress1);
-
-            bucket = bucket->next_;
-          } while(bucket != buckets && result);
+          }
         }
+        free(iov);
         printf("\n");
       }
     }
@@ -439,6 +947,7 @@ int main(int argc, char *argv[])
   {
     free(filespecs[file].name_);
   }
+  free(filespecs);
 
   mp4_split_options_exit(options);
 